@@ -0,0 +1,342 @@
+/* Throughput benchmark for the C core.
+**
+** Generates random, caterpillar and balanced binary trees and times
+** reading and writing their Newick strings, building a phylogeny with
+** phy_build, full cursor traversals, phy_extract_subtree, phy_node_mrca
+** and phy_ages. Each operation reports the best of reps runs and the peak
+** resident memory of the process so far. Build from the package root with
+**
+**   cc -O2 -Isrc bench/bench.c src/phy.c -o bench -lm
+**
+** adding -DPHY_STATS to also report the library's allocation, visit and
+** parse counters for the last run of each operation, and run as
+**
+**   ./bench [random|caterpillar|balanced|all] [ntip] [reps]
+**
+** Without ntip every size from 10^3 to 10^7 tips is run; the largest
+** needs about 6 GB of memory.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "phy.h"
+
+#define RANDOM 0
+#define CATERPILLAR 1
+#define BALANCED 2
+
+static const char *shapes[] = {"random", "caterpillar", "balanced"};
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Peak resident memory in MB
+static double peak(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss / 1e6;
+#else
+    return ru.ru_maxrss / 1e3;
+#endif
+}
+
+
+struct buf {
+    size_t n;
+    size_t nalloc;
+    char *z;
+};
+
+
+static void emit(struct buf *b, const char *fmt, int i, double x)
+{
+    if (b->nalloc - b->n < 64)
+    {
+        b->nalloc = 2 * b->nalloc + 64;
+        b->z = realloc(b->z, b->nalloc);
+        if (!b->z)
+        {
+            fprintf(stderr, "cannot allocate memory\n");
+            exit(1);
+        }
+    }
+    if (i < 0)
+        b->n += sprintf(b->z + b->n, fmt, x);
+    else
+        b->n += sprintf(b->z + b->n, fmt, i, x);
+}
+
+
+/* A Newick string for a tree of the given shape. The tree is written
+** with an explicit stack, as a caterpillar is as deep as it has tips. */
+static char *make_tree(int shape, int ntip, size_t *len)
+{
+    struct frame { int k; int left; int state; } *stack;
+    struct frame *f;
+    struct buf b = {0, 0, NULL};
+    int sp = 0;
+    int label = 0;
+
+    stack = malloc(ntip * sizeof(struct frame));
+    stack[sp++] = (struct frame){ntip, 0, 0};
+    while (sp)
+    {
+        f = stack + sp - 1;
+        if (f->k == 1)
+        {
+            emit(&b, "t%d:%.10g", label++, rand() / (double)RAND_MAX);
+            sp--;
+            continue;
+        }
+        switch (f->state++)
+        {
+            case 0:
+                if (shape == RANDOM)
+                    f->left = 1 + rand() % (f->k - 1);
+                else if (shape == CATERPILLAR)
+                    f->left = 1;
+                else
+                    f->left = f->k / 2;
+                emit(&b, "(", -1, 0);
+                stack[sp++] = (struct frame){f->left, 0, 0};
+                break;
+            case 1:
+                emit(&b, ",", -1, 0);
+                stack[sp++] = (struct frame){f->k - f->left, 0, 0};
+                break;
+            default:
+                emit(&b, "):%.10g", -1, rand() / (double)RAND_MAX);
+                sp--;
+                break;
+        }
+    }
+    emit(&b, ";", -1, 0);
+    free(stack);
+    *len = b.n;
+    return b.z;
+}
+
+
+// Start timing a call, with the library's counters cleared
+static double start(void)
+{
+    phy_stats_reset();
+    return now();
+}
+
+
+// The time since start, keeping the best of the runs so far and the
+// counters of the latest
+static void stop(double t, int i, double *best, struct phy_stats *stats)
+{
+    t = now() - t;
+    phy_stats(stats);
+    if (!i || t < *best)
+        *best = t;
+}
+
+
+static void report(
+    const char *shape, int ntip, const char *op, double t, double n,
+    const char *unit, const struct phy_stats *stats)
+{
+    printf("%-12s %9d  %-16s %10.3f ms %12.1f %-9s %8.1f MB",
+        shape, ntip, op, t * 1e3, n / t, unit, peak());
+#ifdef PHY_STATS
+    printf("  alloc %zu (%zu B) visit %zu parse %zu",
+        stats->nalloc, stats->nbyte, stats->nvisit, stats->nparse);
+#else
+    (void)stats;
+#endif
+    printf("\n");
+}
+
+
+// Keeps the compiler from discarding the loops that are timed
+static volatile double sink;
+
+
+static int run(int shape, int ntip, int reps)
+{
+    int i;
+    int j;
+    int k;
+    int ntip_sub;
+    int nquery;
+    int nnode = 2 * ntip - 1;
+    size_t len;
+    size_t wlen = 0;
+    double t;
+    double best[2] = {0, 0};
+    double sum = 0;
+    struct phy_stats stats[2];
+    char *z;
+    char *w;
+    const double *age;
+    const char *name = shapes[shape];
+    struct phy *phy = NULL;
+    struct phy *sub;
+    struct phy_node **node;
+    struct phy_node **tips;
+    struct phy_node *v;
+    struct phy_cursor cursor;
+
+    z = make_tree(shape, ntip, &len);
+
+    // a fresh tree for each run, so that ages are computed every time
+    for (i = 0; i < reps; ++i)
+    {
+        t = start();
+        phy = phy_read_newickstr(z);
+        stop(t, i, best, stats);
+        if (!phy)
+        {
+            fprintf(stderr, "%s\n", phy_errmsg());
+            return 1;
+        }
+        t = start();
+        age = phy_ages(phy);
+        stop(t, i, best + 1, stats + 1);
+        sum += age[0];
+        if (i < reps - 1)
+            phy_free(phy);
+    }
+    report(name, ntip, "read_newickstr", best[0], len / 1e6, "MB/s", stats);
+    report(name, ntip, "ages", best[1], nnode, "nodes/s", stats + 1);
+
+    for (i = 0; i < reps; ++i)
+    {
+        t = start();
+        w = phy_write_newickstr(phy);
+        stop(t, i, best, stats);
+        wlen = strlen(w);
+        free(w);
+    }
+    report(name, ntip, "write_newickstr", best[0], wlen / 1e6, "MB/s",
+        stats);
+
+    // copy the topology into unattached nodes for phy_build
+    node = malloc(nnode * sizeof(struct phy_node *));
+    for (i = 0; i < reps; ++i)
+    {
+        for (j = 0; j < nnode; ++j)
+        {
+            v = phy_node_get(phy, j);
+            phy_node_alloc(node + j);
+            phy_node_set_brlen(node[j], phy_node_brlen(v));
+        }
+        phy_cursor_prepare_v2(phy, phy_root(phy), &cursor, ALL_NODES,
+            PREORDER);
+        while ((v = phy_cursor_step(&cursor)) != 0)
+        {
+            if (phy_node_anc(v))
+                phy_node_add_child(node[phy_node_index(phy_node_anc(v))],
+                    node[phy_node_index(v)]);
+        }
+        t = start();
+        sub = phy_build(node[phy_node_index(phy_root(phy))], nnode, ntip);
+        stop(t, i, best, stats);
+        phy_free(sub);
+    }
+    report(name, ntip, "build", best[0], nnode, "nodes/s", stats);
+    free(node);
+
+    for (i = 0; i < reps; ++i)
+    {
+        t = start();
+        for (k = PREORDER; k <= POSTORDER; ++k)
+        {
+            phy_cursor_prepare_v2(phy, phy_root(phy), &cursor, ALL_NODES, k);
+            while ((v = phy_cursor_step(&cursor)) != 0)
+                sum += phy_node_brlen(v);
+        }
+        stop(t, i, best, stats);
+    }
+    report(name, ntip, "cursor", best[0], 2.0 * nnode, "nodes/s", stats);
+
+    // one tip chosen at random from each block of ten
+    ntip_sub = ntip / 10;
+    tips = malloc(ntip_sub * sizeof(struct phy_node *));
+    for (j = 0; j < ntip_sub; ++j)
+        tips[j] = phy_node_get(phy, 10 * j + rand() % 10);
+    for (i = 0; i < reps; ++i)
+    {
+        t = start();
+        sub = phy_extract_subtree(ntip_sub, tips, phy);
+        stop(t, i, best, stats);
+        phy_free(sub);
+    }
+    report(name, ntip, "extract_subtree", best[0], ntip_sub, "tips/s",
+        stats);
+    free(tips);
+
+    // each query walks up from a, so keep the total work near 10^8 steps
+    // on caterpillars, whose depth grows with ntip
+    nquery = shape == CATERPILLAR ? 100000000 / ntip + 10 : 100000;
+    for (i = 0; i < reps; ++i)
+    {
+        srand(7);
+        t = start();
+        for (j = 0; j < nquery; ++j)
+        {
+            v = phy_node_mrca(phy, phy_node_get(phy, rand() % ntip),
+                phy_node_get(phy, rand() % ntip));
+            sum += phy_node_index(v);
+        }
+        stop(t, i, best, stats);
+    }
+    report(name, ntip, "node_mrca", best[0], nquery, "queries/s", stats);
+
+    phy_free(phy);
+    free(z);
+    sink = sum;
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int s;
+    int ntip = argc > 2 ? atoi(argv[2]) : 0;
+    int reps = argc > 3 ? atoi(argv[3]) : 3;
+    int sizes[] = {1000, 10000, 100000, 1000000, 10000000};
+    const char *shape = argc > 1 ? argv[1] : "all";
+
+    if (reps < 1)
+    {
+        fprintf(stderr, "reps must be at least 1\n");
+        return 1;
+    }
+
+    srand(42);
+    printf("%-12s %9s  %-16s %13s %22s %11s\n",
+        "shape", "ntip", "operation", "best", "throughput", "peak");
+    for (s = RANDOM; s <= BALANCED; ++s)
+    {
+        if (strcmp(shape, "all") && strcmp(shape, shapes[s]))
+            continue;
+        if (ntip >= 20)
+        {
+            if (run(s, ntip, reps))
+                return 1;
+            continue;
+        }
+        for (i = 0; i < (int)(sizeof sizes / sizeof *sizes); ++i)
+        {
+            if (run(s, sizes[i], reps))
+                return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+/* Newick parse throughput benchmark.
+**
+** Builds a random binary tree, writes it to a Newick string with branch
+** lengths and then times repeated calls to phy_read_newickstr. Build from
+** the package root with
+**
+**   cc -O2 -Isrc bench/parse.c src/phy.c -o parse -lm
+**
+** and run as
+**
+**   ./parse [ntip] [reps]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "phy.h"
+
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+// Append a random tree with ntip tips to z and return the new length
+static size_t random_tree(char *z, size_t n, int ntip, int *label)
+{
+    int k;
+    if (ntip == 1)
+        return n + sprintf(z + n, "t%d:%.10g", (*label)++, rand() / (double)RAND_MAX);
+    k = 1 + rand() % (ntip - 1);
+    z[n++] = '(';
+    n = random_tree(z, n, k, label);
+    z[n++] = ',';
+    n = random_tree(z, n, ntip - k, label);
+    return n + sprintf(z + n, "):%.10g", rand() / (double)RAND_MAX);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int i;
+    int label = 0;
+    int ntip = argc > 1 ? atoi(argv[1]) : 500000;
+    int reps = argc > 2 ? atoi(argv[2]) : 5;
+    size_t n;
+    double t;
+    double best = 0;
+    char *z = malloc((size_t)ntip * 64);
+    struct phy *phy;
+
+    srand(42);
+    n = random_tree(z, 0, ntip, &label);
+    z[n++] = ';';
+    z[n] = 0;
+
+    for (i = 0; i < reps; ++i)
+    {
+        t = now();
+        phy = phy_read_newickstr(z);
+        t = now() - t;
+        if (!phy)
+        {
+            fprintf(stderr, "%s\n", phy_errmsg());
+            return 1;
+        }
+        phy_free(phy);
+        if (!i || t < best)
+            best = t;
+    }
+
+    printf("%d nodes, %.1f MB: best of %d %.3f s, %.1f MB/s\n",
+        2 * ntip - 1, n / 1e6, reps, best, n / 1e6 / best);
+
+    free(z);
+    return 0;
+}
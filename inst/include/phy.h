@@ -31,36 +31,222 @@ extern "C" {
 #define ALL_NODES 0
 #define INTERNAL_NODES_ONLY 1
 
+/* Types of tree rearrangement recorded in a struct phy_move. */
+#define PHY_NNI 0
+#define PHY_SPR 1
+#define PHY_TBR 2
+
+/* Drawing states of a node in a struct phy_layout. */
+#define PHY_LAYOUT_COLLAPSED 1
+#define PHY_LAYOUT_HIDDEN 2
+// set by phy_layout_cull
+#define PHY_LAYOUT_WEDGE 4
+#define PHY_LAYOUT_CULLED 8
+#define PHY_LAYOUT_NOEDGE 16
+
 #define PHY_OK 0
 #define PHY_ERR 1
 
 struct phy;
 struct phy_node;
-struct phy_cursor;
+struct phy_reader;
+struct phy_lca;
+struct phy_splits;
+
+/* Traversal state. The layout is public only so that a cursor can be
+** declared as an automatic variable; its members are private and are
+** set up by phy_cursor_prepare_v2.
+**
+**   struct phy_cursor cursor;
+**   phy_cursor_prepare_v2(phy, node, &cursor, ALL_NODES, PREORDER);
+**   while ((node = phy_cursor_step(&cursor)) != 0)
+**   {
+**       // perform some operations on node
+**   }
+*/
+struct phy_cursor {
+    int visit;
+    int order;
+    int cursor;
+    struct phy *phy;
+    struct phy_node *begin;
+    struct phy_node *end;
+    struct phy_node *next;
+};
+
+/* A read-only structure-of-arrays snapshot of a phylogeny. Every array
+** has nnode entries and, apart from preorder, is indexed by node index.
+** Missing relatives (the parent of the root, the first child of a
+** terminal node, the next sibling of a last child) are recorded as -1.
+** A postorder traversal is a reverse walk over preorder, e.g.
+**
+**   for (i = flat->nnode - 1; i >= 0; --i)
+**   {
+**       int node = flat->preorder[i];
+**       // all descendants of node have already been visited
+**   }
+**
+** The snapshot does not reflect changes made to the phylogeny after it
+** was taken. */
+struct phy_flat {
+    int nnode;
+    int ntip;
+    int root;
+    int *parent;
+    int *first_child;
+    int *next_sibling;
+    int *ndesc;
+    double *brlen;
+    // node ages as returned by phy_ages
+    double *age;
+    // node indices in preorder traversal sequence
+    int *preorder;
+};
+
+/* Coordinates for drawing a phylogeny, computed by phy_layout_new. Every
+** array has nnode entries indexed by node index. Coordinates do not depend
+** on the direction of the drawing: the depth axis measures node age and
+** the breadth axis places the terminal nodes at 0, 1, ..., ntip-1 in index
+** order, so a rectangular drawing maps the two axes to x and y (reversing
+** either as needed) and a circular drawing maps breadth to angle and depth
+** to radius.
+**
+** A collapsed clade is drawn as a wedge from its root to the terminal
+** nodes' span at the clade's reach, and its other nodes are hidden. Its
+** root keeps its place, so collapsing or expanding a clade leaves the
+** coordinates of every node outside it unchanged. */
+struct phy_layout {
+    int nnode;
+    int ntip;
+    int root;
+    // range of node ages
+    double minage;
+    double maxage;
+    // depth of each node and of the start of its branch
+    double *age;
+    double *base;
+    // breadth of each node: internal nodes sit midway between their first
+    // and last child
+    double *pos;
+    // breadth extent of the bar joining the children of an internal node
+    // (equal to pos for terminal nodes)
+    double *lo;
+    double *hi;
+    // largest age in the clade of each node
+    double *reach;
+    // parent of each node (-1 for the root)
+    int *parent;
+    // indices of the first and last terminal node in each clade
+    int *first;
+    int *last;
+    // number of nodes in each clade
+    int *size;
+    // PHY_LAYOUT_* flags of each node
+    unsigned char *state;
+};
+
+/* Record of a tree rearrangement made by phy_nni, phy_spr or phy_tbr that
+** allows phy_move_undo to reverse it. Apart from type, the fields are for
+** the library's use only. */
+struct phy_move {
+    int type;
+    int first;
+    struct phy_node *node[6];
+    double brlen[6];
+};
+
+/* Counters of the work done by the library, read with phy_stats. They are
+** only kept when the package is compiled with PHY_STATS defined (for
+** instance PKG_CPPFLAGS=-DPHY_STATS) and are otherwise always zero. */
+struct phy_stats {
+    // calls to malloc, calloc and realloc, and the bytes they requested
+    size_t nalloc;
+    size_t nbyte;
+    // nodes returned by cursors and renumbered when indices are refreshed
+    size_t nvisit;
+    // bytes of Newick text parsed
+    size_t nparse;
+};
 
 // Allocate a new node. Return 0 on success, 1 on failure.
 int phy_node_alloc(struct phy_node **node);
 
-// Free an allocated node.
+// Free an allocated node. Nodes of a phylogeny built from a Newick string
+// are stored in a single block owned by that phylogeny, so for those only
+// the client data and any label set with phy_node_set_label are released
+// here; the storage itself is released by phy_free.
 void phy_node_free(struct phy_node *node);
 
 // Add q to p's list of immediate descendants.
 void phy_node_add_child(struct phy_node *p, struct phy_node *q);
 
 // Remove q from p's list of immediate descendants and return q.
-// If q is not a child of p return NULL.
+// If q is not a child of p return NULL. The subtree rooted at q is then
+// owned by the caller rather than p's phylogeny: it is not released by
+// phy_free and may be grafted elsewhere, even after phy_free, with
+// phy_node_add_child. Nodes from a Newick string live in the phylogeny's
+// storage, though, so they must be grafted back before it is freed.
 struct phy_node *phy_node_prune(struct phy_node *p, struct phy_node *q);
 
 // Build a phylogeny from the connected nodes rooted at *root.
 struct phy *phy_build(struct phy_node *root, int nnode, int ntip);
 
+// Bring the node indices and traversal arrays of a phylogeny up to date
+// after nodes have been added, pruned or reordered with the functions
+// above. Edits are recorded as they are made and the arrays are refreshed
+// automatically before they are next used (by a cursor, phy_node_get,
+// phy_nnode, etc.), renumbering only the smallest clade containing the
+// edits when its size is unchanged, as for a subtree moved within it.
+// Nodes that are no longer connected to the root are then no longer owned
+// by the phylogeny. Calling this directly allows allocation failure to be
+// detected.
+int phy_refresh(struct phy *phy);
+
+/* Thread safety. Once a phylogeny has no pending edits (phy_refresh has
+** been called, or nothing has been changed since it was built or last
+** traversed) the functions that only read it are reentrant: any number
+** of threads may traverse it with their own cursors (see
+** phy_cursor_prepare_v2), look up nodes, compute ages, common ancestors
+** and distances, extract subtrees and write it out at the same time.
+** Caches built on first use are built once under a lock. The exceptions
+** are phy_cursor_prepare, which returns the one cursor shared by all its
+** callers, and the functions that modify nodes or the phylogeny, which
+** must not run concurrently with anything else on the same phylogeny.
+** When built with OpenMP the error code read by phy_errmsg is kept per
+** thread. */
+
 // Build a phylogeny from a newick string. The returned phy object must be
-// free'd with phy_free.
+// free'd with phy_free. All nodes are allocated from one contiguous block
+// and all labels and notes from one string pool, both of which are owned
+// by the phylogeny and released together by phy_free.
 struct phy *phy_read_newickstr(const char *newick);
 
-// Write a phylogeny to a newick string
+// Same as phy_read_newickstr except that on error the error code is
+// stored in *err instead of the global error state. It is safe to call
+// from multiple threads whether or not the library was built with OpenMP.
+struct phy *phy_read_newickstr_v2(const char *newick, int *err);
+
+// Write a phylogeny to a newick string. The returned string must be free'd
+// with free(). Branch lengths are written with the shortest number of
+// digits that reads back to the same double, and zero branch lengths are
+// omitted.
 char *phy_write_newickstr(struct phy *phy);
 
+// Same as phy_write_newickstr except that if digits > 0 branch lengths are
+// rounded to that many significant digits. The string is allocated once,
+// sized from the node count and the label and note lengths.
+char *phy_write_newickstr_v2(struct phy *phy, int digits);
+
+// Write a phylogeny followed by a newline to an open stream. The text is
+// assembled in a fixed-size buffer and flushed to out as it fills, so no
+// string of the whole tree is built. digits is as for
+// phy_write_newickstr_v2. Returns 1 on error, 0 on success.
+int phy_write_newick(struct phy *phy, FILE *out, int digits);
+
+// Write ntree phylogenies to an open stream, one per line, through a
+// single shared buffer. Returns 1 on error, 0 on success.
+int phy_write_newick_many(int ntree, struct phy **trees, FILE *out, int digits);
+
 // Build a phylogeny from a newick file. The returned phy object must be
 // free'd with phy_free.
 struct phy *phy_read_newickfile(const char *filename);
@@ -69,6 +255,79 @@ struct phy *phy_read_newickfile(const char *filename);
 int phy_write_newickfile(
     struct phy *phy, const char *filename, const char *mode);
 
+// Write ntree phylogenies to a newick file, one per line, opened with the
+// given fopen mode. digits is as for phy_write_newickstr_v2. Returns 1 on
+// error, 0 on success.
+int phy_write_newickfile_v2(
+    int ntree,
+    struct phy **trees,
+    const char *filename,
+    const char *mode,
+    int digits
+);
+
+// Serialize a phylogeny to a compact binary buffer whose size is stored in
+// *size. The buffer must be free'd with free(). Returns NULL on error.
+unsigned char *phy_write_binarystr(struct phy *phy, size_t *size);
+
+// Rebuild a phylogeny from a buffer written by phy_write_binarystr. The
+// returned phy object must be free'd with phy_free. Returns NULL on error.
+struct phy *phy_read_binarystr(const unsigned char *buf, size_t size);
+
+// Write a phylogeny to a binary file. Returns 1 on error, 0 on success
+int phy_write_binary(struct phy *phy, const char *filename);
+
+// Read a phylogeny from a binary file. The returned phy object must be
+// free'd with phy_free. Returns NULL on error.
+struct phy *phy_read_binary(const char *filename);
+
+/* Phylogenies can be read one at a time from a file (or string) holding
+** any number of ';'-terminated Newick trees, like so,
+**
+**   struct phy *phy;
+**   struct phy_reader *reader = phy_reader_open(filename);
+**   while (phy_reader_next(reader, &phy) == PHY_OK && phy)
+**   {
+**       // do something with phy
+**       phy_free(phy);
+**   }
+**   phy_reader_close(reader);
+**
+** Memory use is bounded by the size of the largest tree, not the file
+** (a mapped file's pages are backed by the file itself). */
+
+// Open a Newick file for reading trees one at a time. Return NULL on error.
+// Where supported the file is mapped into memory and trees are parsed in
+// place; otherwise it is read in fixed-size chunks.
+struct phy_reader *phy_reader_open(const char *filename);
+
+// Open a Newick string for reading trees one at a time. The string must
+// remain valid until the reader is closed. Return NULL on error.
+struct phy_reader *phy_reader_openstr(const char *newick);
+
+// Read the next tree, storing it in *phy. At the end of input *phy is set
+// to NULL. Returns 1 on error, 0 on success. Trees returned by the reader
+// must be free'd with phy_free.
+int phy_reader_next(struct phy_reader *reader, struct phy **phy);
+
+// Read all remaining trees, parsing them on nthreads threads (when built
+// with OpenMP support). On success *trees holds *ntree trees in input order;
+// the array must be free'd with free() and each tree with phy_free. Returns
+// 1 on error, 0 on success. On error no trees are returned.
+int phy_reader_readall(
+    struct phy_reader *reader, int nthreads, struct phy ***trees, int *ntree);
+
+// Close a reader and free the memory allocated to it.
+void phy_reader_close(struct phy_reader *reader);
+
+// Apply function FUN to each tree in a Newick file. FUN takes ownership of
+// the tree it is passed and returns nonzero to stop reading early. Returns
+// 1 on error, 0 on success.
+int phy_read_newickfile_foreach(
+    const char *filename,
+    int (*FUN)(struct phy *phy, void *param),
+    void *param);
+
 // Free memory allocated to a phylogeny
 void phy_free(struct phy *phy);
 
@@ -98,7 +357,9 @@ void phy_free(struct phy *phy);
 // not thread safe. All calls to this function return the same cursor
 // object. If multiple threads need to be traversing the phylogeny
 // simultaneously they should use phy_cursor_prepare_v2 in conjunction
-// with independent cursor objects obtained via phy_cursor_alloc.
+// with independent cursor objects, either declared on the stack or
+// obtained via phy_cursor_alloc. The library itself never uses the
+// shared cursor.
 struct phy_cursor *phy_cursor_prepare(
     struct phy *phy,
     struct phy_node *node,
@@ -106,8 +367,9 @@ struct phy_cursor *phy_cursor_prepare(
     int order
 );
 
-// Users should arrange to free the cursor with phy_cursor_free when it is
-// no longer needed.
+// Prepare a caller-owned cursor for phylogeny traversal. A cursor
+// obtained via phy_cursor_alloc should be freed with phy_cursor_free when
+// it is no longer needed; one declared on the stack needs no cleanup.
 void phy_cursor_prepare_v2(
     struct phy *phy,
     struct phy_node *node,
@@ -129,21 +391,118 @@ struct phy *phy_extract_clade(struct phy_node *node);
 struct phy *phy_extract_subtree(
     int ntip, struct phy_node **tips, struct phy *phy);
 
+// Extract the subtrees defined by nset sets of terminal nodes, where set i
+// holds the ntip[i] > 0 nodes tips[i]. Each subtree is built from the tips
+// and their pairwise mrcas found with lca (an LCA index of phy, or NULL to
+// build one for the call), so its cost depends on the size of the set and
+// not of phy. Branch lengths are the differences of the node ages. The sets
+// are processed on nthreads threads when the package is built with OpenMP.
+// On success out[i] holds subtree i; otherwise, including when a set is
+// empty, no subtrees are returned. Return 0 on success or 1 on failure.
+int phy_extract_subtrees(
+    struct phy *phy,
+    struct phy_lca *lca,
+    int nset,
+    const int *ntip,
+    struct phy_node ***tips,
+    int nthreads,
+    struct phy **out);
+
 // Rotate a set of nodes
 void phy_node_rotate(int n, struct phy_node **nodes, struct phy *phy);
 
-// Return a deep copy of a phylogeny.
+/* Tree rearrangements. Each move relinks existing nodes in place and, if
+** move is not NULL, records what is needed to reverse it with
+** phy_move_undo. Node indices change only within the smallest clade
+** spanning the move and are brought up to date the next time they are
+** needed (see phy_refresh); undoing a move restores them.
+** Each function returns 0 on success or 1 (setting the error message) if
+** the move is not possible or its nodes are not part of phy, in which
+** case the tree is left unchanged. The root of the phylogeny is never
+** moved. */
+
+// Nearest neighbor interchange: exchange the subtree a with the subtree b,
+// where b is a child of the parent of a's parent (other than that parent).
+// Branch lengths stay with their subtrees.
+int phy_nni(
+    struct phy *phy,
+    struct phy_node *a,
+    struct phy_node *b,
+    struct phy_move *move);
+
+// Subtree pruning and regrafting: detach the subtree s together with its
+// bifurcating parent p (which must not be the root) and reattach it on the
+// branch above t, outside the clade of p. The two branches left on either
+// side of p are joined, and the branch above t is split at its midpoint
+// between t and p.
+int phy_spr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *t,
+    struct phy_move *move);
+
+// Tree bisection and reconnection: as phy_spr, but first reroot the clade
+// of the bifurcating node s on the branch above r, a node in the clade of
+// s. The path from r to s is reversed with the branch lengths carried
+// along, the two branches at the old root of the clade are joined, and the
+// branch above r is split at its midpoint to form the new root branches.
+// If r is s this is an SPR move.
+int phy_tbr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *r,
+    struct phy_node *t,
+    struct phy_move *move);
+
+// Reverse the last move recorded in move, restoring the tree and the branch
+// lengths exactly. Moves must be undone in the reverse order they were made.
+// Returns 1 if the move was not made on phy, 0 on success.
+int phy_move_undo(struct phy *phy, struct phy_move *move);
+
+// Return a deep copy of a phylogeny, or NULL if memory could not be
+// allocated. Node indices, labels, notes and branch lengths are preserved.
+// Client data is not copied: the nodes of the copy have none.
 struct phy *phy_duplicate(struct phy *phy);
 
 // Re-root the *in phylogeny on node, storing the re-rooted tree
-// in *out. If *in is equal to *out, *in is first free'd.
+// in *out. If *in is equal to *out, *in is re-rooted in place as by
+// phy_reroot_inplace. Otherwise *out is a re-rooted copy, or NULL on error.
 void phy_reroot(struct phy_node *node, struct phy **in, struct phy **out);
 
 // Un-root the root phylogeny *in and store it in *out. If *in
 // is already unrooted sets *out equal to NULL.
-// If *in is equal to *out, *in is first free'd.
+// If *in is equal to *out, *in is un-rooted in place as by
+// phy_unroot_inplace.
 void phy_unroot(struct phy **in, struct phy **out);
 
+// Re-root a phylogeny in place at the midpoint of the branch above node.
+// The nodes, with their labels and client data, are kept: the edges on the
+// path from the root to node are reversed and, if the phylogeny is
+// rooted, the root node is moved onto the branch above node and the two
+// branches that met at it are joined. An unrooted phylogeny gains a new
+// root node. Node indices are renumbered. Returns 1 on error, 0 on success.
+int phy_reroot_inplace(struct phy *phy, struct phy_node *node);
+
+// Un-root a rooted phylogeny in place by removing its root node. An
+// internal child of the root becomes the new root and the two branches
+// below the old root are joined. The other nodes are kept and node
+// indices are renumbered. Returns 1 on error, 0 on success.
+int phy_unroot_inplace(struct phy *phy);
+
+// Call FUN once for every rooting of a phylogeny, with the root placed
+// at the midpoint of each branch in turn (a rooted phylogeny is first
+// visited with its own root). node is the first child of the root. The
+// root is moved across one node between calls, so visiting all rootings
+// costs O(n) in total, and the phylogeny is restored exactly on return.
+// FUN must not modify the phylogeny. Between calls the traversal arrays
+// are stale, so any function that needs node indices renumbers the tree
+// first. Iteration stops early if FUN returns nonzero. Returns 1 on
+// error, 0 on success.
+int phy_reroot_foreach(
+    struct phy *phy,
+    int (*FUN)(struct phy *phy, struct phy_node *node, void *param),
+    void *param);
+
 // Return the branch length subtending a node
 double phy_node_brlen(struct phy_node *node);
 
@@ -195,8 +554,12 @@ int phy_ntip(struct phy *phy);
 // Swap the position of a and b in the child list
 void phy_node_swap(struct phy_node *a, struct phy_node *b);
 
-// Ladderize the phylogeny
-void phy_ladderize(struct phy *phy, int *n, int *perm);
+// Ladderize the phylogeny: sort the children of every node into increasing
+// order of n[child index], keeping the order of ties. If n is NULL the
+// number of descendants of each node is used. Nodes are then renumbered and,
+// if perm is not NULL, perm[i] is set to the former index of the node with
+// index i. Return 0 on success or 1 if memory could not be allocated.
+int phy_ladderize(struct phy *phy, int *n, int *perm);
 
 // Return the root node of a phylogeny
 struct phy_node *phy_root(struct phy *phy);
@@ -206,9 +569,18 @@ struct phy_node *phy_root(struct phy *phy);
 struct phy_node *phy_node_get(struct phy *phy, int index);
 
 // Return the node with the given label from a phylogeny (or NULL if the
-// label is not found).
+// label is not found). If several nodes share the label the first one in a
+// postorder traversal is returned. Lookups use a hash table of the labels
+// that is built on the first call and rebuilt after labels or the topology
+// change.
 struct phy_node *phy_node_find(struct phy *phy, const char *label);
 
+// Store in index[i] the index of the node phy_node_find would return for
+// labels[i], or -1 if there is none (or labels[i] is NULL). Return 0 on
+// success or 1 if memory could not be allocated.
+int phy_node_find_many(
+    struct phy *phy, int n, const char **labels, int *index);
+
 // Attach arbitrary client data to a node, passing a destructor (may be NULL).
 // Any previously added data is removed (and free'd).
 void phy_node_set_data(
@@ -221,6 +593,77 @@ void phy_node_set_index(struct phy_node *node, int index);
 void phy_node_set_brlen(
     struct phy_node *node, double brlen);
 
+// Return the ages of all nodes (the sum of branch lengths from the root up
+// to and including each node's own branch), indexed by node index. The
+// array is computed once and owned by the phylogeny; it remains valid until
+// the phylogeny's branch lengths or topology are modified. Returns NULL on
+// error.
+const double *phy_ages(struct phy *phy);
+
+// Return the depths of all nodes, as numbers of edges from the root,
+// indexed by node index. The array has the same lifetime as phy_ages.
+// Returns NULL on error.
+const int *phy_depths(struct phy *phy);
+
+// Return the height of a phylogeny, the greatest distance from the root
+// to a terminal node. Returns -1 on error.
+double phy_height(struct phy *phy);
+
+// Group the nodes of a phylogeny by height, the greatest number of edges
+// between a node and a tip descended from it. On return the indices of
+// the nodes of height h are, in increasing order,
+//
+//   (*node)[(*offset)[h]] ... (*node)[(*offset)[h+1] - 1]
+//
+// so the first level holds the tips, the last holds the root, and every
+// node is in a later level than its children. The nodes of a level are
+// independent of one another and can be processed at once, level by
+// level for a postorder computation or in reverse for a preorder one.
+// The arrays are computed on first use and belong to the phylogeny; they
+// remain valid until it is next modified. Return the number of levels,
+// or -1 on error.
+int phy_levels(struct phy *phy, const int **offset, const int **node);
+
+// Store the patristic distances (the lengths of the paths between tips)
+// from the nrow tips with indices first ... first+nrow-1 to every tip in
+// d, row by row, so that d[r * ntip + j] is the distance between tips
+// first+r and j. The rows are computed on nthreads threads (when built
+// with OpenMP support) in O(nrow * ntip) time. By filling a block of rows
+// at a time the caller can bound the memory used for a large matrix.
+// Returns 1 on error, such as rows that are not all tips, 0 on success.
+int phy_patristic(
+    struct phy *phy, int first, int nrow, double *d, int nthreads);
+
+// Write the ntip x ntip matrix of patristic distances to a file as native
+// doubles, row by row, without holding the whole matrix in memory. As the
+// matrix is symmetric rows and columns are interchangeable. Returns 1 on
+// error, such as a file that cannot be opened or written in full, 0 on
+// success.
+int phy_patristic_write(struct phy *phy, const char *filename, int nthreads);
+
+// Store the rows for the tips with indices first ... first+nrow-1 of the
+// phylogenetic variance-covariance matrix, whose entries are the lengths
+// of the paths shared by pairs of tips from the root, in d as for
+// phy_patristic. This is the covariance of the tip states of a Brownian
+// motion with unit rate started at the root. Returns 1 on error, 0 on
+// success.
+int phy_vcv(struct phy *phy, int first, int nrow, double *d, int nthreads);
+
+// Write the ntip x ntip variance-covariance matrix to a file as for
+// phy_patristic_write. Returns 1 on error, 0 on success.
+int phy_vcv_write(struct phy *phy, const char *filename, int nthreads);
+
+// Store the 3 * nnode - 2 nonzero entries of the precision matrix of the
+// states at all nodes under a Brownian motion with unit rate in the
+// triplets (i[k], j[k], x[k]), with rows and columns indexed by node
+// index. The first nnode entries are the diagonal. Conditioning on the
+// root state by deleting its row and column gives the precision of the
+// remaining states, whose covariance restricted to the tips is the
+// matrix of phy_vcv. Every branch other than the root's must have
+// positive length. Returns 1 on error, such as a branch that does not,
+// and 0 on success.
+int phy_precision(struct phy *phy, int *i, int *j, double *x);
+
 // Set the label for a node.
 void phy_node_set_label(
     struct phy_node *node, const char *label);
@@ -238,10 +681,112 @@ void phy_node_spanning_pair(
 void phy_node_spanning_index(
     struct phy_node *node, int *a, int *b);
 
-// Return the most recent common ancestor of a and b.
+// Store the range of indices of the terminal nodes in the clade subtended
+// by node in *first and *last, and the number of nodes in the clade,
+// including node, in *nnode. Terminal nodes are numbered in preorder, so
+// the clade's terminal nodes are exactly those with indices first through
+// last. Its internal nodes are likewise numbered consecutively from the
+// index of node. Takes constant time once the traversal arrays are built.
+// Returns 1 on error, 0 on success.
+int phy_node_clade(
+    struct phy *phy,
+    struct phy_node *node,
+    int *first,
+    int *last,
+    int *nnode);
+
+// Test in constant time whether node belongs to the clade subtended by anc
+// (which includes anc itself)
+int phy_node_isdesc(
+    struct phy *phy, struct phy_node *node, struct phy_node *anc);
+
+// Return the most recent common ancestor of a and b. Takes time
+// proportional to the depth of a; see phy_lca_new for repeated queries.
 struct phy_node *phy_node_mrca(
     struct phy *phy, struct phy_node *a, struct phy_node *b);
 
+// Build an index answering most recent common ancestor queries in constant
+// time. It requires O(n log n) space and remains valid until the topology
+// or node order of the phylogeny changes. Returns NULL on error.
+struct phy_lca *phy_lca_new(struct phy *phy);
+
+// Return the most recent common ancestor of a and b
+struct phy_node *phy_lca_query(
+    struct phy_lca *lca, struct phy_node *a, struct phy_node *b);
+
+// Store the index of the most recent common ancestor of nodes with indices
+// a[i] and b[i] in mrca[i] for i = 0 ... n-1
+void phy_lca_query_v(
+    struct phy_lca *lca, int n, const int *a, const int *b, int *mrca);
+
+// Free memory allocated to an LCA index
+void phy_lca_free(struct phy_lca *lca);
+
+/* A split table summarizes the splits (bipartitions of the tips) of a
+** collection of phylogenies over the same tip labels, e.g. a posterior
+** sample, like so,
+**
+**   struct phy_splits *splits = phy_splits_new(0);
+**   for (i = 0; i < ntree; ++i)
+**       phy_splits_add(splits, trees[i]);
+**   consensus = phy_splits_consensus(splits, 0.5);
+**   phy_splits_free(splits);
+**
+** The tips of a split are reported by bit position, each position
+** standing for one of the tip labels of the first phylogeny added. For
+** rooted phylogenies a split is the set of tips below an internal edge;
+** for unrooted ones it is the side of an internal edge that does not hold
+** the tip in bit position 0. Splits of a single tip are not recorded. */
+
+// Create a new split table, treating the phylogenies added to it as
+// rooted if rooted is nonzero. Return NULL on error.
+struct phy_splits *phy_splits_new(int rooted);
+
+// Add the splits of a phylogeny to a split table. Every phylogeny must
+// have the same uniquely labelled tips. Returns 1 on error, 0 on success.
+// On error the table is unchanged.
+int phy_splits_add(struct phy_splits *splits, struct phy *phy);
+
+// Return the number of phylogenies added to a split table
+int phy_splits_ntree(struct phy_splits *splits);
+
+// Return the number of tips of the phylogenies in a split table
+int phy_splits_ntip(struct phy_splits *splits);
+
+// Return the number of distinct splits in a split table. The splits are
+// numbered 0 ... n-1 in the order they were first seen.
+int phy_splits_nsplit(struct phy_splits *splits);
+
+// Return the number of phylogenies in which split i was found
+int phy_splits_count(struct phy_splits *splits, int i);
+
+// Store the bit positions of the tips of split i in increasing order in
+// bit, which must have room for phy_splits_ntip entries, and return
+// their number
+int phy_splits_tips(struct phy_splits *splits, int i, int *bit);
+
+// Return the tip label at a bit position
+const char *phy_splits_label(struct phy_splits *splits, int bit);
+
+// Build the consensus of the phylogenies in a split table from the splits
+// found in more than a proportion p of them, taken in decreasing order of
+// frequency where compatible with those already taken. p = 0.5 gives the
+// majority-rule consensus and p = 0 the greedy consensus. Internal nodes
+// are labelled with the proportion of phylogenies containing their split,
+// and branch lengths are the means over the phylogenies containing each
+// split (or tip). The returned phy object must be free'd with phy_free.
+// Return NULL on error.
+struct phy *phy_splits_consensus(struct phy_splits *splits, double p);
+
+// Store the Robinson-Foulds distance, the number of splits found in one
+// but not the other, between every pair of the m phylogenies in a split
+// table in the m x m matrix rf, computing the rows on nthreads threads
+// (when built with OpenMP support). Returns 1 on error, 0 on success.
+int phy_splits_rf(struct phy_splits *splits, int nthreads, int *rf);
+
+// Free memory allocated to a split table
+void phy_splits_free(struct phy_splits *splits);
+
 // Apply function FUN to each node visited by a specified type of tree
 // traversal.
 void phy_node_foreach(
@@ -252,6 +797,24 @@ void phy_node_foreach(
     void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
     void *param);
 
+// Apply function FUN to each node in the clade below node, visiting each
+// node after all of its descendants (POSTORDER) or after its parent
+// (PREORDER), with disjoint subclades traversed in parallel by up to
+// nthreads threads. FUN may therefore be called concurrently for nodes
+// in different subclades; it must not modify the phylogeny or touch the
+// data of nodes other than the one it is given, its parent (PREORDER)
+// and its descendants (POSTORDER). visit is one of ALL_NODES and
+// INTERNAL_NODES_ONLY, as for phy_node_foreach. Without OpenMP the
+// traversal is serial. Return 0 on success; 1, error.
+int phy_node_foreach_parallel(
+    struct phy *phy,
+    struct phy_node *node,
+    int visit,
+    int order,
+    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
+    void *param,
+    int nthreads);
+
 // Allocate memory for a new phy_cursor object. Return 0 on success; 1, error
 int phy_cursor_alloc(struct phy_cursor **cursor);
 
@@ -265,6 +828,50 @@ const char *phy_node_note(struct phy_node *node);
 // Return the current error message
 const char *phy_errmsg();
 
+// Return the error message for an error code set by a _v2 function
+const char *phy_strerror(int err);
+
+// Return a structure-of-arrays snapshot of a phylogeny (or NULL if memory
+// could not be allocated). The snapshot must be free'd with phy_flat_free.
+struct phy_flat *phy_flatten(struct phy *phy);
+
+// Free a snapshot returned by phy_flatten
+void phy_flat_free(struct phy_flat *flat);
+
+// Compute the drawing coordinates of a phylogeny in one pass over its
+// nodes. Polytomies are supported. The layout is a snapshot that does not
+// see later changes to the phylogeny. Returns NULL on error.
+struct phy_layout *phy_layout_new(struct phy *phy);
+
+// Collapse (collapse = 1) or expand (collapse = 0) the clade subtended by
+// the node with the given index, updating only the states of the nodes in
+// that clade. Clades collapsed inside an expanded clade stay collapsed.
+// Collapsing a terminal node has no effect.
+void phy_layout_collapse(struct phy_layout *layout, int node, int collapse);
+
+// Mark what of a layout is too small or too far out to be seen when drawn
+// with pixels that measure breadth by depth layout units, within window
+// = {breadth min, breadth max, depth min, depth max} (NULL for no window).
+// Clades whose terminal span is under a pixel are marked
+// PHY_LAYOUT_WEDGE, to be drawn as a wedge like a collapsed clade; nodes
+// inside them and clades entirely outside the window are marked
+// PHY_LAYOUT_CULLED; and edges under a pixel long or outside the window
+// are marked PHY_LAYOUT_NOEDGE. Marks from a previous call are cleared
+// first, so call again after phy_layout_collapse. Returns the number of
+// nodes still to be drawn.
+int phy_layout_cull(struct phy_layout *layout, const double *window,
+    double breadth, double depth);
+
+// Free a layout returned by phy_layout_new
+void phy_layout_free(struct phy_layout *layout);
+
+// Copy the library's counters (see struct phy_stats) to stats. The counts
+// are totals over all threads.
+void phy_stats(struct phy_stats *stats);
+
+// Reset the library's counters to zero
+void phy_stats_reset(void);
+
 
 #ifdef PHY_API_IMPLEMENTATION
 
@@ -323,6 +930,16 @@ struct phy *phy_build(struct phy_node *root, int nnode, int ntip)
     return fun(root, nnode, ntip);
 }
 
+int phy_refresh(struct phy *phy)
+{
+    static int (*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (int (*)(struct phy *))R_GetCCallable("phylo", "phy_refresh");
+    }
+    return fun(phy);
+}
+
 struct phy *phy_read_newickstr(const char *newick)
 {
     static struct phy *(*fun)(const char *) = NULL;
@@ -334,6 +951,17 @@ struct phy *phy_read_newickstr(const char *newick)
     return fun(newick);
 }
 
+struct phy *phy_read_newickstr_v2(const char *newick, int *err)
+{
+    static struct phy *(*fun)(const char *, int *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy *(*)(const char *, int *))R_GetCCallable(
+            "phylo", "phy_read_newickstr_v2");
+    }
+    return fun(newick, err);
+}
+
 char *phy_write_newickstr(struct phy *phy)
 {
     static char *(*fun)(struct phy *) = NULL;
@@ -345,6 +973,39 @@ char *phy_write_newickstr(struct phy *phy)
     return fun(phy);
 }
 
+char *phy_write_newickstr_v2(struct phy *phy, int digits)
+{
+    static char *(*fun)(struct phy *, int) = NULL;
+    if (!fun)
+    {
+        fun = (char *(*)(struct phy *, int))R_GetCCallable(
+            "phylo", "phy_write_newickstr_v2");
+    }
+    return fun(phy, digits);
+}
+
+int phy_write_newick(struct phy *phy, FILE *out, int digits)
+{
+    static int(*fun)(struct phy *, FILE *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, FILE *, int))R_GetCCallable(
+            "phylo", "phy_write_newick");
+    }
+    return fun(phy, out, digits);
+}
+
+int phy_write_newick_many(int ntree, struct phy **trees, FILE *out, int digits)
+{
+    static int(*fun)(int, struct phy **, FILE *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(int, struct phy **, FILE *, int))R_GetCCallable(
+            "phylo", "phy_write_newick_many");
+    }
+    return fun(ntree, trees, out, digits);
+}
+
 struct phy *phy_read_newickfile(const char *filename)
 {
     static struct phy *(*fun)(const char *) = NULL;
@@ -368,6 +1029,137 @@ int phy_write_newickfile(
     return fun(phy, filename, mode);
 }
 
+int phy_write_newickfile_v2(
+    int ntree,
+    struct phy **trees,
+    const char *filename,
+    const char *mode,
+    int digits
+){
+    static int(*fun)(int, struct phy **, const char *, const char *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(int, struct phy **, const char *, const char *, int))
+            R_GetCCallable("phylo", "phy_write_newickfile_v2");
+    }
+    return fun(ntree, trees, filename, mode, digits);
+}
+
+unsigned char *phy_write_binarystr(struct phy *phy, size_t *size)
+{
+    static unsigned char *(*fun)(struct phy *, size_t *) = NULL;
+    if (!fun)
+    {
+        fun = (unsigned char *(*)(struct phy *, size_t *))R_GetCCallable(
+            "phylo", "phy_write_binarystr");
+    }
+    return fun(phy, size);
+}
+
+struct phy *phy_read_binarystr(const unsigned char *buf, size_t size)
+{
+    static struct phy *(*fun)(const unsigned char *, size_t) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy *(*)(const unsigned char *, size_t))R_GetCCallable(
+            "phylo", "phy_read_binarystr");
+    }
+    return fun(buf, size);
+}
+
+int phy_write_binary(struct phy *phy, const char *filename)
+{
+    static int(*fun)(struct phy *, const char *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, const char *))R_GetCCallable(
+            "phylo", "phy_write_binary");
+    }
+    return fun(phy, filename);
+}
+
+struct phy *phy_read_binary(const char *filename)
+{
+    static struct phy *(*fun)(const char *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy *(*)(const char *))R_GetCCallable(
+            "phylo", "phy_read_binary");
+    }
+    return fun(filename);
+}
+
+struct phy_reader *phy_reader_open(const char *filename)
+{
+    static struct phy_reader *(*fun)(const char *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_reader *(*)(const char *))R_GetCCallable(
+            "phylo", "phy_reader_open");
+    }
+    return fun(filename);
+}
+
+struct phy_reader *phy_reader_openstr(const char *newick)
+{
+    static struct phy_reader *(*fun)(const char *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_reader *(*)(const char *))R_GetCCallable(
+            "phylo", "phy_reader_openstr");
+    }
+    return fun(newick);
+}
+
+int phy_reader_next(struct phy_reader *reader, struct phy **phy)
+{
+    static int(*fun)(struct phy_reader *, struct phy **) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_reader *, struct phy **))R_GetCCallable(
+            "phylo", "phy_reader_next");
+    }
+    return fun(reader, phy);
+}
+
+int phy_reader_readall(
+    struct phy_reader *reader, int nthreads, struct phy ***trees, int *ntree)
+{
+    static int(*fun)(struct phy_reader *, int, struct phy ***, int *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_reader *, int, struct phy ***, int *))
+            R_GetCCallable("phylo", "phy_reader_readall");
+    }
+    return fun(reader, nthreads, trees, ntree);
+}
+
+void phy_reader_close(struct phy_reader *reader)
+{
+    static void(*fun)(struct phy_reader *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_reader *))R_GetCCallable(
+            "phylo", "phy_reader_close");
+    }
+    fun(reader);
+}
+
+int phy_read_newickfile_foreach(
+    const char *filename,
+    int (*FUN)(struct phy *phy, void *param),
+    void *param)
+{
+    static int(*fun)(
+        const char *, int (*)(struct phy *, void *), void *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(const char *, int (*)(struct phy *, void *), void *))
+            R_GetCCallable("phylo", "phy_read_newickfile_foreach");
+    }
+    return fun(filename, FUN, param);
+}
+
 void phy_free(struct phy *phy)
 {
     static void(*fun)(struct phy *) = NULL;
@@ -458,6 +1250,26 @@ struct phy *phy_extract_subtree(
     return fun(ntip, tips, phy);
 }
 
+int phy_extract_subtrees(
+    struct phy *phy,
+    struct phy_lca *lca,
+    int nset,
+    const int *ntip,
+    struct phy_node ***tips,
+    int nthreads,
+    struct phy **out)
+{
+    static int(*fun)(struct phy *, struct phy_lca *, int, const int *,
+        struct phy_node ***, int, struct phy **) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_lca *, int, const int *,
+            struct phy_node ***, int, struct phy **))R_GetCCallable(
+                "phylo", "phy_extract_subtrees");
+    }
+    return fun(phy, lca, nset, ntip, tips, nthreads, out);
+}
+
 void phy_node_rotate(int n, struct phy_node **nodes, struct phy *phy)
 {
     static void(*fun)(int, struct phy_node **, struct phy *) = NULL;
@@ -469,6 +1281,67 @@ void phy_node_rotate(int n, struct phy_node **nodes, struct phy *phy)
     fun(n, nodes, phy);
 }
 
+int phy_nni(
+    struct phy *phy,
+    struct phy_node *a,
+    struct phy_node *b,
+    struct phy_move *move
+){
+    static int(*fun)(struct phy *, struct phy_node *, struct phy_node *,
+        struct phy_move *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *, struct phy_node *,
+            struct phy_move *))R_GetCCallable("phylo", "phy_nni");
+    }
+    return fun(phy, a, b, move);
+}
+
+int phy_spr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *t,
+    struct phy_move *move
+){
+    static int(*fun)(struct phy *, struct phy_node *, struct phy_node *,
+        struct phy_move *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *, struct phy_node *,
+            struct phy_move *))R_GetCCallable("phylo", "phy_spr");
+    }
+    return fun(phy, s, t, move);
+}
+
+int phy_tbr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *r,
+    struct phy_node *t,
+    struct phy_move *move
+){
+    static int(*fun)(struct phy *, struct phy_node *, struct phy_node *,
+        struct phy_node *, struct phy_move *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *, struct phy_node *,
+            struct phy_node *, struct phy_move *))R_GetCCallable(
+                "phylo", "phy_tbr");
+    }
+    return fun(phy, s, r, t, move);
+}
+
+int phy_move_undo(struct phy *phy, struct phy_move *move)
+{
+    static int(*fun)(struct phy *, struct phy_move *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_move *))R_GetCCallable(
+            "phylo", "phy_move_undo");
+    }
+    return fun(phy, move);
+}
+
 struct phy *phy_duplicate(struct phy *phy)
 {
     static struct phy *(*fun)(struct phy *) = NULL;
@@ -502,6 +1375,44 @@ void phy_unroot(struct phy **in, struct phy **out)
     fun(in, out);
 }
 
+int phy_reroot_inplace(struct phy *phy, struct phy_node *node)
+{
+    static int(*fun)(struct phy *, struct phy_node *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *))R_GetCCallable(
+            "phylo", "phy_reroot_inplace");
+    }
+    return fun(phy, node);
+}
+
+int phy_unroot_inplace(struct phy *phy)
+{
+    static int(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_unroot_inplace");
+    }
+    return fun(phy);
+}
+
+int phy_reroot_foreach(
+    struct phy *phy,
+    int (*FUN)(struct phy *phy, struct phy_node *node, void *param),
+    void *param
+){
+    static int(*fun)(struct phy *,
+        int (*)(struct phy *, struct phy_node *, void *), void *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *,
+            int (*)(struct phy *, struct phy_node *, void *), void *))
+            R_GetCCallable("phylo", "phy_reroot_foreach");
+    }
+    return fun(phy, FUN, param);
+}
+
 double phy_node_brlen(struct phy_node *node)
 {
     static double(*fun)(struct phy_node *) = NULL;
@@ -642,15 +1553,15 @@ void phy_node_swap(struct phy_node *a, struct phy_node *b)
     fun(a, b);
 }
 
-void phy_ladderize(struct phy *phy, int *n, int *perm)
+int phy_ladderize(struct phy *phy, int *n, int *perm)
 {
-    static void(*fun)(struct phy *, int *, int *) = NULL;
+    static int(*fun)(struct phy *, int *, int *) = NULL;
     if (!fun)
     {
-        fun = (void(*)(struct phy *, int *, int *))R_GetCCallable(
+        fun = (int(*)(struct phy *, int *, int *))R_GetCCallable(
             "phylo", "phy_ladderize");
     }
-    fun(phy, n, perm);
+    return fun(phy, n, perm);
 }
 
 struct phy_node *phy_root(struct phy *phy)
@@ -685,6 +1596,18 @@ struct phy_node *phy_node_find(struct phy *phy, const char *label)
     return fun(phy, label);
 }
 
+int phy_node_find_many(
+    struct phy *phy, int n, const char **labels, int *index)
+{
+    static int(*fun)(struct phy *, int, const char **, int *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, int, const char **, int *))R_GetCCallable(
+            "phylo", "phy_node_find_many");
+    }
+    return fun(phy, n, labels, index);
+}
+
 void phy_node_set_data(
     struct phy_node *node, void *data, void (*data_free)(void *))
 {
@@ -719,6 +1642,106 @@ void phy_node_set_brlen(struct phy_node *node, double brlen)
     fun(node, brlen);
 }
 
+const double *phy_ages(struct phy *phy)
+{
+    static const double *(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (const double *(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_ages");
+    }
+    return fun(phy);
+}
+
+const int *phy_depths(struct phy *phy)
+{
+    static const int *(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (const int *(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_depths");
+    }
+    return fun(phy);
+}
+
+double phy_height(struct phy *phy)
+{
+    static double(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (double(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_height");
+    }
+    return fun(phy);
+}
+
+int phy_levels(struct phy *phy, const int **offset, const int **node)
+{
+    static int(*fun)(struct phy *, const int **, const int **) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, const int **, const int **))
+            R_GetCCallable("phylo", "phy_levels");
+    }
+    return fun(phy, offset, node);
+}
+
+int phy_patristic(
+    struct phy *phy, int first, int nrow, double *d, int nthreads)
+{
+    static int(*fun)(struct phy *, int, int, double *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, int, int, double *, int))R_GetCCallable(
+            "phylo", "phy_patristic");
+    }
+    return fun(phy, first, nrow, d, nthreads);
+}
+
+int phy_patristic_write(struct phy *phy, const char *filename, int nthreads)
+{
+    static int(*fun)(struct phy *, const char *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, const char *, int))R_GetCCallable(
+            "phylo", "phy_patristic_write");
+    }
+    return fun(phy, filename, nthreads);
+}
+
+int phy_vcv(struct phy *phy, int first, int nrow, double *d, int nthreads)
+{
+    static int(*fun)(struct phy *, int, int, double *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, int, int, double *, int))R_GetCCallable(
+            "phylo", "phy_vcv");
+    }
+    return fun(phy, first, nrow, d, nthreads);
+}
+
+int phy_vcv_write(struct phy *phy, const char *filename, int nthreads)
+{
+    static int(*fun)(struct phy *, const char *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, const char *, int))R_GetCCallable(
+            "phylo", "phy_vcv_write");
+    }
+    return fun(phy, filename, nthreads);
+}
+
+int phy_precision(struct phy *phy, int *i, int *j, double *x)
+{
+    static int(*fun)(struct phy *, int *, int *, double *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, int *, int *, double *))R_GetCCallable(
+            "phylo", "phy_precision");
+    }
+    return fun(phy, i, j, x);
+}
+
 void phy_node_set_label(struct phy_node *node, const char *label)
 {
     static void (*fun)(struct phy_node *, const char *) = NULL;
@@ -766,6 +1789,38 @@ void phy_node_spanning_index(
 }
 
 
+int phy_node_clade(
+    struct phy *phy,
+    struct phy_node *node,
+    int *first,
+    int *last,
+    int *nnode
+){
+    static int(*fun)(struct phy *, struct phy_node *, int *, int *, int *)
+        = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *, int *, int *, int *))
+            R_GetCCallable("phylo", "phy_node_clade");
+    }
+    return fun(phy, node, first, last, nnode);
+}
+
+
+int phy_node_isdesc(
+    struct phy *phy, struct phy_node *node, struct phy_node *anc)
+{
+    static int(*fun)(struct phy *, struct phy_node *, struct phy_node *)
+        = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy *, struct phy_node *, struct phy_node *))
+            R_GetCCallable("phylo", "phy_node_isdesc");
+    }
+    return fun(phy, node, anc);
+}
+
+
 struct phy_node *phy_node_mrca(
     struct phy *phy, struct phy_node *a, struct phy_node *b)
 {
@@ -780,6 +1835,177 @@ struct phy_node *phy_node_mrca(
     return fun(phy, a, b);
 }
 
+struct phy_lca *phy_lca_new(struct phy *phy)
+{
+    static struct phy_lca *(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_lca *(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_lca_new");
+    }
+    return fun(phy);
+}
+
+struct phy_node *phy_lca_query(
+    struct phy_lca *lca, struct phy_node *a, struct phy_node *b)
+{
+    static struct phy_node *(*fun)(
+        struct phy_lca *, struct phy_node *, struct phy_node *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_node *(*)(
+            struct phy_lca *, struct phy_node *, struct phy_node *))
+        R_GetCCallable("phylo", "phy_lca_query");
+    }
+    return fun(lca, a, b);
+}
+
+void phy_lca_query_v(
+    struct phy_lca *lca, int n, const int *a, const int *b, int *mrca)
+{
+    static void(*fun)(
+        struct phy_lca *, int, const int *, const int *, int *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(
+            struct phy_lca *, int, const int *, const int *, int *))
+        R_GetCCallable("phylo", "phy_lca_query_v");
+    }
+    fun(lca, n, a, b, mrca);
+}
+
+void phy_lca_free(struct phy_lca *lca)
+{
+    static void(*fun)(struct phy_lca *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_lca *))R_GetCCallable(
+            "phylo", "phy_lca_free");
+    }
+    fun(lca);
+}
+
+struct phy_splits *phy_splits_new(int rooted)
+{
+    static struct phy_splits *(*fun)(int) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_splits *(*)(int))R_GetCCallable(
+            "phylo", "phy_splits_new");
+    }
+    return fun(rooted);
+}
+
+int phy_splits_add(struct phy_splits *splits, struct phy *phy)
+{
+    static int(*fun)(struct phy_splits *, struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *, struct phy *))R_GetCCallable(
+            "phylo", "phy_splits_add");
+    }
+    return fun(splits, phy);
+}
+
+int phy_splits_ntree(struct phy_splits *splits)
+{
+    static int(*fun)(struct phy_splits *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *))R_GetCCallable(
+            "phylo", "phy_splits_ntree");
+    }
+    return fun(splits);
+}
+
+int phy_splits_ntip(struct phy_splits *splits)
+{
+    static int(*fun)(struct phy_splits *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *))R_GetCCallable(
+            "phylo", "phy_splits_ntip");
+    }
+    return fun(splits);
+}
+
+int phy_splits_nsplit(struct phy_splits *splits)
+{
+    static int(*fun)(struct phy_splits *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *))R_GetCCallable(
+            "phylo", "phy_splits_nsplit");
+    }
+    return fun(splits);
+}
+
+int phy_splits_count(struct phy_splits *splits, int i)
+{
+    static int(*fun)(struct phy_splits *, int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *, int))R_GetCCallable(
+            "phylo", "phy_splits_count");
+    }
+    return fun(splits, i);
+}
+
+int phy_splits_tips(struct phy_splits *splits, int i, int *bit)
+{
+    static int(*fun)(struct phy_splits *, int, int *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *, int, int *))R_GetCCallable(
+            "phylo", "phy_splits_tips");
+    }
+    return fun(splits, i, bit);
+}
+
+const char *phy_splits_label(struct phy_splits *splits, int bit)
+{
+    static const char *(*fun)(struct phy_splits *, int) = NULL;
+    if (!fun)
+    {
+        fun = (const char *(*)(struct phy_splits *, int))R_GetCCallable(
+            "phylo", "phy_splits_label");
+    }
+    return fun(splits, bit);
+}
+
+struct phy *phy_splits_consensus(struct phy_splits *splits, double p)
+{
+    static struct phy *(*fun)(struct phy_splits *, double) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy *(*)(struct phy_splits *, double))R_GetCCallable(
+            "phylo", "phy_splits_consensus");
+    }
+    return fun(splits, p);
+}
+
+int phy_splits_rf(struct phy_splits *splits, int nthreads, int *rf)
+{
+    static int(*fun)(struct phy_splits *, int, int *) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_splits *, int, int *))R_GetCCallable(
+            "phylo", "phy_splits_rf");
+    }
+    return fun(splits, nthreads, rf);
+}
+
+void phy_splits_free(struct phy_splits *splits)
+{
+    static void(*fun)(struct phy_splits *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_splits *))R_GetCCallable(
+            "phylo", "phy_splits_free");
+    }
+    fun(splits);
+}
+
 void phy_node_foreach(
     struct phy *phy,
     struct phy_node *node,
@@ -809,6 +2035,38 @@ void phy_node_foreach(
     fun(phy, node, visit, order, FUN, param);
 }
 
+int phy_node_foreach_parallel(
+    struct phy *phy,
+    struct phy_node *node,
+    int visit,
+    int order,
+    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
+    void *param,
+    int nthreads)
+{
+    static int(*fun)(
+        struct phy *,
+        struct phy_node *,
+        int,
+        int,
+        void (*)(struct phy_node *, struct phy *, void *),
+        void *,
+        int) = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(
+            struct phy *,
+            struct phy_node *,
+            int,
+            int,
+            void (*)(struct phy_node *, struct phy *, void *),
+            void *,
+            int))
+        R_GetCCallable("phylo", "phy_node_foreach_parallel");
+    }
+    return fun(phy, node, visit, order, FUN, param, nthreads);
+}
+
 int phy_cursor_alloc(struct phy_cursor **cursor)
 {
     static int(*fun)(struct phy_cursor **) = NULL;
@@ -864,6 +2122,107 @@ const char *phy_errmsg()
     return fun();
 }
 
+const char *phy_strerror(int err)
+{
+    static const char *(*fun)(int) = NULL;
+    if (!fun)
+    {
+        fun = (const char *(*)(int))R_GetCCallable(
+            "phylo", "phy_strerror");
+    }
+    return fun(err);
+}
+
+struct phy_flat *phy_flatten(struct phy *phy)
+{
+    static struct phy_flat *(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_flat *(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_flatten");
+    }
+    return fun(phy);
+}
+
+void phy_flat_free(struct phy_flat *flat)
+{
+    static void(*fun)(struct phy_flat *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_flat *))R_GetCCallable(
+            "phylo", "phy_flat_free");
+    }
+    fun(flat);
+}
+
+struct phy_layout *phy_layout_new(struct phy *phy)
+{
+    static struct phy_layout *(*fun)(struct phy *) = NULL;
+    if (!fun)
+    {
+        fun = (struct phy_layout *(*)(struct phy *))R_GetCCallable(
+            "phylo", "phy_layout_new");
+    }
+    return fun(phy);
+}
+
+void phy_layout_collapse(struct phy_layout *layout, int node, int collapse)
+{
+    static void(*fun)(struct phy_layout *, int, int) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_layout *, int, int))R_GetCCallable(
+            "phylo", "phy_layout_collapse");
+    }
+    fun(layout, node, collapse);
+}
+
+int phy_layout_cull(struct phy_layout *layout, const double *window,
+    double breadth, double depth)
+{
+    static int(*fun)(struct phy_layout *, const double *, double, double)
+        = NULL;
+    if (!fun)
+    {
+        fun = (int(*)(struct phy_layout *, const double *, double, double))
+            R_GetCCallable("phylo", "phy_layout_cull");
+    }
+    return fun(layout, window, breadth, depth);
+}
+
+void phy_layout_free(struct phy_layout *layout)
+{
+    static void(*fun)(struct phy_layout *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_layout *))R_GetCCallable(
+            "phylo", "phy_layout_free");
+    }
+    fun(layout);
+}
+
+void phy_stats(struct phy_stats *stats)
+{
+    static void(*fun)(struct phy_stats *) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(struct phy_stats *))R_GetCCallable(
+            "phylo", "phy_stats");
+    }
+    fun(stats);
+}
+
+void phy_stats_reset(void)
+{
+    static void(*fun)(void) = NULL;
+    if (!fun)
+    {
+        fun = (void(*)(void))R_GetCCallable(
+            "phylo", "phy_stats_reset");
+    }
+    fun();
+}
+
 #endif /* PHY_API_IMPLEMENTATION */
 
 #ifdef __cplusplus
@@ -0,0 +1,239 @@
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Altrep.h>
+#include "phy.h"
+#include "init.h"
+
+/*
+** ALTREP vectors over the data of a phylogeny, so that the node
+** attributes returned to R are not copied into R vectors node by node.
+**
+** Labels and notes are string vectors whose data1 is the tree itself.
+** Each CHARSXP is made the first time its element is read and kept in
+** data2, so a label that is never looked at is never copied into R.
+**
+** Branch lengths and ages are double vectors viewing the arrays of a
+** phy_flat snapshot. The snapshot is shared by both vectors and held in
+** the protected slot of the tree's external pointer. As with any
+** snapshot it does not see later changes to the phylogeny, which from R
+** are always made on a duplicate. data2 holds a private copy once R asks
+** to write to the vector.
+*/
+
+static R_altrep_class_t label_class;
+static R_altrep_class_t note_class;
+static R_altrep_class_t brlen_class;
+static R_altrep_class_t age_class;
+
+
+static void phylo_flat_free(SEXP rflat)
+{
+    phy_flat_free((struct phy_flat *)R_ExternalPtrAddr(rflat));
+    R_ClearExternalPtr(rflat);
+}
+
+
+/* The phy_flat snapshot of a tree, taken on first use */
+static SEXP phylo_flat(SEXP rtree)
+{
+    struct phy_flat *flat;
+    SEXP rflat = R_ExternalPtrProtected(rtree);
+    if (rflat != R_NilValue)
+        return rflat;
+    flat = phy_flatten((struct phy *)R_ExternalPtrAddr(rtree));
+    if (!flat)
+        error(phy_errmsg());
+    rflat = PROTECT(R_MakeExternalPtr(flat, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(rflat, &phylo_flat_free);
+    R_SetExternalPtrProtected(rtree, rflat);
+    UNPROTECT(1);
+    return rflat;
+}
+
+
+/*
+** String vectors of labels and notes
+*/
+
+static R_xlen_t string_length(SEXP x)
+{
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(R_altrep_data1(x));
+    if (R_altrep_inherits(x, label_class))
+        return phy_ntip(phy);
+    return phy_nnode(phy);
+}
+
+
+/* The elements made so far. Entries not yet made are NA, which can never
+** be the value of a label or a note. */
+static SEXP string_cache(SEXP x)
+{
+    R_xlen_t i;
+    R_xlen_t n;
+    SEXP cache = R_altrep_data2(x);
+    if (cache == R_NilValue)
+    {
+        n = string_length(x);
+        cache = PROTECT(allocVector(STRSXP, n));
+        for (i = 0; i < n; ++i)
+            SET_STRING_ELT(cache, i, NA_STRING);
+        R_set_altrep_data2(x, cache);
+        UNPROTECT(1);
+    }
+    return cache;
+}
+
+
+static SEXP string_elt(SEXP x, R_xlen_t i)
+{
+    const char *z;
+    struct phy_node *node;
+    SEXP cache = string_cache(x);
+    SEXP elt = STRING_ELT(cache, i);
+    if (elt == NA_STRING)
+    {
+        node = phy_node_get(
+            (struct phy *)R_ExternalPtrAddr(R_altrep_data1(x)), (int)i);
+        if (R_altrep_inherits(x, label_class))
+            z = phy_node_label(node);
+        else
+            z = phy_node_note(node);
+        elt = z ? mkChar(z) : R_BlankString;
+        SET_STRING_ELT(cache, i, elt);
+    }
+    return elt;
+}
+
+
+static void *string_dataptr(SEXP x, Rboolean writeable)
+{
+    R_xlen_t i;
+    R_xlen_t n = string_length(x);
+    for (i = 0; i < n; ++i)
+        string_elt(x, i);
+    return (void *)STRING_PTR_RO(R_altrep_data2(x));
+}
+
+
+static void string_set_elt(SEXP x, R_xlen_t i, SEXP v)
+{
+    string_dataptr(x, TRUE);
+    SET_STRING_ELT(R_altrep_data2(x), i, v);
+}
+
+
+/*
+** Double vectors of branch lengths and ages
+*/
+
+static double *real_view(SEXP x)
+{
+    struct phy_flat *flat = (struct phy_flat *)R_ExternalPtrAddr(
+        R_altrep_data1(x));
+    return R_altrep_inherits(x, brlen_class) ? flat->brlen : flat->age;
+}
+
+
+static R_xlen_t real_length(SEXP x)
+{
+    return ((struct phy_flat *)R_ExternalPtrAddr(R_altrep_data1(x)))->nnode;
+}
+
+
+static const void *real_dataptr_or_null(SEXP x)
+{
+    SEXP copy = R_altrep_data2(x);
+    if (copy != R_NilValue)
+        return REAL_RO(copy);
+    return real_view(x);
+}
+
+
+static void *real_dataptr(SEXP x, Rboolean writeable)
+{
+    R_xlen_t n;
+    SEXP copy = R_altrep_data2(x);
+    if (copy != R_NilValue)
+        return REAL(copy);
+    if (!writeable)
+        return real_view(x);
+    n = real_length(x);
+    copy = PROTECT(allocVector(REALSXP, n));
+    memcpy(REAL(copy), real_view(x), n * sizeof(double));
+    R_set_altrep_data2(x, copy);
+    UNPROTECT(1);
+    return REAL(copy);
+}
+
+
+static double real_elt(SEXP x, R_xlen_t i)
+{
+    return ((const double *)real_dataptr_or_null(x))[i];
+}
+
+
+static R_xlen_t real_get_region(SEXP x, R_xlen_t i, R_xlen_t n, double *buf)
+{
+    R_xlen_t len = real_length(x);
+    if (n > len - i)
+        n = len - i;
+    memcpy(buf, (const double *)real_dataptr_or_null(x) + i,
+        n * sizeof(double));
+    return n;
+}
+
+
+SEXP phylo_tiplabels(SEXP rtree)
+{
+    return R_new_altrep(label_class, rtree, R_NilValue);
+}
+
+
+SEXP phylo_node_notes(SEXP rtree)
+{
+    return R_new_altrep(note_class, rtree, R_NilValue);
+}
+
+
+SEXP phylo_phy_node_brlens(SEXP rtree)
+{
+    return R_new_altrep(brlen_class, phylo_flat(rtree), R_NilValue);
+}
+
+
+SEXP phylo_phy_node_ages(SEXP rtree)
+{
+    return R_new_altrep(age_class, phylo_flat(rtree), R_NilValue);
+}
+
+
+static R_altrep_class_t string_class(const char *name, DllInfo *info)
+{
+    R_altrep_class_t cls = R_make_altstring_class(name, "phylo", info);
+    R_set_altrep_Length_method(cls, string_length);
+    R_set_altvec_Dataptr_method(cls, string_dataptr);
+    R_set_altstring_Elt_method(cls, string_elt);
+    R_set_altstring_Set_elt_method(cls, string_set_elt);
+    return cls;
+}
+
+
+static R_altrep_class_t real_class(const char *name, DllInfo *info)
+{
+    R_altrep_class_t cls = R_make_altreal_class(name, "phylo", info);
+    R_set_altrep_Length_method(cls, real_length);
+    R_set_altvec_Dataptr_method(cls, real_dataptr);
+    R_set_altvec_Dataptr_or_null_method(cls, real_dataptr_or_null);
+    R_set_altreal_Elt_method(cls, real_elt);
+    R_set_altreal_Get_region_method(cls, real_get_region);
+    return cls;
+}
+
+
+void phylo_altrep_init(DllInfo *info)
+{
+    label_class = string_class("phylo_label", info);
+    note_class = string_class("phylo_note", info);
+    brlen_class = real_class("phylo_brlen", info);
+    age_class = real_class("phylo_age", info);
+}
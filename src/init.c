@@ -9,20 +9,46 @@
 
 static const R_CallMethodDef CallEntries[] = {
     CALLDEF(phylo_phy_read_newickstr, 1),
-    CALLDEF(phylo_phy_write_newickstr, 1),
+    CALLDEF(phylo_phy_read_newick, 6),
+    CALLDEF(phylo_phy_write_newickstr, 2),
+    CALLDEF(phylo_phy_write_newickfile, 3),
+    CALLDEF(phylo_phy_duplicate, 1),
+    CALLDEF(phylo_phy_write_binary, 2),
+    CALLDEF(phylo_phy_read_binary, 1),
+    CALLDEF(phylo_phy_serialize, 1),
+    CALLDEF(phylo_phy_unserialize, 1),
+    CALLDEF(phylo_tree_refhook, 1),
     CALLDEF(phylo_tiplabels, 1),
     CALLDEF(phylo_node_notes, 1),
     CALLDEF(phylo_phy_node_brlens, 1),
     CALLDEF(phylo_phy_node_ages, 1),
+    CALLDEF(phylo_phy_node_depths, 1),
+    CALLDEF(phylo_phy_height, 1),
     CALLDEF(phylo_phy_node_ancestors, 2),
+    CALLDEF(phylo_phy_node_mrca, 3),
+    CALLDEF(phylo_phy_node_find, 2),
     CALLDEF(phylo_phy_node_children, 2),
+    CALLDEF(phylo_phy_node_clade, 2),
     CALLDEF(phylo_phy_node_descendants, 4),
+    CALLDEF(phylo_phy_node_descendants_v, 4),
+    CALLDEF(phylo_phy_parents, 1),
+    CALLDEF(phylo_phy_ancestors, 1),
+    CALLDEF(phylo_phy_children, 2),
     CALLDEF(phylo_phy_extract_clade, 2),
     CALLDEF(phylo_phy_extract_subtree, 3),
+    CALLDEF(phylo_phy_extract_subtrees, 3),
     CALLDEF(phylo_phy_ladderize, 2),
     CALLDEF(phylo_phy_node_rotate, 2),
-    CALLDEF(phylo_plot_cartesian, 3),
-    CALLDEF(phylo_plot_polar, 2),
+    CALLDEF(phylo_phy_reroot, 2),
+    CALLDEF(phylo_phy_unroot, 1),
+    CALLDEF(phylo_phy_consensus, 3),
+    CALLDEF(phylo_phy_rf, 3),
+    CALLDEF(phylo_phy_clade_freq, 2),
+    CALLDEF(phylo_phy_patristic, 3),
+    CALLDEF(phylo_phy_vcv, 3),
+    CALLDEF(phylo_phy_precision, 1),
+    CALLDEF(phylo_plot_layout, 1),
+    CALLDEF(phylo_plot_coords, 3),
     {NULL, NULL, 0}
 };
 
@@ -32,6 +58,7 @@ void attribute_visible R_init_phylo(DllInfo *info)
     R_registerRoutines(info, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(info, FALSE);
     R_forceSymbols(info, TRUE);
+    phylo_altrep_init(info);
 
     /* Register the C APIs for use by other packages */
     R_RegisterCCallable(
@@ -44,14 +71,47 @@ void attribute_visible R_init_phylo(DllInfo *info)
         "phylo", "phy_node_prune", (DL_FUNC) &phy_node_prune);
     R_RegisterCCallable(
         "phylo", "phy_build", (DL_FUNC) &phy_build);
+    R_RegisterCCallable(
+        "phylo", "phy_refresh", (DL_FUNC) &phy_refresh);
     R_RegisterCCallable(
         "phylo", "phy_read_newickstr", (DL_FUNC) &phy_read_newickstr);
+    R_RegisterCCallable(
+        "phylo", "phy_read_newickstr_v2", (DL_FUNC) &phy_read_newickstr_v2);
     R_RegisterCCallable(
         "phylo", "phy_write_newickstr", (DL_FUNC) &phy_write_newickstr);
+    R_RegisterCCallable(
+        "phylo", "phy_write_newickstr_v2", (DL_FUNC) &phy_write_newickstr_v2);
+    R_RegisterCCallable(
+        "phylo", "phy_write_newick", (DL_FUNC) &phy_write_newick);
+    R_RegisterCCallable(
+        "phylo", "phy_write_newick_many", (DL_FUNC) &phy_write_newick_many);
     R_RegisterCCallable(
         "phylo", "phy_read_newickfile", (DL_FUNC) &phy_read_newickfile);
     R_RegisterCCallable(
         "phylo", "phy_write_newickfile", (DL_FUNC) &phy_write_newickfile);
+    R_RegisterCCallable(
+        "phylo", "phy_write_newickfile_v2", (DL_FUNC) &phy_write_newickfile_v2);
+    R_RegisterCCallable(
+        "phylo", "phy_write_binarystr", (DL_FUNC) &phy_write_binarystr);
+    R_RegisterCCallable(
+        "phylo", "phy_read_binarystr", (DL_FUNC) &phy_read_binarystr);
+    R_RegisterCCallable(
+        "phylo", "phy_write_binary", (DL_FUNC) &phy_write_binary);
+    R_RegisterCCallable(
+        "phylo", "phy_read_binary", (DL_FUNC) &phy_read_binary);
+    R_RegisterCCallable(
+        "phylo", "phy_reader_open", (DL_FUNC) &phy_reader_open);
+    R_RegisterCCallable(
+        "phylo", "phy_reader_openstr", (DL_FUNC) &phy_reader_openstr);
+    R_RegisterCCallable(
+        "phylo", "phy_reader_next", (DL_FUNC) &phy_reader_next);
+    R_RegisterCCallable(
+        "phylo", "phy_reader_readall", (DL_FUNC) &phy_reader_readall);
+    R_RegisterCCallable(
+        "phylo", "phy_reader_close", (DL_FUNC) &phy_reader_close);
+    R_RegisterCCallable(
+        "phylo", "phy_read_newickfile_foreach",
+        (DL_FUNC) &phy_read_newickfile_foreach);
     R_RegisterCCallable(
         "phylo", "phy_free", (DL_FUNC) &phy_free);
     R_RegisterCCallable(
@@ -66,14 +126,30 @@ void attribute_visible R_init_phylo(DllInfo *info)
         "phylo", "phy_extract_clade", (DL_FUNC) &phy_extract_clade);
     R_RegisterCCallable(
         "phylo", "phy_extract_subtree", (DL_FUNC) &phy_extract_subtree);
+    R_RegisterCCallable(
+        "phylo", "phy_extract_subtrees", (DL_FUNC) &phy_extract_subtrees);
     R_RegisterCCallable(
         "phylo", "phy_node_rotate", (DL_FUNC) &phy_node_rotate);
+    R_RegisterCCallable(
+        "phylo", "phy_nni", (DL_FUNC) &phy_nni);
+    R_RegisterCCallable(
+        "phylo", "phy_spr", (DL_FUNC) &phy_spr);
+    R_RegisterCCallable(
+        "phylo", "phy_tbr", (DL_FUNC) &phy_tbr);
+    R_RegisterCCallable(
+        "phylo", "phy_move_undo", (DL_FUNC) &phy_move_undo);
     R_RegisterCCallable(
         "phylo", "phy_duplicate", (DL_FUNC) &phy_duplicate);
     R_RegisterCCallable(
         "phylo", "phy_reroot", (DL_FUNC) &phy_reroot);
     R_RegisterCCallable(
         "phylo", "phy_unroot", (DL_FUNC) &phy_unroot);
+    R_RegisterCCallable(
+        "phylo", "phy_reroot_inplace", (DL_FUNC) &phy_reroot_inplace);
+    R_RegisterCCallable(
+        "phylo", "phy_unroot_inplace", (DL_FUNC) &phy_unroot_inplace);
+    R_RegisterCCallable(
+        "phylo", "phy_reroot_foreach", (DL_FUNC) &phy_reroot_foreach);
     R_RegisterCCallable(
         "phylo", "phy_node_brlen", (DL_FUNC) &phy_node_brlen);
     R_RegisterCCallable(
@@ -108,12 +184,32 @@ void attribute_visible R_init_phylo(DllInfo *info)
         "phylo", "phy_node_get", (DL_FUNC) &phy_node_get);
     R_RegisterCCallable(
         "phylo", "phy_node_find", (DL_FUNC) &phy_node_find);
+    R_RegisterCCallable(
+        "phylo", "phy_node_find_many", (DL_FUNC) &phy_node_find_many);
     R_RegisterCCallable(
         "phylo", "phy_node_set_data", (DL_FUNC) &phy_node_set_data);
     R_RegisterCCallable(
         "phylo", "phy_node_set_index", (DL_FUNC) &phy_node_set_index);
     R_RegisterCCallable(
         "phylo", "phy_node_set_brlen", (DL_FUNC) &phy_node_set_brlen);
+    R_RegisterCCallable(
+        "phylo", "phy_ages", (DL_FUNC) &phy_ages);
+    R_RegisterCCallable(
+        "phylo", "phy_depths", (DL_FUNC) &phy_depths);
+    R_RegisterCCallable(
+        "phylo", "phy_height", (DL_FUNC) &phy_height);
+    R_RegisterCCallable(
+        "phylo", "phy_levels", (DL_FUNC) &phy_levels);
+    R_RegisterCCallable(
+        "phylo", "phy_patristic", (DL_FUNC) &phy_patristic);
+    R_RegisterCCallable(
+        "phylo", "phy_patristic_write", (DL_FUNC) &phy_patristic_write);
+    R_RegisterCCallable(
+        "phylo", "phy_vcv", (DL_FUNC) &phy_vcv);
+    R_RegisterCCallable(
+        "phylo", "phy_vcv_write", (DL_FUNC) &phy_vcv_write);
+    R_RegisterCCallable(
+        "phylo", "phy_precision", (DL_FUNC) &phy_precision);
     R_RegisterCCallable(
         "phylo", "phy_node_set_label", (DL_FUNC) &phy_node_set_label);
     R_RegisterCCallable(
@@ -122,10 +218,47 @@ void attribute_visible R_init_phylo(DllInfo *info)
         "phylo", "phy_node_spanning_pair", (DL_FUNC) &phy_node_spanning_pair);
     R_RegisterCCallable(
         "phylo", "phy_node_spanning_index", (DL_FUNC) &phy_node_spanning_index);
+    R_RegisterCCallable(
+        "phylo", "phy_node_clade", (DL_FUNC) &phy_node_clade);
+    R_RegisterCCallable(
+        "phylo", "phy_node_isdesc", (DL_FUNC) &phy_node_isdesc);
     R_RegisterCCallable(
         "phylo", "phy_node_mrca", (DL_FUNC) &phy_node_mrca);
+    R_RegisterCCallable(
+        "phylo", "phy_lca_new", (DL_FUNC) &phy_lca_new);
+    R_RegisterCCallable(
+        "phylo", "phy_lca_query", (DL_FUNC) &phy_lca_query);
+    R_RegisterCCallable(
+        "phylo", "phy_lca_query_v", (DL_FUNC) &phy_lca_query_v);
+    R_RegisterCCallable(
+        "phylo", "phy_lca_free", (DL_FUNC) &phy_lca_free);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_new", (DL_FUNC) &phy_splits_new);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_add", (DL_FUNC) &phy_splits_add);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_ntree", (DL_FUNC) &phy_splits_ntree);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_ntip", (DL_FUNC) &phy_splits_ntip);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_nsplit", (DL_FUNC) &phy_splits_nsplit);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_count", (DL_FUNC) &phy_splits_count);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_tips", (DL_FUNC) &phy_splits_tips);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_label", (DL_FUNC) &phy_splits_label);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_consensus", (DL_FUNC) &phy_splits_consensus);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_rf", (DL_FUNC) &phy_splits_rf);
+    R_RegisterCCallable(
+        "phylo", "phy_splits_free", (DL_FUNC) &phy_splits_free);
     R_RegisterCCallable(
         "phylo", "phy_node_foreach", (DL_FUNC) &phy_node_foreach);
+    R_RegisterCCallable(
+        "phylo", "phy_node_foreach_parallel",
+        (DL_FUNC) &phy_node_foreach_parallel);
     R_RegisterCCallable(
         "phylo", "phy_cursor_alloc", (DL_FUNC) &phy_cursor_alloc);
     R_RegisterCCallable(
@@ -136,4 +269,22 @@ void attribute_visible R_init_phylo(DllInfo *info)
         "phylo", "phy_node_note", (DL_FUNC) &phy_node_note);
     R_RegisterCCallable(
         "phylo", "phy_errmsg", (DL_FUNC) &phy_errmsg);
+    R_RegisterCCallable(
+        "phylo", "phy_strerror", (DL_FUNC) &phy_strerror);
+    R_RegisterCCallable(
+        "phylo", "phy_flatten", (DL_FUNC) &phy_flatten);
+    R_RegisterCCallable(
+        "phylo", "phy_flat_free", (DL_FUNC) &phy_flat_free);
+    R_RegisterCCallable(
+        "phylo", "phy_layout_new", (DL_FUNC) &phy_layout_new);
+    R_RegisterCCallable(
+        "phylo", "phy_layout_collapse", (DL_FUNC) &phy_layout_collapse);
+    R_RegisterCCallable(
+        "phylo", "phy_layout_cull", (DL_FUNC) &phy_layout_cull);
+    R_RegisterCCallable(
+        "phylo", "phy_layout_free", (DL_FUNC) &phy_layout_free);
+    R_RegisterCCallable(
+        "phylo", "phy_stats", (DL_FUNC) &phy_stats);
+    R_RegisterCCallable(
+        "phylo", "phy_stats_reset", (DL_FUNC) &phy_stats_reset);
 }
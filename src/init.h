@@ -3,23 +3,52 @@
 
 #include <R.h>
 #include <Rinternals.h>
+#include <R_ext/Rdynload.h>
 
-/* treeio.c */
-SEXP phylo_phy_read_newickstr(SEXP);
-SEXP phylo_phy_write_newickstr(SEXP);
+/* altrep.c */
 SEXP phylo_tiplabels(SEXP);
 SEXP phylo_node_notes(SEXP);
 SEXP phylo_phy_node_brlens(SEXP);
 SEXP phylo_phy_node_ages(SEXP);
+void phylo_altrep_init(DllInfo *);
+/* treeio.c */
+SEXP phylo_phy_read_newickstr(SEXP);
+SEXP phylo_phy_read_newick(SEXP, SEXP, SEXP, SEXP, SEXP, SEXP);
+SEXP phylo_phy_write_newickstr(SEXP, SEXP);
+SEXP phylo_phy_write_newickfile(SEXP, SEXP, SEXP);
+SEXP phylo_phy_duplicate(SEXP);
+SEXP phylo_phy_write_binary(SEXP, SEXP);
+SEXP phylo_phy_read_binary(SEXP);
+SEXP phylo_phy_serialize(SEXP);
+SEXP phylo_phy_unserialize(SEXP);
+SEXP phylo_tree_refhook(SEXP);
+SEXP phylo_phy_node_depths(SEXP);
+SEXP phylo_phy_height(SEXP);
 SEXP phylo_phy_node_ancestors(SEXP, SEXP);
+SEXP phylo_phy_node_mrca(SEXP, SEXP, SEXP);
+SEXP phylo_phy_node_find(SEXP, SEXP);
 SEXP phylo_phy_node_children(SEXP, SEXP);
+SEXP phylo_phy_node_clade(SEXP, SEXP);
 SEXP phylo_phy_node_descendants(SEXP, SEXP, SEXP, SEXP);
+SEXP phylo_phy_node_descendants_v(SEXP, SEXP, SEXP, SEXP);
+SEXP phylo_phy_parents(SEXP);
+SEXP phylo_phy_ancestors(SEXP);
+SEXP phylo_phy_children(SEXP, SEXP);
 SEXP phylo_phy_extract_clade(SEXP, SEXP);
 SEXP phylo_phy_extract_subtree(SEXP, SEXP, SEXP);
+SEXP phylo_phy_extract_subtrees(SEXP, SEXP, SEXP);
 SEXP phylo_phy_ladderize(SEXP, SEXP);
 SEXP phylo_phy_node_rotate(SEXP, SEXP);
+SEXP phylo_phy_reroot(SEXP, SEXP);
+SEXP phylo_phy_unroot(SEXP);
+SEXP phylo_phy_consensus(SEXP, SEXP, SEXP);
+SEXP phylo_phy_rf(SEXP, SEXP, SEXP);
+SEXP phylo_phy_clade_freq(SEXP, SEXP);
+SEXP phylo_phy_patristic(SEXP, SEXP, SEXP);
+SEXP phylo_phy_vcv(SEXP, SEXP, SEXP);
+SEXP phylo_phy_precision(SEXP);
 /* treeplot.c */
-SEXP phylo_plot_cartesian(SEXP, SEXP, SEXP);
-SEXP phylo_plot_polar(SEXP, SEXP);
+SEXP phylo_plot_layout(SEXP);
+SEXP phylo_plot_coords(SEXP, SEXP, SEXP);
 
 #endif
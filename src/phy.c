@@ -1,12 +1,119 @@
 #include "phy.h"
+#include <stdint.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define PHY_MMAP 1
+#endif
 
 #define PHY_ERR1 "cannot allocate memory"
 #define PHY_ERR2 "encountered unexpected character in Newick string node label/branch length"
 #define PHY_ERR3 "detected unifurcation in Newick string"
 #define PHY_ERR4 "malformed Newick string"
+#define PHY_ERR5 "cannot open file"
+#define PHY_ERR6 "malformed binary tree data"
+#define PHY_ERR7 "invalid tree rearrangement"
+#define PHY_ERR8 "trees do not share a common set of uniquely labelled tips"
+#define PHY_ERR9 "branch lengths must be positive"
+#define PHY_ERR10 "invalid argument"
+
+/* Number of bytes a phy_reader requests from its file at a time */
+#define READER_CHUNK 65536
+
+/* Upper bounds on the number of trees and bytes of Newick text gathered
+** before a batch is handed off to be parsed by phy_reader_readall */
+#define READER_BATCH 4096
+#define READER_BATCHSZ (16 << 20)
+
+/* Binary tree format. All integers are stored little-endian.
+**
+**   bytes 0-3     magic "PHYB"
+**   bytes 4-7     format version (BINARY_VERSION)
+**   bytes 8-11    number of terminal nodes
+**   bytes 12-15   number of nodes, n
+**   n x int32     preorder position of each node's parent (-1 at the root)
+**   n x float64   branch lengths in preorder
+**   n x uint32    label lengths in preorder (0 if the node is unlabeled)
+**   n x uint32    note lengths in preorder (0 if the node has no note)
+**   labels, then notes, concatenated in preorder without terminators
+*/
+#define BINARY_VERSION 1
+#define BINARY_HEADER 16
+
+/* Ownership flags for a node. Nodes and strings created while reading a
+** Newick string live in storage owned by the phylogeny (see struct phy)
+** and must not be handed to free() individually. */
+#define NODE_ARENA 1
+#define NODE_LAB_POOL 2
+#define NODE_NOTE_POOL 4
+
+/* Scratch flag used while locating the common ancestor of two nodes */
+#define NODE_MARK 8
 
 static int phy_errno = 0;
 
+// Each thread sees its own error code
+#ifdef _OPENMP
+#pragma omp threadprivate(phy_errno)
+#endif
+
+/* Lazily built caches (ages, the label table) are built under the
+** phy_cache lock and published with a release store so that a reader
+** seeing the pointer also sees the contents. */
+#ifdef __GNUC__
+#define LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define LOAD(x) (x)
+#define STORE(x, v) ((x) = (v))
+#endif
+
+/* Counters for phy_stats. Allocations are counted by routing this file's
+** calls to malloc, calloc and realloc through the wrappers below, so that
+** nothing outside this block needs to know about them. */
+#ifdef PHY_STATS
+static struct phy_stats stats;
+
+static void stats_add(size_t *counter, size_t n)
+{
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+    *counter += n;
+}
+
+static void *stats_malloc(size_t n)
+{
+    stats_add(&stats.nalloc, 1);
+    stats_add(&stats.nbyte, n);
+    return malloc(n);
+}
+
+static void *stats_calloc(size_t n, size_t size)
+{
+    stats_add(&stats.nalloc, 1);
+    stats_add(&stats.nbyte, n * size);
+    return calloc(n, size);
+}
+
+static void *stats_realloc(void *p, size_t n)
+{
+    stats_add(&stats.nalloc, 1);
+    stats_add(&stats.nbyte, n);
+    return realloc(p, n);
+}
+
+#define malloc(n) stats_malloc(n)
+#define calloc(n, size) stats_calloc(n, size)
+#define realloc(p, n) stats_realloc(p, n)
+#define STAT(counter, n) stats_add(&stats.counter, (n))
+#else
+#define STAT(counter, n) ((void)0)
+#endif
+
 /**********************************************************************
 **
 ** Internal functions and definitions of opaque structures
@@ -27,6 +134,9 @@ struct phy_node {
     /* Number of immediate descendants */
     int ndesc;
 
+    /* Bitwise OR of the NODE_* ownership flags */
+    int flags;
+
     /* Name of node */
     char *lab;
 
@@ -53,6 +163,13 @@ struct phy_node {
     ** is a terminal node). It is always a terminal node if not null. */
     struct phy_node *lastvisit;
 
+    /* Index of the first terminal node visited in a preorder traversal
+    ** of the subtree rooted at this node (the node's own index if it is
+    ** a terminal node). Terminal nodes are numbered in preorder, so the
+    ** terminal nodes of the clade have the indices firsttip through
+    ** lastvisit->index. */
+    int firsttip;
+
     /* The length of the branch that leads to this node */
     double brlen;
 
@@ -61,17 +178,11 @@ struct phy_node {
 
     /* Function pointer to free data held by node */
     void (*data_free)(void *);
-};
 
-
-struct phy_cursor {
-    int visit;
-    int order;
-    int cursor;
+    /* Phylogeny the node was last built into (NULL if none). Used to
+    ** invalidate the phylogeny's cached quantities when the node is
+    ** modified. */
     struct phy *phy;
-    struct phy_node *begin;
-    struct phy_node *end;
-    struct phy_node *next;
 };
 
 
@@ -101,90 +212,245 @@ struct phy {
 
     /* State information for phylogeny traversal */
     struct phy_cursor cursor;
+
+    /* Contiguous blocks holding the nodes and the label/note strings
+    ** of a phylogeny read from a Newick string (both NULL otherwise).
+    ** They are released in bulk by phy_free. */
+    struct phy_node *arena;
+    char *pool;
+
+    /* Cached node ages and depths (number of edges from the root),
+    ** indexed by node index, and the tree height. Computed on demand by
+    ** phy_ages and discarded by invalidate when the phylogeny changes.
+    ** The depths share the allocation made for the ages. */
+    double *age;
+    int *depth;
+    double height;
+
+    /* Cached execution schedule: the nnode node indices grouped by height
+    ** (number of edges to the furthest descendant tip) followed by the
+    ** nlevel + 1 offsets of the groups. Computed on demand by phy_levels
+    ** and discarded with the ages. */
+    int *level;
+    int nlevel;
+
+    /* Root of the smallest subtree known to contain every topology edit
+    ** made since the traversal arrays were last brought up to date, or
+    ** NULL if they are current. Set by the editing functions and cleared
+    ** by refresh, which renumbers only this subtree when it can. */
+    struct phy_node *dirty;
+
+    /* Open-addressing hash table of the labelled nodes, keyed on label,
+    ** with mask + 1 slots (a power of two). Built on demand by
+    ** phy_node_find and discarded when a label or the topology changes. */
+    struct phy_node **labels;
+    size_t mask;
+
+    /* Generation-stamped node marks indexed by node index: a node is
+    ** marked if its entry equals gen. The array is allocated on first use
+    ** and kept, so that clearing every mark only takes a new generation. */
+    unsigned int *mark;
+    unsigned int gen;
 };
 
 
 struct newick_reader {
-    unsigned int n;
-    unsigned int nAlloc;
-    unsigned int cursor;
+    size_t cursor;
     unsigned int ntip;
     unsigned int nnode;
-    char *z;
+    /* Text being parsed. It need not be NUL-terminated. */
     const char *newick;
+    size_t len;
     struct phy_node *q;
     struct phy_node *p;
     struct phy_node *root;
+    /* Error code of the first error encountered */
+    int err;
+    /* Node arena and string pool sized by reader_alloc */
+    unsigned int narena;
+    struct phy_node *arena;
+    size_t npool;
+    size_t poolsz;
+    char *pool;
+};
+
+
+/* A phy_reader splits a stream of Newick text into individual trees. Where
+** possible a file is mapped into memory and, as for a string, trees are
+** parsed directly from the input without being copied. Otherwise the input
+** is consumed READER_CHUNK bytes at a time and only the text of the tree
+** currently being assembled is retained. */
+struct phy_reader {
+    /* Input file (NULL when the whole input is in memory) */
+    FILE *in;
+
+    /* Memory mapping of the input file, if any */
+    void *map;
+    size_t mapsz;
+
+    /* Buffered input and the read position within it */
+    char *buf;
+    const char *chunk;
+    size_t nchunk;
+    size_t pos;
+
+    /* Text of the tree being assembled */
+    char *tree;
+    size_t ntree;
+    size_t nAlloc;
 };
 
 
+/* Output buffer of the Newick writer. When out is set the buffer has a
+** fixed size and is flushed to out whenever it fills, otherwise it grows
+** to hold the whole string. */
 struct newick_writer {
-    unsigned int n;
-    unsigned int nAlloc;
+    size_t n;
+    size_t nAlloc;
     char *newick;
+    FILE *out;
+    /* Significant digits of branch lengths, or 0 for the shortest string
+    ** that reads back to the same double */
+    int digits;
 };
 
+// Size of the buffer used when streaming Newick text to a file
+#define NEWICK_CHUNK 65536
+
+// Upper bound on the characters written for one branch length
+#define NEWICK_BRLEN_MAX 32
+
+
+static struct phy_node *node_new()
+{
+    struct phy_node *node = malloc(sizeof(struct phy_node));
+    if (!node)
+    {
+        phy_errno = 1;
+        return NULL;
+    }
+    node->index = -1;
+    node->ndesc = 0;
+    node->flags = 0;
+    node->lab = 0;
+    node->note = 0;
+    node->lfdesc = 0;
+    node->next = 0;
+    node->prev = 0;
+    node->anc = 0;
+    node->lastvisit = 0;
+    node->firsttip = -1;
+    node->brlen = 0;
+    node->data = 0;
+    node->data_free = 0;
+    node->phy = 0;
+    return node;
+}
+
+
+static void node_free(struct phy_node *node)
+{
+    if (node)
+    {
+        if (node->data && node->data_free)
+            node->data_free(node->data);
+        if (!(node->flags & NODE_LAB_POOL))
+            free(node->lab);
+        if (!(node->flags & NODE_NOTE_POOL))
+            free(node->note);
+        if (!(node->flags & NODE_ARENA))
+            free(node);
+    }
+}
+
 
 /* This function is called on the root node whenever
 ** an error is encountered during the process of
 ** building the phylogeny. */
 static void cleanup(struct phy_node *root)
 {
-    struct phy_node *q, *r, *p = root;
+    struct phy_node *q, *p = root;
 
     while (p)
     {
         if (p->lfdesc)
             p = p->lfdesc;
-        else if (p->next)
-            p = p->next;
         else
         {
-            // on entry p is a terminal node that marks a clade
-            // boundary. this will be the last node visited in a
-            // preorder traversal of the subtree rooted at each node
-            // on the path back from this node up to and including the
-            // first encountered node with a ->next sibling
-            q = p->prev;
-            while (q != 0)
-            {
-                r = q;
-                q = q->prev;
-                free(r->lab);
-                free(r->note);
-                free(r);
-                r = 0;
-            }
-            while (p->anc != 0 && p->next == 0)
-            {
-                q = p;
-                p = p->anc;
-                free(q->lab);
-                free(r->note);
-                free(q);
-                q = 0;
-            }
+            // on entry p is a terminal node (or an internal node whose
+            // descendants have all been free'd) and is always the head
+            // of its parent's child list. unlink it and continue with its
+            // next sibling, or with its parent if it has none
             q = p;
-            p = p->next;
-            free(q->lab);
-            free(r->note);
-            free(q);
-            q = 0;
+            if (p->anc)
+                p->anc->lfdesc = p->next;
+            p = p->next ? p->next : p->anc;
+            node_free(q);
         }
     }
 }
 
 
-static struct phy_node *node_new()
+/* Size the node arena and string pool for a Newick string. Every '(' and
+** ',' outside of a note introduces exactly one new node, so the number of
+** nodes is known before parsing begins. The combined length of all labels
+** and notes is bounded by the length of the string. */
+static int reader_alloc(struct newick_reader *ctx)
 {
-    struct phy_node *node = malloc(sizeof(struct phy_node));
-    if (!node)
+    int depth = 0;
+    unsigned int nnode = 1;
+    const char *z;
+
+    for (z = ctx->newick; z < ctx->newick + ctx->len; ++z)
     {
-        phy_errno = 1;
+        switch (*z)
+        {
+            case '[':
+                ++depth;
+                break;
+            case ']':
+                if (depth)
+                    --depth;
+                break;
+            case '(':
+            case ',':
+                if (!depth)
+                    ++nnode;
+                break;
+            default:;
+        }
+    }
+
+    ctx->narena = nnode;
+    ctx->poolsz = ctx->len + 2 * (size_t)nnode;
+    ctx->arena = malloc(nnode * sizeof(struct phy_node));
+    ctx->pool = malloc(ctx->poolsz);
+    if (!ctx->arena || !ctx->pool)
+    {
+        free(ctx->arena);
+        free(ctx->pool);
+        ctx->arena = 0;
+        ctx->pool = 0;
+        ctx->err = 1;
+        return PHY_ERR;
+    }
+    return PHY_OK;
+}
+
+
+// Take the next unused node from the arena
+static struct phy_node *reader_node(struct newick_reader *ctx)
+{
+    struct phy_node *node;
+    if (ctx->nnode >= ctx->narena)
+    {
+        ctx->err = 4;
         return NULL;
     }
+    node = ctx->arena + ctx->nnode++;
     node->index = -1;
     node->ndesc = 0;
+    node->flags = NODE_ARENA;
     node->lab = 0;
     node->note = 0;
     node->lfdesc = 0;
@@ -192,23 +458,34 @@ static struct phy_node *node_new()
     node->prev = 0;
     node->anc = 0;
     node->lastvisit = 0;
+    node->firsttip = -1;
     node->brlen = 0;
     node->data = 0;
     node->data_free = 0;
+    node->phy = 0;
     return node;
 }
 
 
-static void node_free(struct phy_node *node)
+// Return the next character of the Newick string, or NUL past its end
+static char reader_char(struct newick_reader *ctx)
 {
-    if (node)
-    {
-        if (node->data && node->data_free)
-            node->data_free(node->data);
-        free(node->lab);
-        free(node->note);
-        free(node);
-    }
+    if (ctx->cursor < ctx->len)
+        return ctx->newick[ctx->cursor++];
+    ctx->cursor++;
+    return '\0';
+}
+
+
+// Copy n characters of the Newick string into the string pool
+static char *reader_string(
+    struct newick_reader *ctx, size_t offset, size_t n)
+{
+    char *z = ctx->pool + ctx->npool;
+    memcpy(z, ctx->newick + offset, n);
+    z[n] = 0;
+    ctx->npool += n + 1;
+    return z;
 }
 
 
@@ -217,9 +494,10 @@ static int read_label(struct newick_reader *ctx)
 {
     char c;
     int toread = 1;
+    size_t start = ctx->cursor;
     while (toread)
     {
-        c = ctx->newick[ctx->cursor++];
+        c = reader_char(ctx);
         switch (c)
         {
             case ':':
@@ -238,38 +516,19 @@ static int read_label(struct newick_reader *ctx)
             case '\f':
             case '(':
             case ']':
-                phy_errno = 2;
+                ctx->err = 2;
                 return PHY_ERR;
             case '\0':
-                phy_errno = 4;
+                ctx->err = 4;
                 return PHY_ERR;
-            default:
-                if (ctx->n == ctx->nAlloc)
-                {
-                    ctx->nAlloc += 100;
-                    ctx->z = realloc(ctx->z, ctx->nAlloc);
-                    if (!ctx->z)
-                    {
-                        phy_errno = 1;
-                        return PHY_ERR;
-                    }
-                }
-                ctx->z[ctx->n++] = c;
+            default:;
         }
     }
-    ctx->z[ctx->n] = 0;
-    if (ctx->n)
+    if (ctx->cursor > start)
     {
-        ctx->p->lab = calloc(ctx->n+1, 1);
-        if (!ctx->p->lab)
-        {
-            phy_errno = 1;
-            ctx->p->lab = 0;
-            return PHY_ERR;
-        }
-        strcpy(ctx->p->lab, ctx->z);
+        ctx->p->lab = reader_string(ctx, start, ctx->cursor - start);
+        ctx->p->flags |= NODE_LAB_POOL;
     }
-    ctx->n = 0;
     return PHY_OK;
 }
 
@@ -279,49 +538,31 @@ static int read_note(struct newick_reader *ctx)
 {
     char c;
     int opened;
-    c = ctx->newick[ctx->cursor++];
+    size_t start;
+    c = reader_char(ctx);
     if (c == '[')
     {
         opened = 1;
-        while ((c = ctx->newick[ctx->cursor++]), opened > 0)
+        start = ctx->cursor;
+        while (opened > 0)
         {
+            c = reader_char(ctx);
             if (c == '\0')
             {
-                phy_errno = 4;
+                ctx->err = 4;
                 return PHY_ERR;
             }
             if (c == '[')
                 ++opened;
             else if (c == ']')
                 --opened;
-            if (opened)
-            {
-                if (ctx->n == ctx->nAlloc)
-                {
-                    ctx->nAlloc += 100;
-                    ctx->z = realloc(ctx->z, ctx->nAlloc);
-                    if (!ctx->z)
-                    {
-                        phy_errno = 1;
-                        return PHY_ERR;
-                    }
-                }
-                ctx->z[ctx->n++] = c;
-            }
         }
-        ctx->z[ctx->n] = 0;
-        if (ctx->n)
+        // the closing bracket is not part of the note
+        if (ctx->cursor - 1 > start)
         {
-            ctx->p->note = calloc(ctx->n+1, 1);
-            if (!ctx->p->note)
-            {
-                phy_errno = 1;
-                ctx->p->note = 0;
-                return PHY_ERR;
-            }
-            strcpy(ctx->p->note, ctx->z);
+            ctx->p->note = reader_string(ctx, start, ctx->cursor - 1 - start);
+            ctx->p->flags |= NODE_NOTE_POOL;
         }
-        ctx->n = 0;
     }
     else
         ctx->cursor--;
@@ -329,67 +570,111 @@ static int read_note(struct newick_reader *ctx)
 }
 
 
+/* Powers of ten that are exactly representable as doubles */
+static const double pow10_exact[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+
+/* Convert the n characters of a branch length at z to a double. When the
+** significand fits in 53 bits and the decimal exponent is no more than 22
+** in magnitude the result is the correctly rounded product or quotient of
+** two exact doubles. Anything else, including the malformed strings that
+** atof would partially convert, is handed to strtod. The character
+** following the branch length is always one of ",);" so strtod cannot run
+** past it. */
+static double parse_brlen(const char *z, size_t n)
+{
+    int neg = 0;
+    int eneg = 0;
+    int nd = 0;
+    int exp = 0;
+    int e = 0;
+    size_t i = 0;
+    unsigned long long m = 0;
+    double v;
+
+    if (z[i] == '-' || z[i] == '+')
+        neg = z[i++] == '-';
+    for (; i < n && z[i] >= '0' && z[i] <= '9'; ++i, ++nd)
+        m = 10 * m + (z[i] - '0');
+    if (i < n && z[i] == '.')
+    {
+        for (++i; i < n && z[i] >= '0' && z[i] <= '9'; ++i, ++nd, --exp)
+            m = 10 * m + (z[i] - '0');
+    }
+    if (!nd || nd > 19)
+        return strtod(z, NULL);
+    if (i < n && z[i] == 'e')
+    {
+        if (++i < n && (z[i] == '-' || z[i] == '+'))
+            eneg = z[i++] == '-';
+        if (i == n)
+            return strtod(z, NULL);
+        for (; i < n && z[i] >= '0' && z[i] <= '9'; ++i)
+        {
+            if (e < 10000)
+                e = 10 * e + (z[i] - '0');
+        }
+        exp += eneg ? -e : e;
+    }
+    if (i < n || m > (1ULL << 53) || exp < -22 || exp > 22)
+        return strtod(z, NULL);
+    v = (double)m;
+    v = exp < 0 ? v / pow10_exact[-exp] : v * pow10_exact[exp];
+    return neg ? -v : v;
+}
+
+
 // Read off a branch length in a Newick string. Return 0 if successful, 1 on error
 static int read_brlen(struct newick_reader *ctx)
 {
     char c;
-    int toread = 1;
-    c = ctx->newick[ctx->cursor++];
-    if (c == ':')
+    size_t start;
+    c = reader_char(ctx);
+    if (c != ':')
     {
-        while (toread)
+        ctx->cursor--;
+        return PHY_OK;
+    }
+    start = ctx->cursor;
+    for (;;)
+    {
+        c = reader_char(ctx);
+        switch (c)
         {
-            c = ctx->newick[ctx->cursor++];
-            switch (c)
-            {
-                case 'e':
-                case '-':
-                case '+':
-                case '0':
-                case '1':
-                case '2':
-                case '3':
-                case '4':
-                case '5':
-                case '6':
-                case '7':
-                case '8':
-                case '9':
-                case '.':
-                    if (ctx->n == ctx->nAlloc)
-                    {
-                        ctx->nAlloc += 100;
-                        ctx->z = realloc(ctx->z, ctx->nAlloc);
-                        if (!ctx->z)
-                        {
-                            phy_errno = 1;
-                            return PHY_ERR;
-                        }
-                    }
-                    ctx->z[ctx->n++] = c;
-                    break;
-                case ',':
-                case ')':
-                case ';':
-                    ctx->cursor--;
-                    toread = 0;
-                    break;
-                case '\0':
-                    phy_errno = 4;
-                    return PHY_ERR;
-                default:
-                    phy_errno = 2;
-                    return PHY_ERR;
-            }
+            case 'e':
+            case '-':
+            case '+':
+            case '0':
+            case '1':
+            case '2':
+            case '3':
+            case '4':
+            case '5':
+            case '6':
+            case '7':
+            case '8':
+            case '9':
+            case '.':
+                break;
+            case ',':
+            case ')':
+            case ';':
+                ctx->cursor--;
+                if (ctx->cursor > start)
+                    ctx->p->brlen = parse_brlen(
+                        ctx->newick + start, ctx->cursor - start);
+                return PHY_OK;
+            case '\0':
+                ctx->err = 4;
+                return PHY_ERR;
+            default:
+                ctx->err = 2;
+                return PHY_ERR;
         }
     }
-    else
-        ctx->cursor--;
-    ctx->z[ctx->n] = 0;
-    if (ctx->n)
-        ctx->p->brlen = atof(ctx->z);
-    ctx->n = 0;
-    return PHY_OK;
 }
 
 
@@ -398,21 +683,17 @@ static struct phy_node *read_newick(struct newick_reader *ctx)
 {
     char c;
 
-    if (ctx->newick[strlen(ctx->newick)-1] != ';')
+    if (!ctx->len || ctx->newick[ctx->len-1] != ';')
     {
-        phy_errno = 4;
+        ctx->err = 4;
         return NULL;
     }
 
-    ctx->nnode++;
-    ctx->root = node_new();
+    ctx->root = reader_node(ctx);
     if (ctx->root == NULL)
-    {
-        phy_errno = 1;
         return NULL;
-    }
     ctx->p = ctx->root;
-    while ((c = ctx->newick[ctx->cursor++]) != ';')
+    while ((c = reader_char(ctx)) != ';')
     {
         switch (c)
         {
@@ -421,40 +702,24 @@ static struct phy_node *read_newick(struct newick_reader *ctx)
                     ctx->newick[ctx->cursor-2] == ','
                     || ctx->newick[ctx->cursor-2] == '('))
                 {
-                    phy_errno = 4;
+                    ctx->err = 4;
                     return NULL;
                 }
-                ctx->nnode++;
-                ctx->q = node_new();
+                ctx->q = reader_node(ctx);
                 if (ctx->q == NULL)
-                {
-                    phy_errno = 1;
                     return NULL;
-                }
                 phy_node_add_child(ctx->p, ctx->q);
                 ctx->p = ctx->q;
                 break;
             case ',':
-                ctx->nnode++;
-                if (!ctx->p->anc && ctx->p != ctx->root)
-                {
-                    phy_errno = 4;
-                    free(ctx->p->lab);
-                    free(ctx->p->note);
-                    free(ctx->p);
-                    return NULL;
-                }
-                else if (ctx->p == ctx->root)
+                if (ctx->p == ctx->root)
                 {
-                    phy_errno = 4;
+                    ctx->err = 4;
                     return NULL;
                 }
-                ctx->q = node_new();
+                ctx->q = reader_node(ctx);
                 if (ctx->q == NULL)
-                {
-                    phy_errno = 1;
                     return NULL;
-                }
                 phy_node_add_child(ctx->p->anc, ctx->q);
                 if (!ctx->p->ndesc)
                     ctx->ntip++;
@@ -463,23 +728,15 @@ static struct phy_node *read_newick(struct newick_reader *ctx)
             case ')':
                 if (!ctx->p->ndesc)
                     ctx->ntip++;
-                if (!ctx->p->anc && ctx->p != ctx->root)
-                {
-                    phy_errno = 4;
-                    free(ctx->p->lab);
-                    free(ctx->p->note);
-                    free(ctx->p);
-                    return NULL;
-                }
-                else if (ctx->p == ctx->root)
+                if (ctx->p == ctx->root)
                 {
-                    phy_errno = 4;
+                    ctx->err = 4;
                     return NULL;
                 }
                 ctx->p = ctx->p->anc;
                 if (ctx->p->ndesc < 2)
                 {
-                    phy_errno = 3;
+                    ctx->err = 3;
                     return NULL;
                 }
                 break;
@@ -493,267 +750,740 @@ static struct phy_node *read_newick(struct newick_reader *ctx)
                     return NULL;
         }
     }
+    if (ctx->p != ctx->root)
+    {
+        ctx->err = 4;
+        return NULL;
+    }
     if (ctx->p->ndesc < 2)
     {
-        phy_errno = 3;
+        ctx->err = 3;
         return NULL;
     }
     return ctx->p;
 }
 
 
-static int write_chars(char *z, struct newick_writer *ctx)
+static int write_flush(struct newick_writer *ctx)
 {
-    unsigned int len = strlen(z);
-    if (len > 0)
+    if (ctx->n && fwrite(ctx->newick, 1, ctx->n, ctx->out) != ctx->n)
     {
-        int togo = ctx->nAlloc - ctx->n;
-        while (togo <= len)
-        {
-            ctx->nAlloc += 100;
-            ctx->newick = realloc(ctx->newick, ctx->nAlloc);
-            if (!ctx->newick)
-            {
-                phy_errno = 1;
-                return PHY_ERR;
-            }
-            togo = ctx->nAlloc - ctx->n;
-        }
-        ctx->newick[ctx->n] = 0;
-        strcat(ctx->newick, z);
-        ctx->n += len;
+        phy_errno = 5;
+        return PHY_ERR;
     }
+    ctx->n = 0;
     return PHY_OK;
 }
 
 
-static int write_brlen(struct phy_node *p, struct newick_writer *ctx)
+static int write_reserve(struct newick_writer *ctx, size_t len)
 {
-    if (p->brlen > 0)
+    size_t nAlloc;
+    char *newick;
+    if (ctx->n + len < ctx->nAlloc)
+        return PHY_OK;
+    if (ctx->out)
     {
-        char brlen[25] = "";
-        sprintf(brlen, ":%f", p->brlen);
-        if (write_chars(brlen, ctx))
+        if (write_flush(ctx))
             return PHY_ERR;
+        if (len < ctx->nAlloc)
+            return PHY_OK;
+    }
+    nAlloc = ctx->nAlloc ? 2 * ctx->nAlloc : 256;
+    while (nAlloc <= ctx->n + len)
+        nAlloc *= 2;
+    newick = realloc(ctx->newick, nAlloc);
+    if (!newick)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
     }
+    ctx->newick = newick;
+    ctx->nAlloc = nAlloc;
     return PHY_OK;
 }
 
 
-static int write_label(struct phy_node *p, struct newick_writer *ctx)
+static int write_nchars(const char *z, size_t len, struct newick_writer *ctx)
 {
-    if (p->lab != 0)
-    {
-        if (strlen(p->lab) > 0)
-        {
-            if (write_chars(p->lab, ctx))
-                return PHY_ERR;
-        }
-    }
+    if (write_reserve(ctx, len))
+        return PHY_ERR;
+    memcpy(ctx->newick + ctx->n, z, len);
+    ctx->n += len;
     return PHY_OK;
 }
 
 
-static int write_note(struct phy_node *p, struct newick_writer *ctx)
+static int write_char(char c, struct newick_writer *ctx)
 {
-    if (p->note != 0)
-    {
-        if (strlen(p->note) > 0)
-        {
-            if (write_chars(p->note, ctx))
-                return PHY_ERR;
-        }
-    }
+    if (ctx->n + 1 >= ctx->nAlloc && write_reserve(ctx, 1))
+        return PHY_ERR;
+    ctx->newick[ctx->n++] = c;
     return PHY_OK;
 }
 
 
-static int write_newick(struct phy_node *node, struct newick_writer *ctx)
+static int write_chars(const char *z, struct newick_writer *ctx)
 {
-    struct phy_node *d = 0;
-    if (node->ndesc)
-    {
-        for (d = node->lfdesc; d != 0; d = d->next)
-        {
-            if (d == node->lfdesc)
-            {
-                if (write_chars("(", ctx))
-                    return PHY_ERR;
-            }
-            write_newick(d, ctx);
-            if (d->next)
-            {
-                if (write_chars(",", ctx))
-                    return PHY_ERR;
-            }
-        }
-        if (write_chars(")", ctx))
-            return PHY_ERR;
-    }
-    if (write_label(node, ctx))
-        return PHY_ERR;
-    if (write_note(node, ctx))
-        return PHY_ERR;
-    if (write_brlen(node, ctx))
-        return PHY_ERR;
-    return PHY_OK;
+    return write_nchars(z, strlen(z), ctx);
 }
 
 
+/* Shortest round-trip formatting of branch lengths, after Grisu3 (Loitsch,
+** "Printing floating-point numbers quickly and accurately with integers",
+** PLDI 2010). A double is scaled by a cached power of ten into a 64-bit
+** fixed-point number whose digits are generated until they fall within
+** its rounding interval, which is known to within a unit in the last
+** place. When that leaves the shortest or nearest digits in doubt, for
+** roughly one double in three hundred, grisu fails and printf and strtod
+** are used instead. */
 
-/**********************************************************************
-**
-** Functions accessible via the API
-**
-**********************************************************************/
+struct diyfp {
+    uint64_t f;
+    int e;
+};
 
 
-int phy_node_alloc(struct phy_node **node)
+// 10^k = f * 2^e to 64 bits for k = -348, -340, ..., 340
+static const struct { uint64_t f; short e; short k; } powers_ten[] = {
+    {0xfa8fd5a0081c0288ULL, -1220, -348},
+    {0xbaaee17fa23ebf76ULL, -1193, -340},
+    {0x8b16fb203055ac76ULL, -1166, -332},
+    {0xcf42894a5dce35eaULL, -1140, -324},
+    {0x9a6bb0aa55653b2dULL, -1113, -316},
+    {0xe61acf033d1a45dfULL, -1087, -308},
+    {0xab70fe17c79ac6caULL, -1060, -300},
+    {0xff77b1fcbebcdc4fULL, -1034, -292},
+    {0xbe5691ef416bd60cULL, -1007, -284},
+    {0x8dd01fad907ffc3cULL, -980, -276},
+    {0xd3515c2831559a83ULL, -954, -268},
+    {0x9d71ac8fada6c9b5ULL, -927, -260},
+    {0xea9c227723ee8bcbULL, -901, -252},
+    {0xaecc49914078536dULL, -874, -244},
+    {0x823c12795db6ce57ULL, -847, -236},
+    {0xc21094364dfb5637ULL, -821, -228},
+    {0x9096ea6f3848984fULL, -794, -220},
+    {0xd77485cb25823ac7ULL, -768, -212},
+    {0xa086cfcd97bf97f4ULL, -741, -204},
+    {0xef340a98172aace5ULL, -715, -196},
+    {0xb23867fb2a35b28eULL, -688, -188},
+    {0x84c8d4dfd2c63f3bULL, -661, -180},
+    {0xc5dd44271ad3cdbaULL, -635, -172},
+    {0x936b9fcebb25c996ULL, -608, -164},
+    {0xdbac6c247d62a584ULL, -582, -156},
+    {0xa3ab66580d5fdaf6ULL, -555, -148},
+    {0xf3e2f893dec3f126ULL, -529, -140},
+    {0xb5b5ada8aaff80b8ULL, -502, -132},
+    {0x87625f056c7c4a8bULL, -475, -124},
+    {0xc9bcff6034c13053ULL, -449, -116},
+    {0x964e858c91ba2655ULL, -422, -108},
+    {0xdff9772470297ebdULL, -396, -100},
+    {0xa6dfbd9fb8e5b88fULL, -369, -92},
+    {0xf8a95fcf88747d94ULL, -343, -84},
+    {0xb94470938fa89bcfULL, -316, -76},
+    {0x8a08f0f8bf0f156bULL, -289, -68},
+    {0xcdb02555653131b6ULL, -263, -60},
+    {0x993fe2c6d07b7facULL, -236, -52},
+    {0xe45c10c42a2b3b06ULL, -210, -44},
+    {0xaa242499697392d3ULL, -183, -36},
+    {0xfd87b5f28300ca0eULL, -157, -28},
+    {0xbce5086492111aebULL, -130, -20},
+    {0x8cbccc096f5088ccULL, -103, -12},
+    {0xd1b71758e219652cULL, -77, -4},
+    {0x9c40000000000000ULL, -50, 4},
+    {0xe8d4a51000000000ULL, -24, 12},
+    {0xad78ebc5ac620000ULL, 3, 20},
+    {0x813f3978f8940984ULL, 30, 28},
+    {0xc097ce7bc90715b3ULL, 56, 36},
+    {0x8f7e32ce7bea5c70ULL, 83, 44},
+    {0xd5d238a4abe98068ULL, 109, 52},
+    {0x9f4f2726179a2245ULL, 136, 60},
+    {0xed63a231d4c4fb27ULL, 162, 68},
+    {0xb0de65388cc8ada8ULL, 189, 76},
+    {0x83c7088e1aab65dbULL, 216, 84},
+    {0xc45d1df942711d9aULL, 242, 92},
+    {0x924d692ca61be758ULL, 269, 100},
+    {0xda01ee641a708deaULL, 295, 108},
+    {0xa26da3999aef774aULL, 322, 116},
+    {0xf209787bb47d6b85ULL, 348, 124},
+    {0xb454e4a179dd1877ULL, 375, 132},
+    {0x865b86925b9bc5c2ULL, 402, 140},
+    {0xc83553c5c8965d3dULL, 428, 148},
+    {0x952ab45cfa97a0b3ULL, 455, 156},
+    {0xde469fbd99a05fe3ULL, 481, 164},
+    {0xa59bc234db398c25ULL, 508, 172},
+    {0xf6c69a72a3989f5cULL, 534, 180},
+    {0xb7dcbf5354e9beceULL, 561, 188},
+    {0x88fcf317f22241e2ULL, 588, 196},
+    {0xcc20ce9bd35c78a5ULL, 614, 204},
+    {0x98165af37b2153dfULL, 641, 212},
+    {0xe2a0b5dc971f303aULL, 667, 220},
+    {0xa8d9d1535ce3b396ULL, 694, 228},
+    {0xfb9b7cd9a4a7443cULL, 720, 236},
+    {0xbb764c4ca7a44410ULL, 747, 244},
+    {0x8bab8eefb6409c1aULL, 774, 252},
+    {0xd01fef10a657842cULL, 800, 260},
+    {0x9b10a4e5e9913129ULL, 827, 268},
+    {0xe7109bfba19c0c9dULL, 853, 276},
+    {0xac2820d9623bf429ULL, 880, 284},
+    {0x80444b5e7aa7cf85ULL, 907, 292},
+    {0xbf21e44003acdd2dULL, 933, 300},
+    {0x8e679c2f5e44ff8fULL, 960, 308},
+    {0xd433179d9c8cb841ULL, 986, 316},
+    {0x9e19db92b4e31ba9ULL, 1013, 324},
+    {0xeb96bf6ebadf77d9ULL, 1039, 332},
+    {0xaf87023b9bf0ee6bULL, 1066, 340},
+};
+
+
+static const uint32_t small_powers_ten[] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+    1000000000
+};
+
+
+// The upper 64 bits of the product of x and y, rounded
+static struct diyfp diyfp_mul(struct diyfp x, struct diyfp y)
 {
-    *node = node_new();
-    if (*node)
-        return PHY_OK;
-    return PHY_ERR;
+    const uint64_t m = 0xffffffffu;
+    uint64_t a = x.f >> 32;
+    uint64_t b = x.f & m;
+    uint64_t c = y.f >> 32;
+    uint64_t d = y.f & m;
+    uint64_t bd = b * d;
+    uint64_t ad = a * d;
+    uint64_t bc = b * c;
+    uint64_t t = (bd >> 32) + (ad & m) + (bc & m) + (1u << 31);
+    struct diyfp r = {a * c + (ad >> 32) + (bc >> 32) + (t >> 32),
+        x.e + y.e + 64};
+    return r;
 }
 
 
-void phy_node_free(struct phy_node *node)
+static struct diyfp diyfp_normalize(struct diyfp x)
 {
-    node_free(node);
+    while (!(x.f & 0xffc0000000000000ULL))
+    {
+        x.f <<= 10;
+        x.e -= 10;
+    }
+    while (!(x.f & 0x8000000000000000ULL))
+    {
+        x.f <<= 1;
+        x.e -= 1;
+    }
+    return x;
 }
 
 
-void phy_node_add_child(struct phy_node *parent, struct phy_node *child)
+/* Move the last digit of z down towards w while that keeps it within the
+** rounding interval and brings it closer, then check that the result is
+** certain to be the closest. Distances are from the upper end of the
+** interval, scaled as rest is, and each is uncertain by unit. */
+static int round_weed(
+    char *z, int len, uint64_t dist_w, uint64_t unsafe, uint64_t rest,
+    uint64_t ten_kappa, uint64_t unit)
 {
-    struct phy_node *r;
-    switch (parent->ndesc)
+    uint64_t small = dist_w - unit;
+    uint64_t big = dist_w + unit;
+
+    while (rest < small && unsafe - rest >= ten_kappa
+        && (rest + ten_kappa < small
+            || small - rest >= rest + ten_kappa - small))
     {
-        case 0:
-            parent->lfdesc = child;
-            child->prev = 0;
-            break;
-        case 1:
-            parent->lfdesc->next = child;
-            child->prev = parent->lfdesc;
-            break;
-        case 2:
-            parent->lfdesc->next->next = child;
-            child->prev = parent->lfdesc->next;
-            break;
-        case 3:
-            parent->lfdesc->next->next->next = child;
-            child->prev = parent->lfdesc->next->next;
-            break;
-        case 4:
-            parent->lfdesc->next->next->next->next = child;
-            child->prev = parent->lfdesc->next->next->next;
+        z[len - 1]--;
+        rest += ten_kappa;
+    }
+    if (rest < big && unsafe - rest >= ten_kappa
+        && (rest + ten_kappa < big || big - rest > rest + ten_kappa - big))
+        return 0;
+    return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+
+/* The shortest digits z[0..*len) and exponent *exp10 with x = z * 10^exp10
+** for a positive, finite double x. Returns 0 when they cannot be
+** determined with certainty. */
+static int grisu(double x, char *z, int *len, int *exp10)
+{
+    int k;
+    int kappa;
+    int shift;
+    int mk;
+    int i;
+    uint64_t u;
+    uint64_t one;
+    uint64_t unit = 1;
+    uint64_t unsafe;
+    uint64_t rest;
+    uint64_t frac;
+    uint32_t integrals;
+    uint32_t divisor;
+    struct diyfp v;
+    struct diyfp w;
+    struct diyfp lo;
+    struct diyfp hi;
+    struct diyfp c;
+
+    memcpy(&u, &x, sizeof u);
+    v.f = u & 0xfffffffffffffULL;
+    v.e = (int)(u >> 52 & 0x7ff);
+    if (v.e)
+    {
+        v.f |= 1ULL << 52;
+        v.e -= 1075;
+    }
+    else
+        v.e = -1074;
+
+    // the ends of the rounding interval, which is narrower below a power
+    // of two
+    hi = diyfp_normalize((struct diyfp){(v.f << 1) + 1, v.e - 1});
+    if (v.f == 1ULL << 52 && v.e > -1074)
+        lo = (struct diyfp){(v.f << 2) - 1, v.e - 2};
+    else
+        lo = (struct diyfp){(v.f << 1) - 1, v.e - 1};
+    lo.f <<= lo.e - hi.e;
+    lo.e = hi.e;
+    w = diyfp_normalize(v);
+
+    // a power of ten bringing the binary exponent into [-60, -32]
+    k = (int)(((-60 - (w.e + 64)) + 63) * 0.30102999566398114);
+    if (((-60 - (w.e + 64)) + 63) * 0.30102999566398114 > k)
+        k++;
+    i = (348 + k - 1) / 8 + 1;
+    c.f = powers_ten[i].f;
+    c.e = powers_ten[i].e;
+    mk = powers_ten[i].k;
+
+    w = diyfp_mul(w, c);
+    lo = diyfp_mul(lo, c);
+    hi = diyfp_mul(hi, c);
+
+    // the scaled ends are widened by a unit to cover the error of the
+    // products
+    lo.f -= unit;
+    hi.f += unit;
+    unsafe = hi.f - lo.f;
+    shift = -w.e;
+    one = 1ULL << shift;
+    integrals = (uint32_t)(hi.f >> shift);
+    frac = hi.f & (one - 1);
+
+    for (kappa = 1; kappa < 10 && integrals >= small_powers_ten[kappa];
+            ++kappa) {};
+    divisor = small_powers_ten[kappa - 1];
+
+    *len = 0;
+    while (kappa > 0)
+    {
+        z[(*len)++] = '0' + integrals / divisor;
+        integrals %= divisor;
+        kappa--;
+        rest = ((uint64_t)integrals << shift) + frac;
+        if (rest < unsafe)
+        {
+            *exp10 = kappa - mk;
+            return round_weed(z, *len, hi.f - w.f, unsafe, rest,
+                (uint64_t)divisor << shift, unit);
+        }
+        divisor /= 10;
+    }
+    for (;;)
+    {
+        frac *= 10;
+        unit *= 10;
+        unsafe *= 10;
+        z[(*len)++] = '0' + (frac >> shift);
+        frac &= one - 1;
+        kappa--;
+        if (frac < unsafe)
+        {
+            *exp10 = kappa - mk;
+            return round_weed(z, *len, (hi.f - w.f) * unit, unsafe, frac,
+                one, unit);
+        }
+    }
+}
+
+
+/* The digits and exponent of x as for grisu, found with printf and strtod
+** by trying ever more digits. Below a power of two the rounding interval
+** is narrower, so the digits just above the closest are also tried. */
+static void shortest_slow(double x, char *z, int *len, int *exp10)
+{
+    int i;
+    int k;
+    int n = 0;
+    char s[40];
+    uint64_t u;
+
+    memcpy(&u, &x, sizeof u);
+    for (k = 1; k <= 17; ++k)
+    {
+        snprintf(s, sizeof s, "%.*e", k - 1, x);
+        z[0] = s[0];
+        for (i = 1; i < k; ++i)
+            z[i] = s[i + 1];
+        n = atoi(s + (k > 1 ? k + 2 : 2));
+        if (strtod(s, NULL) == x)
             break;
-        case 5:
-            parent->lfdesc->next->next->next->next->next = child;
-            child->prev = parent->lfdesc->next->next->next->next;
+        if (u & 0xfffffffffffffULL)
+            continue;
+        for (i = k - 1; i >= 0 && z[i] == '9'; --i)
+            z[i] = '0';
+        if (i < 0)
+        {
+            z[0] = '1';
+            n++;
+        }
+        else
+            z[i]++;
+        snprintf(s, sizeof s, "%.*se%d", k, z, n - k + 1);
+        if (strtod(s, NULL) == x)
             break;
-        default:
-            for (r = parent->lfdesc; r->next != 0; r = r->next) {};
-            r->next = child;
-            child->prev = r;
     }
-    parent->ndesc += 1;
-    child->anc = parent;
+    for (*len = k; *len > 1 && z[*len - 1] == '0'; --*len) {};
+    *exp10 = n - *len + 1;
 }
 
-// Remove q from p's list of immediate descendants and return q.
-// If q is not a child of p return NULL.
-struct phy_node *phy_node_prune(struct phy_node *p, struct phy_node *q)
+
+// Format x into z, which must hold NEWICK_BRLEN_MAX characters. With
+// digits > 0 x is rounded to that many significant digits. Otherwise the
+// fewest digits that read back to x are written, choosing those closest
+// to x among them, in the notation of printf's %g.
+static int format_brlen(char *z, double x, int digits)
 {
-    if (!q || !p)
-        return NULL;
+    int i;
+    int n;
+    int len;
+    int exp10;
+    char d[24];
+    char *s = z;
+
+    if (digits > 0)
+        return snprintf(z, NEWICK_BRLEN_MAX, "%.*g", digits > 17 ? 17 : digits, x);
+    if (x == 0 || x - x != 0)
+        return snprintf(z, NEWICK_BRLEN_MAX, "%g", x);
+    if (x < 0)
+    {
+        *s++ = '-';
+        x = -x;
+    }
 
-    if (q->anc != p)
-        return NULL;
+    // from 2^53 the ends of the rounding interval are integers, and the
+    // shortest digits may be one of them, which grisu does not consider
+    if (x >= 9007199254740992.0 || !grisu(x, d, &len, &exp10))
+        shortest_slow(x, d, &len, &exp10);
+
+    // the exponent of the leading digit
+    n = len + exp10 - 1;
+    if (n < -4 || n >= 17)
+    {
+        *s++ = d[0];
+        if (len > 1)
+        {
+            *s++ = '.';
+            memcpy(s, d + 1, len - 1);
+            s += len - 1;
+        }
+        s += sprintf(s, "e%c%02d", n < 0 ? '-' : '+', n < 0 ? -n : n);
+    }
+    else if (n < 0)
+    {
+        *s++ = '0';
+        *s++ = '.';
+        for (i = n + 1; i < 0; ++i)
+            *s++ = '0';
+        memcpy(s, d, len);
+        s += len;
+    }
+    else if (len <= n + 1)
+    {
+        memcpy(s, d, len);
+        s += len;
+        for (i = len; i <= n; ++i)
+            *s++ = '0';
+    }
+    else
+    {
+        memcpy(s, d, n + 1);
+        s += n + 1;
+        *s++ = '.';
+        memcpy(s, d + n + 1, len - n - 1);
+        s += len - n - 1;
+    }
+    *s = 0;
+    return (int)(s - z);
+}
+
+
+static int write_brlen(struct phy_node *p, struct newick_writer *ctx)
+{
+    if (p->brlen != 0)
+    {
+        if (write_reserve(ctx, NEWICK_BRLEN_MAX + 1))
+            return PHY_ERR;
+        ctx->newick[ctx->n++] = ':';
+        ctx->n += format_brlen(ctx->newick + ctx->n, p->brlen, ctx->digits);
+    }
+    return PHY_OK;
+}
 
-    struct phy_node *prev = q->prev;
-    struct phy_node *next = q->next;
 
-    q->prev = 0;
-    q->next = 0;
-    q->anc = 0;
+static int write_label(struct phy_node *p, struct newick_writer *ctx)
+{
+    if (p->lab != 0 && p->lab[0])
+    {
+        if (write_chars(p->lab, ctx))
+            return PHY_ERR;
+    }
+    return PHY_OK;
+}
 
-    if (prev)
-        prev->next = next;
-    if (next)
-        next->prev = prev;
 
-    if (q == p->lfdesc)
-        p->lfdesc = next;
+static int write_note(struct phy_node *p, struct newick_writer *ctx)
+{
+    if (p->note != 0 && p->note[0])
+    {
+        if (write_char('[', ctx))
+            return PHY_ERR;
+        if (write_chars(p->note, ctx))
+            return PHY_ERR;
+        if (write_char(']', ctx))
+            return PHY_ERR;
+    }
+    return PHY_OK;
+}
 
-    p->ndesc -=1;
 
-    return q;
+static int write_tail(struct phy_node *p, struct newick_writer *ctx)
+{
+    if (write_label(p, ctx))
+        return PHY_ERR;
+    if (write_note(p, ctx))
+        return PHY_ERR;
+    if (write_brlen(p, ctx))
+        return PHY_ERR;
+    return PHY_OK;
 }
 
 
-// Called after a Newick string has been fully processed
-struct phy *phy_build(struct phy_node *root, int nnode, int ntip)
+// Bound on the length of the Newick text of the clade subtended by node,
+// excluding the closing ';'
+static size_t newick_size(struct phy_node *node)
 {
-    int i = 0, j = 0, k = 0;
-    struct phy_node *p, *q;
-    struct phy *phy = malloc(sizeof(struct phy));
-    if (!phy)
+    size_t size = 0;
+    struct phy_node *p = node;
+    for (;;)
     {
-        phy_errno = 1;
-        return NULL;
+        // each node contributes "(" or "," plus ")" for internal nodes
+        size += 2 + NEWICK_BRLEN_MAX + 1;
+        if (p->lab)
+            size += strlen(p->lab);
+        if (p->note)
+            size += strlen(p->note) + 2;
+        if (p->ndesc)
+        {
+            p = p->lfdesc;
+            continue;
+        }
+        while (p != node && !p->next)
+            p = p->anc;
+        if (p == node)
+            break;
+        p = p->next;
     }
-    phy->ntip = ntip;
-    phy->nnode = nnode;
-    phy->root = root;
-    phy->nodes = malloc(nnode * sizeof(struct phy_node *));
-    if (!phy->nodes)
+    return size;
+}
+
+
+// Write the clade subtended by node. The traversal is iterative so that
+// deep trees do not exhaust the stack.
+static int write_newick(struct phy_node *node, struct newick_writer *ctx)
+{
+    struct phy_node *p = node;
+    for (;;)
     {
-        phy_errno = 1;
-        free(phy);
-        return NULL;
+        while (p->ndesc)
+        {
+            if (write_char('(', ctx))
+                return PHY_ERR;
+            p = p->lfdesc;
+        }
+        if (write_tail(p, ctx))
+            return PHY_ERR;
+        while (p != node && !p->next)
+        {
+            p = p->anc;
+            if (write_char(')', ctx))
+                return PHY_ERR;
+            if (write_tail(p, ctx))
+                return PHY_ERR;
+        }
+        if (p == node)
+            break;
+        if (write_char(',', ctx))
+            return PHY_ERR;
+        p = p->next;
     }
-    phy->vseq = malloc(nnode * sizeof(int));
-    if (!phy->vseq)
+    return PHY_OK;
+}
+
+
+// Write the clade subtended by node to a NUL-terminated string sized up
+// front from the labels and notes of the clade
+static char *write_newickstr(struct phy_node *node, int digits)
+{
+    struct newick_writer ctx = {0, 0, 0, 0, digits};
+    ctx.nAlloc = newick_size(node) + 2;
+    ctx.newick = malloc(ctx.nAlloc);
+    if (!ctx.newick)
     {
         phy_errno = 1;
-        free(phy->nodes);
-        free(phy);
         return NULL;
     }
-    phy->inodes = malloc((nnode-ntip) * sizeof(struct phy_node *));
-    if (!phy->inodes)
+    if (write_newick(node, &ctx) || write_nchars(";", 2, &ctx))
     {
-        phy_errno = 1;
-        free(phy->vseq);
-        free(phy->nodes);
-        free(phy);
+        free(ctx.newick);
         return NULL;
     }
+    return ctx.newick;
+}
 
-    /* Assign indices to each node and record their visitation sequence
-    ** in a preorder traversal beginning from the root. Terminal nodes
-    ** are numbered 0 ... ntip-1 and internal nodes are numbered from
-    ** ntip ... nnode-1. The root node always has index ntip using this
-    ** scheme. */
 
-    p = phy->root;
+
+/**********************************************************************
+**
+** Functions accessible via the API
+**
+**********************************************************************/
+
+
+// Discard the cached quantities of a phylogeny after it has been modified
+static void invalidate(struct phy *phy)
+{
+    if (phy)
+    {
+        free(phy->age);
+        phy->age = 0;
+        phy->depth = 0;
+        free(phy->level);
+        phy->level = 0;
+        phy->nlevel = 0;
+    }
+}
+
+
+// Record that the children of node have changed. The dirty subtree of
+// node's phylogeny is widened to the common ancestor of its current root
+// and node, or to the whole tree if node is not connected to the root.
+static void touch(struct phy_node *node)
+{
+    struct phy *phy = node->phy;
+    struct phy_node *p;
+    struct phy_node *q;
+
+    if (!phy)
+        return;
+
+    invalidate(phy);
+
+    if (phy->dirty == phy->root)
+        return;
+
+    q = phy->dirty ? phy->dirty : node;
+    for (p = q; p->anc; p = p->anc)
+        p->flags |= NODE_MARK;
+    p->flags |= NODE_MARK;
+
+    if (p != phy->root)
+        node = phy->root;
+    else
+    {
+        while (!(node->flags & NODE_MARK) && node->anc)
+            node = node->anc;
+        if (!(node->flags & NODE_MARK))
+            node = phy->root;
+    }
+
+    for (p = q; p; p = p->anc)
+        p->flags &= ~NODE_MARK;
+
+    phy->dirty = node;
+}
+
+
+// Count the nodes and terminal nodes of the subtree rooted at top
+static void count(struct phy_node *top, int *nnode, int *ntip)
+{
+    struct phy_node *p = top;
+
+    *nnode = 0;
+    *ntip = 0;
+    while (p)
+    {
+        *nnode += 1;
+        if (!p->ndesc)
+            *ntip += 1;
+        if (p->lfdesc)
+            p = p->lfdesc;
+        else if (p != top && p->next)
+            p = p->next;
+        else
+        {
+            while (p != top && p->next == 0)
+                p = p->anc;
+            p = p == top ? 0 : p->next;
+        }
+    }
+}
+
+
+/* Assign indices to each node of the subtree rooted at top and record
+** their visitation sequence in a preorder traversal beginning from top.
+** The subtree occupies the nodes array from position pos, and its terminal
+** and internal nodes are numbered consecutively from tip and inode. When
+** top is the root (pos = 0, tip = 0, inode = ntip) terminal nodes are
+** numbered 0 ... ntip-1 and internal nodes are numbered from ntip ...
+** nnode-1, so the root node always has index ntip. If perm is not NULL
+** the previous index of the node with new index i is stored in perm[i]. */
+static void reindex(
+    struct phy *phy,
+    struct phy_node *top,
+    int pos,
+    int tip,
+    int inode,
+    int *perm
+){
+    struct phy_node *p = top;
+    struct phy_node *q;
+
     while (p)
     {
-        phy->nodes[i] = p;
+        STAT(nvisit, 1);
+        phy->nodes[pos] = p;
+        p->phy = phy;
+        // the next terminal node numbered is the first in p's clade
+        p->firsttip = tip;
         if (p->ndesc)
         {
-            p->index = ntip + j;
-            phy->inodes[j++] = p;
+            if (perm)
+                perm[inode] = p->index;
+            p->index = inode;
+            phy->inodes[inode++ - phy->ntip] = p;
         }
         else
         {
-            p->index = k++;
+            if (perm)
+                perm[tip] = p->index;
+            p->index = tip++;
+            p->lastvisit = 0;
         }
-        phy->vseq[p->index] = i++;
+        phy->vseq[p->index] = pos++;
         if (p->lfdesc)
             p = p->lfdesc;
-        else if (p->next)
+        else if (p != top && p->next)
             p = p->next;
         else
         {
@@ -763,36 +1493,356 @@ struct phy *phy_build(struct phy_node *root, int nnode, int ntip)
             // on the path back from this node up to and including the
             // first encountered node with a ->next sibling
             q = p;
-            while (p->anc != 0 && p->next == 0)
+            while (p != top && p->next == 0)
             {
                 p = p->anc;
                 p->lastvisit = q;
             }
-            p = p->next;
+            p = p == top ? 0 : p->next;
         }
     }
-    return phy;
 }
 
 
-void phy_cursor_prepare_v2(
-    struct phy *phy,
-    struct phy_node *node,
-    struct phy_cursor *cursor,
-    int visit,
-    int order
-){
-    cursor->visit = visit;
-    cursor->order = order;
-    cursor->phy = phy;
+// Position of the first element of the n increasing integers at a that is
+// not less than x
+static int search(const int *a, int n, int x)
+{
+    int lo = 0;
+    int mid;
 
-    if (order == PREORDER)
+    while (lo < n)
     {
-        cursor->begin = node;
-        cursor->next = node;
-        if (node->ndesc)
+        mid = lo + (n - lo) / 2;
+        if (a[mid] < x)
+            lo = mid + 1;
+        else
+            n = mid;
+    }
+    return lo;
+}
+
+
+/* Bring the traversal arrays of a phylogeny up to date with the edits
+** recorded by touch. If the dirty subtree holds as many nodes and terminal
+** nodes as it did before, only its block of the preorder arrays is
+** rewritten and, above it, only the clade boundaries of its ancestors are
+** updated. Otherwise the whole tree is renumbered. */
+static int refresh(struct phy *phy)
+{
+    int n;
+    int k;
+    int nnode;
+    int ntip;
+    int pos;
+    int tip;
+    void *x;
+    struct phy_node *d = phy->dirty;
+    struct phy_node *last;
+    struct phy_node *p;
+
+    if (!d)
+        return PHY_OK;
+
+    free(phy->labels);
+    phy->labels = 0;
+
+    /* Nodes of the dirty subtree may have been freed since the arrays were
+    ** built, so its old extent is found from the nodes that follow it,
+    ** which are untouched, and from the positions of the terminal nodes,
+    ** which increase with their indices. */
+    last = d->lastvisit;
+    if (d != phy->root && d->ndesc && last && d->phy == phy
+        && d->index >= phy->ntip && d->index < phy->nnode
+        && phy->nodes[phy->vseq[d->index]] == d)
+    {
+        pos = phy->vseq[d->index];
+        for (p = d; p->anc && !p->next; p = p->anc);
+        n = (p->next ? phy->vseq[p->next->index] : phy->nnode) - pos;
+        tip = search(phy->vseq, phy->ntip, pos);
+        ntip = search(phy->vseq, phy->ntip, pos + n) - tip;
+        count(d, &nnode, &k);
+        if (nnode == n && k == ntip)
         {
-            if (visit == ALL_NODES)
+            reindex(phy, d, pos, tip, d->index, 0);
+            for (p = d->anc; p && p->lastvisit == last; p = p->anc)
+                p->lastvisit = d->lastvisit;
+            phy->dirty = 0;
+            return PHY_OK;
+        }
+    }
+
+    // the arrays are only ever grown, so that they remain consistent
+    // with phy->nnode should an allocation fail
+    count(phy->root, &nnode, &ntip);
+    if (nnode > phy->nnode)
+    {
+        x = realloc(phy->nodes, nnode * sizeof(struct phy_node *));
+        if (!x)
+            goto error;
+        phy->nodes = x;
+        x = realloc(phy->vseq, nnode * sizeof(int));
+        if (!x)
+            goto error;
+        phy->vseq = x;
+    }
+    if (nnode - ntip > phy->nnode - phy->ntip)
+    {
+        x = realloc(phy->inodes, (nnode - ntip) * sizeof(struct phy_node *));
+        if (!x)
+            goto error;
+        phy->inodes = x;
+    }
+    if (nnode > phy->nnode)
+    {
+        free(phy->mark);
+        phy->mark = 0;
+    }
+    phy->nnode = nnode;
+    phy->ntip = ntip;
+    reindex(phy, phy->root, 0, 0, ntip, 0);
+    phy->dirty = 0;
+    return PHY_OK;
+
+error:
+    phy_errno = 1;
+    return PHY_ERR;
+}
+
+
+// Start a new generation of node marks, returning its stamp (or 0 if the
+// mark array could not be allocated)
+static unsigned int stamp(struct phy *phy)
+{
+    if (!phy->mark)
+    {
+        phy->mark = calloc(phy->nnode, sizeof(unsigned int));
+        if (!phy->mark)
+        {
+            phy_errno = 1;
+            return 0;
+        }
+        phy->gen = 0;
+    }
+    if (++phy->gen == 0)
+    {
+        memset(phy->mark, 0, phy->nnode * sizeof(unsigned int));
+        phy->gen = 1;
+    }
+    return phy->gen;
+}
+
+
+// First node marked with gen in the sibling list starting at p
+static struct phy_node *marked(
+    struct phy *phy, struct phy_node *p, unsigned int gen)
+{
+    while (p && phy->mark[p->index] != gen)
+        p = p->next;
+    return p;
+}
+
+
+int phy_node_alloc(struct phy_node **node)
+{
+    *node = node_new();
+    if (*node)
+        return PHY_OK;
+    return PHY_ERR;
+}
+
+
+void phy_node_free(struct phy_node *node)
+{
+    node_free(node);
+}
+
+
+void phy_node_add_child(struct phy_node *parent, struct phy_node *child)
+{
+    struct phy_node *r;
+    touch(parent);
+    switch (parent->ndesc)
+    {
+        case 0:
+            parent->lfdesc = child;
+            child->prev = 0;
+            break;
+        case 1:
+            parent->lfdesc->next = child;
+            child->prev = parent->lfdesc;
+            break;
+        case 2:
+            parent->lfdesc->next->next = child;
+            child->prev = parent->lfdesc->next;
+            break;
+        case 3:
+            parent->lfdesc->next->next->next = child;
+            child->prev = parent->lfdesc->next->next;
+            break;
+        case 4:
+            parent->lfdesc->next->next->next->next = child;
+            child->prev = parent->lfdesc->next->next->next;
+            break;
+        case 5:
+            parent->lfdesc->next->next->next->next->next = child;
+            child->prev = parent->lfdesc->next->next->next->next;
+            break;
+        default:
+            for (r = parent->lfdesc; r->next != 0; r = r->next) {};
+            r->next = child;
+            child->prev = r;
+    }
+    parent->ndesc += 1;
+    child->anc = parent;
+}
+
+// Detach a child from node
+static void unlink_child(struct phy_node *node, struct phy_node *child)
+{
+    if (child->prev)
+        child->prev->next = child->next;
+    else
+        node->lfdesc = child->next;
+    if (child->next)
+        child->next->prev = child->prev;
+    child->anc = child->prev = child->next = 0;
+    node->ndesc--;
+}
+
+
+// Release the nodes of the subtree rooted at top from their phylogeny, so
+// that edits made to a detached clade are not recorded against a
+// phylogeny that may since have been freed
+static void disown(struct phy_node *top)
+{
+    struct phy_node *p = top;
+
+    while (p)
+    {
+        p->phy = 0;
+        if (p->lfdesc)
+            p = p->lfdesc;
+        else if (p != top && p->next)
+            p = p->next;
+        else
+        {
+            while (p != top && p->next == 0)
+                p = p->anc;
+            p = p == top ? 0 : p->next;
+        }
+    }
+}
+
+
+// Remove q from p's list of immediate descendants and return q.
+// If q is not a child of p return NULL.
+struct phy_node *phy_node_prune(struct phy_node *p, struct phy_node *q)
+{
+    if (!q || !p)
+        return NULL;
+
+    if (q->anc != p)
+        return NULL;
+
+    touch(p);
+    unlink_child(p, q);
+    disown(q);
+
+    return q;
+}
+
+
+// Called after a Newick string has been fully processed. Errors are
+// reported through *err rather than phy_errno.
+static struct phy *build(struct phy_node *root, int nnode, int ntip, int *err)
+{
+    struct phy *phy = malloc(sizeof(struct phy));
+    if (!phy)
+    {
+        *err = 1;
+        return NULL;
+    }
+    phy->ntip = ntip;
+    phy->nnode = nnode;
+    phy->root = root;
+    phy->arena = 0;
+    phy->pool = 0;
+    phy->age = 0;
+    phy->depth = 0;
+    phy->height = 0;
+    phy->level = 0;
+    phy->nlevel = 0;
+    phy->dirty = 0;
+    phy->labels = 0;
+    phy->mark = 0;
+    phy->gen = 0;
+    phy->nodes = malloc(nnode * sizeof(struct phy_node *));
+    if (!phy->nodes)
+    {
+        *err = 1;
+        free(phy);
+        return NULL;
+    }
+    phy->vseq = malloc(nnode * sizeof(int));
+    if (!phy->vseq)
+    {
+        *err = 1;
+        free(phy->nodes);
+        free(phy);
+        return NULL;
+    }
+    phy->inodes = malloc((nnode-ntip) * sizeof(struct phy_node *));
+    if (!phy->inodes)
+    {
+        *err = 1;
+        free(phy->vseq);
+        free(phy->nodes);
+        free(phy);
+        return NULL;
+    }
+
+    reindex(phy, root, 0, 0, ntip, 0);
+    return phy;
+}
+
+
+struct phy *phy_build(struct phy_node *root, int nnode, int ntip)
+{
+    int err = 0;
+    struct phy *phy = build(root, nnode, ntip, &err);
+    if (!phy)
+        phy_errno = err;
+    return phy;
+}
+
+
+int phy_refresh(struct phy *phy)
+{
+    return refresh(phy);
+}
+
+
+void phy_cursor_prepare_v2(
+    struct phy *phy,
+    struct phy_node *node,
+    struct phy_cursor *cursor,
+    int visit,
+    int order
+){
+    refresh(phy);
+
+    cursor->visit = visit;
+    cursor->order = order;
+    cursor->phy = phy;
+
+    if (order == PREORDER)
+    {
+        cursor->begin = node;
+        cursor->next = node;
+        if (node->ndesc)
+        {
+            if (visit == ALL_NODES)
             {
                 cursor->end = phy->nodes[phy->vseq[node->lastvisit->index]];
             }
@@ -888,6 +1938,7 @@ struct phy_node *phy_cursor_step(struct phy_cursor *cursor)
 
     if (node)
     {
+        STAT(nvisit, 1);
         if (node != cursor->end)
         {
             if (cursor->visit == ALL_NODES)
@@ -913,851 +1964,4337 @@ struct phy_node *phy_cursor_step(struct phy_cursor *cursor)
         }
     }
 
-    return node;
+    return node;
+}
+
+
+int phy_isbinary(struct phy *phy)
+{
+    refresh(phy);
+    return (phy->nnode ==  2*phy->ntip - 1) ? 1 : 0;
+}
+
+
+int phy_cursor_alloc(struct phy_cursor **cursor)
+{
+    *cursor = (struct phy_cursor *) malloc(sizeof(struct phy_cursor));
+
+    if (*cursor)
+        return PHY_OK;
+
+    phy_errno = 1;
+    return PHY_ERR;
+}
+
+
+void phy_cursor_free(struct phy_cursor *cursor)
+{
+    free(cursor);
+}
+
+
+void phy_free(struct phy *phy)
+{
+    if (phy)
+    {
+        int i;
+        // nodes pruned since the last refresh belong to the caller
+        for (i = 0; i < phy->nnode; ++i)
+        {
+            if (phy->nodes[i]->phy == phy)
+                node_free(phy->nodes[i]);
+        }
+        free(phy->nodes);
+        free(phy->inodes);
+        free(phy->vseq);
+        free(phy->arena);
+        free(phy->pool);
+        free(phy->age);
+        free(phy->level);
+        free(phy->labels);
+        free(phy->mark);
+        free(phy);
+    }
+}
+
+
+// Parse the len characters of Newick text starting at newick
+static struct phy *parse(const char *newick, size_t len, int *err)
+{
+    struct phy_node *root = 0;
+    struct phy *phy = 0;
+    struct newick_reader ctx = {0};
+    ctx.newick = newick;
+    ctx.len = len;
+    STAT(nparse, len);
+    if (reader_alloc(&ctx))
+    {
+        *err = ctx.err;
+        return NULL;
+    }
+    root = read_newick(&ctx);
+    if (root)
+        phy = build(root, ctx.nnode, ctx.ntip, &ctx.err);
+    if (phy)
+    {
+        phy->arena = ctx.arena;
+        phy->pool = ctx.pool;
+    }
+    else
+    {
+        free(ctx.arena);
+        free(ctx.pool);
+        *err = ctx.err;
+    }
+    return phy;
+}
+
+
+struct phy *phy_read_newickstr_v2(const char *newick, int *err)
+{
+    return parse(newick, strlen(newick), err);
+}
+
+
+struct phy *phy_read_newickstr(const char *newick)
+{
+    int err = 0;
+    struct phy *phy = phy_read_newickstr_v2(newick, &err);
+    if (!phy)
+        phy_errno = err;
+    return phy;
+}
+
+
+struct phy *phy_read_newickfile(const char *filename)
+{
+    struct phy *phy = 0;
+    struct phy_reader *reader = phy_reader_open(filename);
+    if (reader) {
+        phy_reader_next(reader, &phy);
+        phy_reader_close(reader);
+    }
+    return phy;
+}
+
+
+static struct phy_reader *reader_new(FILE *in)
+{
+    struct phy_reader *reader = calloc(1, sizeof(struct phy_reader));
+    if (!reader)
+    {
+        phy_errno = 1;
+        return NULL;
+    }
+    reader->in = in;
+    return reader;
+}
+
+
+#ifdef PHY_MMAP
+// Map a file into memory. Return NULL if the file cannot be mapped, in
+// which case the caller falls back to reading it in chunks.
+static struct phy_reader *reader_map(const char *filename)
+{
+    int fd;
+    void *map;
+    struct stat st;
+    struct phy_reader *reader;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_size <= 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+#ifdef MADV_SEQUENTIAL
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+    reader = reader_new(NULL);
+    if (!reader)
+    {
+        munmap(map, (size_t)st.st_size);
+        return NULL;
+    }
+    reader->map = map;
+    reader->mapsz = (size_t)st.st_size;
+    reader->chunk = map;
+    reader->nchunk = reader->mapsz;
+    return reader;
+}
+#endif
+
+
+struct phy_reader *phy_reader_open(const char *filename)
+{
+    struct phy_reader *reader;
+    FILE *in;
+#ifdef PHY_MMAP
+    reader = reader_map(filename);
+    if (reader)
+        return reader;
+#endif
+    in = fopen(filename, "r");
+    if (!in)
+    {
+        phy_errno = 5;
+        return NULL;
+    }
+    reader = reader_new(in);
+    if (reader)
+        reader->buf = malloc(READER_CHUNK);
+    if (!reader || !reader->buf)
+    {
+        phy_errno = 1;
+        free(reader);
+        fclose(in);
+        return NULL;
+    }
+    reader->chunk = reader->buf;
+    return reader;
+}
+
+
+struct phy_reader *phy_reader_openstr(const char *newick)
+{
+    struct phy_reader *reader = reader_new(NULL);
+    if (reader)
+    {
+        reader->chunk = newick;
+        reader->nchunk = strlen(newick);
+    }
+    return reader;
+}
+
+
+// Refill the input buffer. Return 0 at the end of input.
+static size_t reader_fill(struct phy_reader *reader)
+{
+    reader->pos = 0;
+    if (reader->in)
+        reader->nchunk = fread(reader->buf, 1, READER_CHUNK, reader->in);
+    else
+        reader->nchunk = 0;
+    return reader->nchunk;
+}
+
+
+// Append n bytes to the text of the current tree
+static int reader_append(
+    struct phy_reader *reader, const char *z, size_t n)
+{
+    char *tree;
+    size_t nAlloc = reader->nAlloc ? reader->nAlloc : 4096;
+    while (reader->ntree + n + 1 > nAlloc)
+        nAlloc *= 2;
+    if (nAlloc != reader->nAlloc)
+    {
+        tree = realloc(reader->tree, nAlloc);
+        if (!tree)
+        {
+            phy_errno = 1;
+            return PHY_ERR;
+        }
+        reader->tree = tree;
+        reader->nAlloc = nAlloc;
+    }
+    memcpy(reader->tree + reader->ntree, z, n);
+    reader->ntree += n;
+    return PHY_OK;
+}
+
+
+// Locate the text of the next tree in the input, including its closing
+// ';'. On return the tree occupies the n bytes at *offset from the start
+// of reader_text(). When reading in chunks the text is appended to
+// reader->tree. Return 1 if a tree was found, 0 at the end of input and
+// -1 on error.
+static int reader_scan(struct phy_reader *reader, size_t *offset, size_t *n)
+{
+    int depth = 0;
+    int done = 0;
+    int started = 0;
+    size_t i;
+    const char *z;
+
+    *offset = reader->ntree;
+
+    while (!done)
+    {
+        if (reader->pos == reader->nchunk && !reader_fill(reader))
+            break;
+        z = reader->chunk;
+        i = reader->pos;
+        // whitespace separating trees is not part of either of them
+        if (!started)
+        {
+            while (i < reader->nchunk && (z[i] == ' ' || z[i] == '\n'
+                || z[i] == '\r' || z[i] == '\t' || z[i] == '\v'
+                || z[i] == '\f'))
+                ++i;
+            reader->pos = i;
+            if (i == reader->nchunk)
+                continue;
+            started = 1;
+            if (!reader->in)
+                *offset = i;
+        }
+        // a ';' inside a note does not terminate the tree
+        for (; i < reader->nchunk && !done; ++i)
+        {
+            switch (z[i])
+            {
+                case '[':
+                    ++depth;
+                    break;
+                case ']':
+                    if (depth)
+                        --depth;
+                    break;
+                case ';':
+                    if (!depth)
+                        done = 1;
+                    break;
+                default:;
+            }
+        }
+        if (reader->in && reader_append(reader, z + reader->pos, i - reader->pos))
+            return -1;
+        reader->pos = i;
+    }
+
+    if (!started)
+        return 0;
+
+    if (!done)
+    {
+        phy_errno = 4;
+        return -1;
+    }
+
+    *n = (reader->in ? reader->ntree : reader->pos) - *offset;
+    return 1;
+}
+
+
+// Base address of the tree text located by reader_scan
+static const char *reader_text(struct phy_reader *reader)
+{
+    return reader->in ? reader->tree : reader->chunk;
+}
+
+
+int phy_reader_next(struct phy_reader *reader, struct phy **phy)
+{
+    int rc;
+    int err = 0;
+    size_t offset;
+    size_t n;
+
+    *phy = 0;
+    reader->ntree = 0;
+
+    rc = reader_scan(reader, &offset, &n);
+    if (rc <= 0)
+        return rc ? PHY_ERR : PHY_OK;
+
+    *phy = parse(reader_text(reader) + offset, n, &err);
+    if (!*phy)
+    {
+        phy_errno = err;
+        return PHY_ERR;
+    }
+    return PHY_OK;
+}
+
+
+int phy_reader_readall(
+    struct phy_reader *reader, int nthreads, struct phy ***trees, int *ntree)
+{
+    int i;
+    int k;
+    int n = 0;
+    int nAlloc = 0;
+    int nbatch;
+    int rc = 1;
+    int err = 0;
+    int *errs = 0;
+    size_t nbytes;
+    size_t *offset = 0;
+    size_t *len = 0;
+    const char *text;
+    struct phy **tree = 0;
+    struct phy **tmp;
+
+    *trees = 0;
+    *ntree = 0;
+    if (nthreads < 1)
+        nthreads = 1;
+
+    errs = malloc(READER_BATCH * sizeof(int));
+    offset = malloc(READER_BATCH * sizeof(size_t));
+    len = malloc(READER_BATCH * sizeof(size_t));
+    if (!errs || !offset || !len)
+    {
+        phy_errno = 1;
+        goto fail;
+    }
+
+    while (rc > 0)
+    {
+        // locate the text of a batch of trees
+        nbatch = 0;
+        nbytes = 0;
+        reader->ntree = 0;
+        while (nbatch < READER_BATCH && nbytes < READER_BATCHSZ)
+        {
+            rc = reader_scan(reader, offset + nbatch, len + nbatch);
+            if (rc < 0)
+                goto fail;
+            if (!rc)
+                break;
+            nbytes += len[nbatch++];
+        }
+
+        if (n + nbatch > nAlloc)
+        {
+            nAlloc = nAlloc ? 2 * nAlloc : READER_BATCH;
+            while (n + nbatch > nAlloc)
+                nAlloc *= 2;
+            tmp = realloc(tree, nAlloc * sizeof(struct phy *));
+            if (!tmp)
+            {
+                phy_errno = 1;
+                goto fail;
+            }
+            tree = tmp;
+        }
+
+        // trees in a batch are independent of one another and each is
+        // written to its own slot, so the input order is preserved
+        text = reader_text(reader);
+#ifdef _OPENMP
+        #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+        for (k = 0; k < nbatch; ++k)
+        {
+            errs[k] = 0;
+            tree[n+k] = parse(text + offset[k], len[k], errs + k);
+        }
+
+        for (k = 0; k < nbatch; ++k)
+        {
+            if (!tree[n+k] && !err)
+                err = errs[k];
+        }
+        n += nbatch;
+
+        if (err)
+        {
+            phy_errno = err;
+            goto fail;
+        }
+    }
+
+    free(errs);
+    free(offset);
+    free(len);
+    *trees = tree;
+    *ntree = n;
+    return PHY_OK;
+
+fail:
+    for (i = 0; i < n; ++i)
+        phy_free(tree[i]);
+    free(tree);
+    free(errs);
+    free(offset);
+    free(len);
+    return PHY_ERR;
+}
+
+
+void phy_reader_close(struct phy_reader *reader)
+{
+    if (reader)
+    {
+        if (reader->in)
+            fclose(reader->in);
+#ifdef PHY_MMAP
+        if (reader->map)
+            munmap(reader->map, reader->mapsz);
+#endif
+        free(reader->buf);
+        free(reader->tree);
+        free(reader);
+    }
+}
+
+
+int phy_read_newickfile_foreach(
+    const char *filename,
+    int (*FUN)(struct phy *phy, void *param),
+    void *param
+){
+    int status = PHY_OK;
+    struct phy *phy;
+    struct phy_reader *reader = phy_reader_open(filename);
+    if (!reader)
+        return PHY_ERR;
+    while ((status = phy_reader_next(reader, &phy)) == PHY_OK && phy)
+    {
+        if (FUN(phy, param))
+            break;
+    }
+    phy_reader_close(reader);
+    return status;
+}
+
+
+char *phy_write_newickstr(struct phy *phy)
+{
+    return write_newickstr(phy->root, 0);
+}
+
+
+char *phy_write_newickstr_v2(struct phy *phy, int digits)
+{
+    return write_newickstr(phy->root, digits);
+}
+
+
+int phy_write_newick(struct phy *phy, FILE *out, int digits)
+{
+    return phy_write_newick_many(1, &phy, out, digits);
+}
+
+
+int phy_write_newick_many(int ntree, struct phy **trees, FILE *out, int digits)
+{
+    int i;
+    struct newick_writer ctx = {0, NEWICK_CHUNK, 0, out, digits};
+    ctx.newick = malloc(NEWICK_CHUNK);
+    if (!ctx.newick)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    for (i = 0; i < ntree; ++i)
+    {
+        if (write_newick(trees[i]->root, &ctx) || write_nchars(";\n", 2, &ctx))
+        {
+            free(ctx.newick);
+            return PHY_ERR;
+        }
+    }
+    i = write_flush(&ctx);
+    free(ctx.newick);
+    return i;
+}
+
+
+int phy_write_newickfile(
+    struct phy *phy, const char *filename, const char *mode)
+{
+    return phy_write_newickfile_v2(1, &phy, filename, mode, 0);
+}
+
+
+int phy_write_newickfile_v2(
+    int ntree,
+    struct phy **trees,
+    const char *filename,
+    const char *mode,
+    int digits
+){
+    int status;
+    FILE *out = fopen(filename, mode);
+    if (!out)
+    {
+        phy_errno = 5;
+        return PHY_ERR;
+    }
+    status = phy_write_newick_many(ntree, trees, out, digits);
+    if (fclose(out) && status == PHY_OK)
+    {
+        phy_errno = 5;
+        status = PHY_ERR;
+    }
+    return status;
+}
+
+
+static void put_u32(unsigned char *z, unsigned int x)
+{
+    z[0] = x & 0xff;
+    z[1] = (x >> 8) & 0xff;
+    z[2] = (x >> 16) & 0xff;
+    z[3] = (x >> 24) & 0xff;
+}
+
+
+static unsigned int get_u32(const unsigned char *z)
+{
+    return (unsigned int)z[0] | ((unsigned int)z[1] << 8)
+        | ((unsigned int)z[2] << 16) | ((unsigned int)z[3] << 24);
+}
+
+
+static void put_f64(unsigned char *z, double x)
+{
+    unsigned long long u;
+    memcpy(&u, &x, sizeof(double));
+    put_u32(z, (unsigned int)(u & 0xffffffffULL));
+    put_u32(z + 4, (unsigned int)(u >> 32));
+}
+
+
+static double get_f64(const unsigned char *z)
+{
+    double x;
+    unsigned long long u = get_u32(z) | ((unsigned long long)get_u32(z + 4) << 32);
+    memcpy(&x, &u, sizeof(double));
+    return x;
+}
+
+
+unsigned char *phy_write_binarystr(struct phy *phy, size_t *size)
+{
+    int i;
+    int n;
+    size_t len;
+    size_t nstr = 0;
+    unsigned char *buf;
+    unsigned char *z;
+    struct phy_node *p;
+
+    if (refresh(phy))
+        return NULL;
+
+    n = phy->nnode;
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        if (p->lab)
+            nstr += strlen(p->lab);
+        if (p->note)
+            nstr += strlen(p->note);
+    }
+
+    *size = BINARY_HEADER + 24 * (size_t)n + nstr;
+    buf = malloc(*size);
+    if (!buf)
+    {
+        phy_errno = 1;
+        return NULL;
+    }
+
+    memcpy(buf, "PHYB", 4);
+    put_u32(buf + 4, BINARY_VERSION);
+    put_u32(buf + 8, (unsigned int)phy->ntip);
+    put_u32(buf + 12, (unsigned int)n);
+
+    z = buf + BINARY_HEADER;
+    for (i = 0; i < n; ++i, z += 4)
+    {
+        p = phy->nodes[i];
+        put_u32(z, p->anc ? (unsigned int)phy->vseq[p->anc->index] : 0xffffffffU);
+    }
+    for (i = 0; i < n; ++i, z += 8)
+        put_f64(z, phy->nodes[i]->brlen);
+    for (i = 0; i < n; ++i, z += 4)
+        put_u32(z, phy->nodes[i]->lab ? strlen(phy->nodes[i]->lab) : 0);
+    for (i = 0; i < n; ++i, z += 4)
+        put_u32(z, phy->nodes[i]->note ? strlen(phy->nodes[i]->note) : 0);
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        if (p->lab)
+        {
+            len = strlen(p->lab);
+            memcpy(z, p->lab, len);
+            z += len;
+        }
+    }
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        if (p->note)
+        {
+            len = strlen(p->note);
+            memcpy(z, p->note, len);
+            z += len;
+        }
+    }
+    return buf;
+}
+
+
+/* Rebuild a phylogeny from its binary representation. Nodes are linked
+** into the tree in the stored preorder, so the only work left to
+** phy_build is the assignment of indices. */
+struct phy *phy_read_binarystr(const unsigned char *buf, size_t size)
+{
+    int i;
+    int n;
+    int ntip;
+    int err = 6;
+    unsigned int k;
+    size_t nstr = 0;
+    size_t len;
+    const unsigned char *z;
+    const unsigned char *brlen;
+    const unsigned char *lablen;
+    const unsigned char *notelen;
+    const char *str;
+    char *pool = 0;
+    char *dst;
+    struct phy_node *p;
+    struct phy_node *arena = 0;
+    struct phy_node **last = 0;
+    struct phy *phy = 0;
+
+    if (size < BINARY_HEADER || memcmp(buf, "PHYB", 4)
+        || get_u32(buf + 4) != BINARY_VERSION)
+        goto fail;
+    ntip = (int)get_u32(buf + 8);
+    n = (int)get_u32(buf + 12);
+    if (n < 1 || ntip < 1 || ntip > n
+        || (size - BINARY_HEADER) / 24 < (size_t)n)
+        goto fail;
+
+    brlen = buf + BINARY_HEADER + 4 * (size_t)n;
+    lablen = brlen + 8 * (size_t)n;
+    notelen = lablen + 4 * (size_t)n;
+    str = (const char *)(notelen + 4 * (size_t)n);
+    for (i = 0; i < n; ++i)
+        nstr += (size_t)get_u32(lablen + 4*i) + get_u32(notelen + 4*i);
+    if (size - BINARY_HEADER - 24 * (size_t)n != nstr)
+        goto fail;
+
+    arena = malloc(n * sizeof(struct phy_node));
+    last = malloc(n * sizeof(struct phy_node *));
+    pool = malloc(nstr + (size_t)n);
+    if (!arena || !last || !pool)
+    {
+        err = 1;
+        goto fail_alloc;
+    }
+
+    z = buf + BINARY_HEADER;
+    for (i = 0; i < n; ++i, z += 4)
+    {
+        p = arena + i;
+        memset(p, 0, sizeof(struct phy_node));
+        p->index = -1;
+        p->flags = NODE_ARENA;
+        p->brlen = get_f64(brlen + 8*i);
+        k = get_u32(z);
+        if (i == 0)
+        {
+            if (k != 0xffffffffU)
+                goto fail_alloc;
+            continue;
+        }
+        if (k >= (unsigned int)i)
+            goto fail_alloc;
+        p->anc = arena + k;
+        if (p->anc->ndesc++)
+        {
+            last[k]->next = p;
+            p->prev = last[k];
+        }
+        else
+            p->anc->lfdesc = p;
+        last[k] = p;
+    }
+
+    k = 0;
+    for (i = 0; i < n; ++i)
+    {
+        if (!arena[i].ndesc)
+            ++k;
+    }
+    if (k != (unsigned int)ntip)
+        goto fail_alloc;
+
+    dst = pool;
+    for (i = 0; i < n; ++i)
+    {
+        if ((len = get_u32(lablen + 4*i)))
+        {
+            arena[i].lab = dst;
+            arena[i].flags |= NODE_LAB_POOL;
+            memcpy(dst, str, len);
+            dst[len] = 0;
+            dst += len + 1;
+            str += len;
+        }
+    }
+    for (i = 0; i < n; ++i)
+    {
+        if ((len = get_u32(notelen + 4*i)))
+        {
+            arena[i].note = dst;
+            arena[i].flags |= NODE_NOTE_POOL;
+            memcpy(dst, str, len);
+            dst[len] = 0;
+            dst += len + 1;
+            str += len;
+        }
+    }
+
+    free(last);
+    last = 0;
+    phy = build(arena, n, ntip, &err);
+    if (!phy)
+        goto fail_alloc;
+    phy->arena = arena;
+    phy->pool = pool;
+    return phy;
+
+fail_alloc:
+    free(arena);
+    free(last);
+    free(pool);
+fail:
+    phy_errno = err;
+    return NULL;
+}
+
+
+int phy_write_binary(struct phy *phy, const char *filename)
+{
+    int rc = PHY_OK;
+    size_t size;
+    FILE *out;
+    unsigned char *buf = phy_write_binarystr(phy, &size);
+    if (!buf)
+        return PHY_ERR;
+    out = fopen(filename, "wb");
+    if (!out)
+    {
+        phy_errno = 5;
+        free(buf);
+        return PHY_ERR;
+    }
+    if (fwrite(buf, 1, size, out) != size)
+        rc = PHY_ERR;
+    if (fclose(out))
+        rc = PHY_ERR;
+    free(buf);
+    return rc;
+}
+
+
+struct phy *phy_read_binary(const char *filename)
+{
+    size_t size = 0;
+    size_t nAlloc = 4096;
+    size_t n;
+    unsigned char *buf = 0;
+    unsigned char *tmp;
+    struct phy *phy;
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+    {
+        phy_errno = 5;
+        return NULL;
+    }
+    for (;;)
+    {
+        tmp = realloc(buf, nAlloc);
+        if (!tmp)
+        {
+            phy_errno = 1;
+            free(buf);
+            fclose(in);
+            return NULL;
+        }
+        buf = tmp;
+        n = fread(buf + size, 1, nAlloc - size, in);
+        size += n;
+        if (size < nAlloc)
+            break;
+        nAlloc *= 2;
+    }
+    fclose(in);
+    phy = phy_read_binarystr(buf, size);
+    free(buf);
+    return phy;
+}
+
+
+struct phy *phy_extract_clade(struct phy_node *node)
+{
+    struct phy *phy = 0;
+    char *newick = write_newickstr(node, 0);
+    if (!newick)
+        return NULL;
+    phy = phy_read_newickstr(newick);
+    free(newick);
+    if (!phy)
+        return NULL;
+    phy->root->brlen = 0;
+    return phy;
+}
+
+
+// Copy the nodes on the paths from the tips to the root of phy, returning
+// the root of the copy and adding the number of nodes copied to *nnode.
+// The node marks are shared by all callers, so this must run under the
+// phy_mark lock.
+static struct phy_node *copy_marked(
+    int ntip,
+    struct phy_node **tips,
+    struct phy *phy,
+    int *nnode
+){
+    int i;
+    unsigned int gen;
+    struct phy_node *d;
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *root;
+    struct phy_node *head;
+
+    if (!(gen = stamp(phy)))
+        return NULL;
+
+    // mark the nodes on the paths from the tips to the root
+    for (i = 0; i < ntip; ++i)
+    {
+        p = tips[i];
+        phy->mark[p->index] = gen;
+        while ((p = p->anc) != 0)
+        {
+            if (phy->mark[p->index] == gen)
+                break;
+            phy->mark[p->index] = gen;
+        }
+    }
+
+    // copy the marked nodes in preorder, visiting no others
+    root = 0;
+    head = 0;
+
+    p = phy->root;
+    while (p)
+    {
+        (*nnode)++;
+        q = node_new();
+        if (!q)
+        {
+            phy_errno = 1;
+            cleanup(root);
+            return NULL;
+        }
+        if (!root)
+            root = q;
+        else
+        {
+            q->brlen = p->brlen;
+            if (p->lab)
+            {
+                q->lab = malloc(strlen(p->lab)+1);
+                if (!q->lab)
+                {
+                    phy_errno = 1;
+                    node_free(q);
+                    cleanup(root);
+                    return NULL;
+                }
+                strcpy(q->lab, p->lab);
+            }
+            phy_node_add_child(head, q);
+        }
+        if ((d = marked(phy, p->lfdesc, gen)) != 0)
+        {
+            head = q;
+            p = d;
+        }
+        else
+        {
+            // head is the copy of the parent of p
+            while (p != phy->root && !(d = marked(phy, p->next, gen)))
+            {
+                p = p->anc;
+                head = head->anc;
+            }
+            p = p == phy->root ? 0 : d;
+        }
+    }
+
+    return root;
+}
+
+
+struct phy *phy_extract_subtree(
+    int ntip,
+    struct phy_node **tips,
+    struct phy *phy
+){
+    int nnode = 0;
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *root;
+
+    if (refresh(phy))
+        return NULL;
+
+#ifdef _OPENMP
+    #pragma omp critical(phy_mark)
+#endif
+    root = copy_marked(ntip, tips, phy, &nnode);
+
+    if (!root)
+        return NULL;
+
+    root->brlen = 0;
+    p = root;
+    while (p)
+    {
+        while (p->ndesc == 1)
+        {
+            q = p->lfdesc;
+            q->brlen += p->brlen;
+            q->next = p->next;
+            q->prev = p->prev;
+            q->anc = p->anc;
+            if (p->prev)
+                p->prev->next = q;
+            if (p->next)
+                p->next->prev = q;
+            if (p->anc && p->anc->lfdesc == p)
+                p->anc->lfdesc = q;
+            if (p == root) {
+                root = q;
+                root->brlen = 0;
+            }
+            node_free(p);
+            p = q;
+            nnode--;
+        }
+        if (p->lfdesc)
+            p = p->lfdesc;
+        else if (p->next)
+            p = p->next;
+        else {
+            while (p->anc != 0 && p->next == 0)
+                p = p->anc;
+            p = p->next;
+        }
+    }
+
+    return phy_build(root, nnode, ntip);
+}
+
+
+static int compare_int(const void *a, const void *b)
+{
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
+
+
+// Sort n integers and remove duplicates, returning the number that remain
+static int sort_unique(int *a, int n)
+{
+    int i;
+    int m = 0;
+    qsort(a, n, sizeof(int), compare_int);
+    for (i = 0; i < n; ++i)
+        if (!m || a[i] != a[m-1])
+            a[m++] = a[i];
+    return m;
+}
+
+
+static int ages_build(struct phy *phy);
+
+
+/* Induced subtree of k terminal nodes. Its nodes are the tips and the mrcas
+** of tips adjacent in preorder, which are exactly the branching points of
+** the subtree, so only O(k) nodes of phy are visited. The copies are laid
+** out in one arena in preorder and linked using a stack of the current
+** path; the length of each branch is the difference in node ages. As for
+** phy_extract_subtree, labels are copied except for the root of phy.
+** Errors are reported through *err. */
+static struct phy *induced_subtree(
+    struct phy *phy,
+    struct phy_lca *lca,
+    const double *age,
+    int k,
+    struct phy_node **tips,
+    int *err
+){
+    int i;
+    int n;
+    int ntip;
+    int depth = 0;
+    size_t len;
+    size_t nstr = 0;
+    int *pos = 0;
+    int *path = 0;
+    char *z;
+    char *pool = 0;
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *arena = 0;
+    struct phy *sub = 0;
+
+    if (k < 1)
+    {
+        *err = 10;
+        return NULL;
+    }
+    pos = malloc(2 * k * sizeof(int));
+    path = malloc(2 * k * sizeof(int));
+    if (!pos || !path)
+        goto nomem;
+
+    for (i = 0; i < k; ++i)
+        pos[i] = phy->vseq[tips[i]->index];
+    n = ntip = sort_unique(pos, k);
+    for (i = 0; i < ntip - 1; ++i)
+        pos[n++] = phy->vseq[phy_lca_query(lca,
+            phy->nodes[pos[i]], phy->nodes[pos[i+1]])->index];
+    n = sort_unique(pos, n);
+
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[pos[i]];
+        if (p->lab && p != phy->root)
+            nstr += strlen(p->lab) + 1;
+    }
+    arena = malloc(n * sizeof(struct phy_node));
+    z = pool = malloc(nstr ? nstr : 1);
+    if (!arena || !pool)
+        goto nomem;
+
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[pos[i]];
+        q = arena + i;
+        memset(q, 0, sizeof(struct phy_node));
+        q->index = -1;
+        q->flags = NODE_ARENA;
+        if (p->lab && p != phy->root)
+        {
+            len = strlen(p->lab) + 1;
+            q->lab = memcpy(z, p->lab, len);
+            q->flags |= NODE_LAB_POOL;
+            z += len;
+        }
+        // pop the nodes whose clades do not contain p
+        while (depth && pos[i] > phy->vseq[
+            phy->nodes[pos[path[depth-1]]]->lastvisit->index])
+            depth--;
+        if (depth)
+        {
+            phy_node_add_child(arena + path[depth-1], q);
+            q->brlen = age[p->index]
+                - age[phy->nodes[pos[path[depth-1]]]->index];
+        }
+        if (p->ndesc)
+            path[depth++] = i;
+    }
+
+    sub = build(arena, n, ntip, err);
+    if (!sub)
+        goto fail;
+    sub->arena = arena;
+    sub->pool = pool;
+    free(pos);
+    free(path);
+    return sub;
+
+nomem:
+    *err = 1;
+fail:
+    free(pos);
+    free(path);
+    free(arena);
+    free(pool);
+    return NULL;
+}
+
+
+int phy_extract_subtrees(
+    struct phy *phy,
+    struct phy_lca *lca,
+    int nset,
+    const int *ntip,
+    struct phy_node ***tips,
+    int nthreads,
+    struct phy **out
+){
+    int i;
+    int err = 0;
+    int *errs;
+    struct phy_lca *own = 0;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (refresh(phy) || ages_build(phy))
+        return PHY_ERR;
+    if (!lca && !(lca = own = phy_lca_new(phy)))
+        return PHY_ERR;
+
+    errs = calloc(nset ? nset : 1, sizeof(int));
+    if (!errs)
+    {
+        phy_lca_free(own);
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+
+    // the phylogeny, its ages and the LCA index are only read here, and
+    // each subtree is written to its own slot
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(nthreads)
+#endif
+    for (i = 0; i < nset; ++i)
+        out[i] = induced_subtree(phy, lca, phy->age, ntip[i], tips[i], errs + i);
+
+    for (i = 0; i < nset; ++i)
+    {
+        if (!out[i] && !err)
+            err = errs[i] ? errs[i] : 1;
+    }
+    if (err)
+    {
+        for (i = 0; i < nset; ++i)
+        {
+            phy_free(out[i]);
+            out[i] = 0;
+        }
+        phy_errno = err;
+    }
+
+    free(errs);
+    phy_lca_free(own);
+    return err ? PHY_ERR : PHY_OK;
+}
+
+
+void phy_node_rotate(int n, struct phy_node **nodes, struct phy *phy)
+{
+    int i;
+    struct phy_node *d = 0;
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *node;
+
+    for (i = 0; i < n; ++i)
+    {
+        node = nodes[i];
+
+        q = node->lfdesc;
+        p = q->next;
+
+        touch(node);
+        while (q)
+        {
+            unlink_child(node, q);
+            if (d)
+            {
+                q->prev = d;
+                d = q;
+            }
+            else
+                d = q;
+            q = p;
+            if (q)
+                p = q->next;
+        }
+
+        while (d)
+        {
+            q = d;
+            d = q->prev;
+            phy_node_add_child(node, q);
+        }
+
+    }
+
+    // only the smallest clade containing the rotated nodes is renumbered
+    refresh(phy);
+}
+
+
+/* Tree rearrangements are made by relinking nodes in place: no node is
+** created or destroyed, so the indices of a phylogeny only change within
+** the smallest clade spanning a move, and undoing a move restores the
+** original child order and therefore the original indices. */
+
+// Put node b in the place of node a among a's siblings, detaching a
+static void relink(struct phy_node *a, struct phy_node *b)
+{
+    if (a == b)
+        return;
+    touch(a->anc);
+    b->anc = a->anc;
+    b->prev = a->prev;
+    b->next = a->next;
+    if (b->prev)
+        b->prev->next = b;
+    else
+        b->anc->lfdesc = b;
+    if (b->next)
+        b->next->prev = b;
+    a->anc = 0;
+    a->prev = 0;
+    a->next = 0;
+}
+
+
+// Make a and b, in that order, the only children of node p
+static void adopt(struct phy_node *p, struct phy_node *a, struct phy_node *b)
+{
+    touch(p);
+    p->lfdesc = a;
+    p->ndesc = 2;
+    a->anc = b->anc = p;
+    a->prev = 0;
+    a->next = b;
+    b->prev = a;
+    b->next = 0;
+}
+
+
+// Exchange the places of two nodes that are not siblings
+static void exchange(struct phy_node *a, struct phy_node *b)
+{
+    struct phy_node *anc = a->anc;
+    struct phy_node *prev = a->prev;
+    struct phy_node *next = a->next;
+
+    touch(a->anc);
+    touch(b->anc);
+
+    a->anc = b->anc;
+    a->prev = b->prev;
+    a->next = b->next;
+    if (a->prev)
+        a->prev->next = a;
+    else
+        a->anc->lfdesc = a;
+    if (a->next)
+        a->next->prev = a;
+
+    b->anc = anc;
+    b->prev = prev;
+    b->next = next;
+    if (b->prev)
+        b->prev->next = b;
+    else
+        b->anc->lfdesc = b;
+    if (b->next)
+        b->next->prev = b;
+}
+
+
+// Return 1 if node is a descendant of, or equal to, anc
+static int within(struct phy_node *node, struct phy_node *anc)
+{
+    for (; node; node = node->anc)
+        if (node == anc)
+            return 1;
+    return 0;
+}
+
+
+/* Reroot the clade of the bifurcating node s on the branch above r, where
+** r is a proper descendant of s. The path from r up to s is reversed and s
+** is moved onto the branch above r, so that r and the node above it on the
+** path become the children of s. Branch lengths travel with the edges:
+** each node on the path takes the length of the edge to the node it now
+** descends from, the two branches that met at s are joined and r keeps
+** its length. The child of s off the path is stored in *z and the other
+** new child of s is returned (if r was a child of s nothing is relinked
+** and this is *z). */
+static struct phy_node *reroot_clade(
+    struct phy_node *s, struct phy_node *r, struct phy_node **z)
+{
+    int first;
+    double b;
+    double c;
+    struct phy_node *u;
+    struct phy_node *w;
+    struct phy_node *x;
+    struct phy_node *y;
+
+    for (y = r; y->anc != s; y = y->anc)
+        y->flags |= NODE_MARK;
+    *z = y == s->lfdesc ? y->next : s->lfdesc;
+    if (y == r)
+        return *z;
+    first = y == s->lfdesc;
+
+    // shift the branch lengths one edge up the path
+    b = r->brlen;
+    for (x = r->anc; x != s; x = x->anc)
+    {
+        c = x->brlen;
+        x->brlen = b;
+        b = c;
+    }
+    (*z)->brlen += b;
+
+    // walk down the path from y: each node on it takes the node above it
+    // (z in the case of y) in place of the child leading to r
+    u = *z;
+    x = y;
+    while (x != r)
+    {
+        for (w = x->lfdesc; !(w->flags & NODE_MARK); w = w->next);
+        w->flags &= ~NODE_MARK;
+        relink(w, u);
+        u = x;
+        x = w;
+    }
+
+    if (first)
+        adopt(s, r, u);
+    else
+        adopt(s, u, r);
+
+    return u;
+}
+
+
+/* Whether node is part of phy. A node added since the arrays of phy were
+** last built is only known to it once they are refreshed. */
+static int owned(struct phy *phy, struct phy_node *node)
+{
+    if (node->phy != phy && refresh(phy))
+        return 0;
+    return node->phy == phy;
+}
+
+
+int phy_nni(
+    struct phy *phy,
+    struct phy_node *a,
+    struct phy_node *b,
+    struct phy_move *move
+){
+    if (!owned(phy, a) || !owned(phy, b)
+        || !a->anc || !a->anc->anc || b->anc != a->anc->anc || b == a->anc)
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+    exchange(a, b);
+    if (move)
+    {
+        move->type = PHY_NNI;
+        move->node[0] = a;
+        move->node[1] = b;
+    }
+    return PHY_OK;
+}
+
+
+int phy_spr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *t,
+    struct phy_move *move
+){
+    int first;
+    struct phy_node *p = s->anc;
+    struct phy_node *c;
+
+    if (!owned(phy, s) || !owned(phy, t)
+        || !p || p->ndesc != 2 || !p->anc || !t->anc || within(t, p))
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+    first = s == p->lfdesc;
+    c = first ? s->next : p->lfdesc;
+    if (move)
+    {
+        move->type = PHY_SPR;
+        move->first = first;
+        move->node[0] = s;
+        move->node[1] = c;
+        move->node[2] = t;
+        move->brlen[0] = p->brlen;
+        move->brlen[1] = c->brlen;
+        move->brlen[2] = t->brlen;
+    }
+
+    relink(p, c);
+    c->brlen += p->brlen;
+    relink(t, p);
+    if (first)
+        adopt(p, s, t);
+    else
+        adopt(p, t, s);
+    p->brlen = 0.5 * t->brlen;
+    t->brlen -= p->brlen;
+
+    return PHY_OK;
+}
+
+
+int phy_tbr(
+    struct phy *phy,
+    struct phy_node *s,
+    struct phy_node *r,
+    struct phy_node *t,
+    struct phy_move *move
+){
+    double b;
+    double len[3];
+    struct phy_node *u;
+    struct phy_node *y;
+    struct phy_node *z;
+
+    if (r == s)
+    {
+        if (phy_spr(phy, s, t, move))
+            return PHY_ERR;
+        if (move)
+        {
+            move->type = PHY_TBR;
+            move->node[3] = 0;
+        }
+        return PHY_OK;
+    }
+
+    if (!owned(phy, s) || !owned(phy, t)
+        || !within(r, s) || s->ndesc != 2 || !s->anc || s->anc->ndesc != 2
+        || !s->anc->anc || !t->anc || within(t, s->anc))
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+
+    for (y = r; y->anc != s; y = y->anc);
+    z = y == s->lfdesc ? y->next : s->lfdesc;
+    len[0] = r->brlen;
+    len[1] = y->brlen;
+    len[2] = z->brlen;
+    if (move)
+    {
+        move->node[3] = r;
+        move->node[4] = y;
+        move->node[5] = z;
+        move->brlen[3] = len[0];
+        move->brlen[4] = len[1];
+        move->brlen[5] = len[2];
+    }
+
+    // the new root branch of the clade is split at its midpoint
+    u = reroot_clade(s, r, &z);
+    b = r->brlen;
+    r->brlen = 0.5 * b;
+    if (u == z)
+        z->brlen += b - r->brlen;
+    else
+        u->brlen = b - r->brlen;
+
+    if (phy_spr(phy, s, t, move))
+    {
+        // the clade is put back as phy_move_undo would
+        reroot_clade(s, z, &u);
+        r->brlen = len[0];
+        y->brlen = len[1];
+        z->brlen = len[2];
+        return PHY_ERR;
+    }
+    if (move)
+        move->type = PHY_TBR;
+
+    return PHY_OK;
+}
+
+
+int phy_move_undo(struct phy *phy, struct phy_move *move)
+{
+    struct phy_node *s;
+    struct phy_node *p;
+    struct phy_node *c;
+    struct phy_node *t;
+    struct phy_node *z;
+
+    if (!owned(phy, move->node[0]))
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+
+    if (move->type == PHY_NNI)
+    {
+        exchange(move->node[0], move->node[1]);
+        return PHY_OK;
+    }
+
+    s = move->node[0];
+    c = move->node[1];
+    t = move->node[2];
+    p = s->anc;
+
+    relink(p, t);
+    t->brlen = move->brlen[2];
+    relink(c, p);
+    if (move->first)
+        adopt(p, s, c);
+    else
+        adopt(p, c, s);
+    p->brlen = move->brlen[0];
+    c->brlen = move->brlen[1];
+
+    if (move->type == PHY_TBR && move->node[3])
+    {
+        // rerooting the clade on the branch above its former root branch
+        // reverses the path, after which the lengths are restored
+        reroot_clade(s, move->node[5], &z);
+        move->node[3]->brlen = move->brlen[3];
+        move->node[4]->brlen = move->brlen[4];
+        move->node[5]->brlen = move->brlen[5];
+    }
+    return PHY_OK;
+}
+
+
+// Counterpart in a copy of a node of its phylogeny, where the copy of the
+// node at preorder position i is arena[i]
+static struct phy_node *node_image(
+    struct phy *phy, struct phy_node *arena, struct phy_node *node)
+{
+    return node ? arena + phy->vseq[node->index] : NULL;
+}
+
+
+/* Copy a phylogeny node for node in a single preorder pass. The copies are
+** laid out in preorder in one arena and their labels and notes in one
+** string pool, so indices, the traversal arrays and clade boundaries carry
+** over unchanged. */
+struct phy *phy_duplicate(struct phy *phy)
+{
+    int i;
+    int n;
+    size_t nstr = 0;
+    size_t len;
+    char *z;
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *arena;
+    struct phy *dup;
+
+    if (refresh(phy))
+        return NULL;
+
+    n = phy->nnode;
+
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        if (p->lab)
+            nstr += strlen(p->lab) + 1;
+        if (p->note)
+            nstr += strlen(p->note) + 1;
+    }
+
+    dup = malloc(sizeof(struct phy));
+    arena = malloc(n * sizeof(struct phy_node));
+    z = malloc(nstr ? nstr : 1);
+    if (dup)
+    {
+        dup->nodes = malloc(n * sizeof(struct phy_node *));
+        dup->inodes = malloc((n - phy->ntip) * sizeof(struct phy_node *));
+        dup->vseq = malloc(n * sizeof(int));
+    }
+    if (!dup || !arena || !z || !dup->nodes || !dup->inodes || !dup->vseq)
+    {
+        if (dup)
+        {
+            free(dup->nodes);
+            free(dup->inodes);
+            free(dup->vseq);
+        }
+        free(dup);
+        free(arena);
+        free(z);
+        phy_errno = 1;
+        return NULL;
+    }
+
+    dup->ntip = phy->ntip;
+    dup->nnode = n;
+    dup->root = arena;
+    dup->arena = arena;
+    dup->pool = z;
+    dup->age = 0;
+    dup->depth = 0;
+    dup->height = 0;
+    dup->level = 0;
+    dup->nlevel = 0;
+    dup->dirty = 0;
+    dup->labels = 0;
+    dup->mark = 0;
+    dup->gen = 0;
+    memcpy(dup->vseq, phy->vseq, n * sizeof(int));
+
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        q = arena + i;
+        *q = *p;
+        q->flags = NODE_ARENA;
+        q->lfdesc = node_image(phy, arena, p->lfdesc);
+        q->next = node_image(phy, arena, p->next);
+        q->prev = node_image(phy, arena, p->prev);
+        q->anc = node_image(phy, arena, p->anc);
+        q->lastvisit = node_image(phy, arena, p->lastvisit);
+        // client data belongs to the original, which may free it at any
+        // time, so the copy starts without any
+        q->data = 0;
+        q->data_free = 0;
+        q->phy = dup;
+        if (p->lab)
+        {
+            len = strlen(p->lab) + 1;
+            q->lab = memcpy(z, p->lab, len);
+            q->flags |= NODE_LAB_POOL;
+            z += len;
+        }
+        if (p->note)
+        {
+            len = strlen(p->note) + 1;
+            q->note = memcpy(z, p->note, len);
+            q->flags |= NODE_NOTE_POOL;
+            z += len;
+        }
+        dup->nodes[i] = q;
+        if (p->ndesc)
+            dup->inodes[p->index - phy->ntip] = q;
+    }
+
+    return dup;
+}
+
+
+/* A move of the root of a phylogeny from the branch above a, one child of
+** the root, onto the branch above c, a child of a, as recorded so that it
+** can be undone exactly */
+struct root_move {
+    struct phy_node *c;
+    struct phy_node *s;
+    int first;
+    double brlen[3];
+};
+
+
+/* Move the root onto the branch above c, whose parent a is a child of the
+** bifurcating root. The other child s of the root takes the place of c
+** among the children of a and inherits the branch joining a and s, c and a
+** become the children of the root in that order, and the root is placed at
+** the midpoint of the branch above c. The phylogeny must be marked dirty
+** at its root, so that touch does no work. */
+static void root_down(struct phy_node *c, struct root_move *move)
+{
+    struct phy_node *a = c->anc;
+    struct phy_node *root = a->anc;
+    struct phy_node *s = a == root->lfdesc ? a->next : root->lfdesc;
+    if (move)
+    {
+        move->c = c;
+        move->s = s;
+        move->first = a == root->lfdesc;
+        move->brlen[0] = c->brlen;
+        move->brlen[1] = a->brlen;
+        move->brlen[2] = s->brlen;
+    }
+    s->brlen += a->brlen;
+    a->brlen = c->brlen - 0.5 * c->brlen;
+    c->brlen = 0.5 * c->brlen;
+    relink(c, s);
+    adopt(root, c, a);
+}
+
+
+// Undo a move made by root_down
+static void root_up(struct root_move *move)
+{
+    struct phy_node *c = move->c;
+    struct phy_node *s = move->s;
+    struct phy_node *root = c->anc;
+    struct phy_node *a = c->next;
+    relink(s, c);
+    if (move->first)
+        adopt(root, a, s);
+    else
+        adopt(root, s, a);
+    c->brlen = move->brlen[0];
+    a->brlen = move->brlen[1];
+    s->brlen = move->brlen[2];
+}
+
+
+/* Root an unrooted phylogeny on the midpoint of the branch above x, a child
+** of its root, with a new root node whose children are x and the old
+** root. Returns the new root, or NULL if it could not be allocated. */
+static struct phy_node *root_add(struct phy *phy, struct phy_node *x)
+{
+    struct phy_node *old = phy->root;
+    struct phy_node *root = node_new();
+    if (!root)
+        return NULL;
+    touch(old);
+    unlink_child(old, x);
+    root->phy = phy;
+    phy->root = root;
+    phy->dirty = root;
+    adopt(root, x, old);
+    old->brlen = x->brlen - 0.5 * x->brlen;
+    x->brlen = 0.5 * x->brlen;
+    return root;
+}
+
+
+int phy_reroot_inplace(struct phy *phy, struct phy_node *node)
+{
+    double b;
+    struct phy_node *a;
+    struct phy_node *c;
+    struct phy_node *s;
+    struct phy_node *root = phy->root;
+
+    if (refresh(phy))
+        return PHY_ERR;
+    if (node == root || node->phy != phy || root->ndesc < 2)
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+
+    // every edit below renumbers the whole tree
+    touch(root);
+
+    for (a = node; a->anc != root; a = a->anc);
+    if (root->ndesc > 2)
+    {
+        if (!root_add(phy, a))
+            return PHY_ERR;
+        root = phy->root;
+    }
+    else if (a == node)
+    {
+        // the root stays on the same branch, which is split at node's
+        // midpoint
+        s = a == root->lfdesc ? a->next : root->lfdesc;
+        b = node->brlen;
+        node->brlen = 0.5 * b;
+        s->brlen += b - node->brlen;
+        adopt(root, node, s);
+    }
+
+    // walk the root down the path from a to node
+    for (c = node; c != a; c = c->anc)
+        c->flags |= NODE_MARK;
+    while (a != node)
+    {
+        for (c = a->lfdesc; !(c->flags & NODE_MARK); c = c->next);
+        c->flags &= ~NODE_MARK;
+        root_down(c, NULL);
+        a = c;
+    }
+
+    return refresh(phy);
+}
+
+
+int phy_unroot_inplace(struct phy *phy)
+{
+    struct phy_node *p;
+    struct phy_node *q;
+    struct phy_node *root = phy->root;
+
+    if (refresh(phy))
+        return PHY_ERR;
+    if (root->ndesc != 2)
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+    p = root->lfdesc;
+    q = p->next;
+    if (!p->ndesc)
+    {
+        p = q;
+        q = root->lfdesc;
+    }
+    if (!p->ndesc)
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+
+    touch(root);
+    unlink_child(root, p);
+    unlink_child(root, q);
+    q->brlen += p->brlen;
+    p->brlen = 0;
+    phy_node_add_child(p, q);
+    phy->root = p;
+    phy->dirty = p;
+
+    // the old root leaves the traversal arrays before it is freed; as the
+    // tree shrinks the arrays are not reallocated and this cannot fail
+    refresh(phy);
+    node_free(root);
+    return PHY_OK;
+}
+
+
+int phy_reroot_foreach(
+    struct phy *phy,
+    int (*FUN)(struct phy *phy, struct phy_node *node, void *param),
+    void *param
+){
+    int i;
+    int top = 0;
+    int stop;
+    double brlen[2];
+    struct phy_node *c;
+    struct phy_node *side[2];
+    struct phy_node *added = 0;
+    struct phy_node *old = phy->root;
+    struct root_move *stack;
+
+    if (refresh(phy))
+        return PHY_ERR;
+    if (old->ndesc < 2)
+    {
+        phy_errno = 7;
+        return PHY_ERR;
+    }
+    // no path from a child of the root is longer than the number of nodes
+    stack = malloc(phy->nnode * sizeof(struct root_move));
+    if (!stack)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+
+    touch(old);
+    if (old->ndesc > 2)
+    {
+        // the branches split by the new root are restored exactly at the end
+        brlen[0] = old->brlen;
+        brlen[1] = old->lfdesc->brlen;
+        if (!(added = root_add(phy, old->lfdesc)))
+        {
+            free(stack);
+            return PHY_ERR;
+        }
+    }
+
+    /* Every branch other than the one the root sits on is reached by
+    ** walking the root down into the clade of one of its two children and
+    ** back, so each step moves the root across a single node */
+    side[0] = phy->root->lfdesc;
+    side[1] = side[0]->next;
+    stop = FUN(phy, phy->root->lfdesc, param);
+    for (i = 0; i < 2 && !stop; ++i)
+    {
+        c = side[i]->lfdesc;
+        for (;;)
+        {
+            if (c && !stop)
+            {
+                root_down(c, stack + top++);
+                stop = FUN(phy, c, param);
+                c = c->lfdesc;
+            }
+            else if (top)
+            {
+                c = stack[--top].c;
+                root_up(stack + top);
+                c = c->next;
+            }
+            else
+                break;
+        }
+    }
+
+    if (added)
+    {
+        touch(added);
+        c = added->lfdesc;
+        unlink_child(added, c);
+        unlink_child(added, old);
+        old->lfdesc->prev = c;
+        c->next = old->lfdesc;
+        c->anc = old;
+        old->lfdesc = c;
+        old->ndesc++;
+        old->brlen = brlen[0];
+        c->brlen = brlen[1];
+        phy->root = old;
+        phy->dirty = old;
+        refresh(phy);
+        node_free(added);
+    }
+    free(stack);
+
+    return refresh(phy);
+}
+
+
+void phy_reroot(
+    struct phy_node *node,
+    struct phy **in,
+    struct phy **out
+){
+    struct phy *phy;
+
+    if (*in == *out)
+    {
+        phy_reroot_inplace(*in, node);
+        return;
+    }
+
+    // the copy preserves node indices
+    phy = phy_duplicate(*in);
+    if (phy && phy_reroot_inplace(phy, phy_node_get(phy, node->index)))
+    {
+        phy_free(phy);
+        phy = 0;
+    }
+    *out = phy;
+}
+
+
+void phy_unroot(struct phy **in, struct phy **out)
+{
+    struct phy *phy;
+
+    if (!phy_isrooted(*in))
+    {
+        *out = 0;
+        return;
+    }
+
+    if (*in == *out)
+    {
+        phy_unroot_inplace(*in);
+        return;
+    }
+
+    phy = phy_duplicate(*in);
+    if (phy && phy_unroot_inplace(phy))
+    {
+        phy_free(phy);
+        phy = 0;
+    }
+    *out = phy;
+}
+
+
+struct phy_node *phy_node_lfdesc(struct phy_node *node)
+{
+    return node->lfdesc;
+}
+
+
+struct phy_node *phy_node_rtdesc(struct phy_node *node)
+{
+    struct phy_node *r;
+    switch (node->ndesc)
+    {
+        case 0:
+            return NULL;
+        case 2:
+            return node->lfdesc->next;
+        case 3:
+            return node->lfdesc->next->next;
+        case 4:
+            return node->lfdesc->next->next->next;
+        case 5:
+            return node->lfdesc->next->next->next->next;
+        default:
+            for (r = node->lfdesc; r->next != 0; r = r->next) {};
+            return r;
+    }
+}
+
+
+struct phy_node *phy_node_next(struct phy_node *node)
+{
+    return node->next;
+}
+
+
+struct phy_node *phy_node_prev(struct phy_node *node)
+{
+    return node->prev;
+}
+
+
+struct phy_node *phy_node_anc(struct phy_node *node)
+{
+    return node->anc;
+}
+
+
+double phy_node_brlen(struct phy_node *node)
+{
+    return node->brlen;
+}
+
+
+int phy_node_index(struct phy_node *node)
+{
+    return node->index;
+}
+
+
+int phy_node_ndesc(struct phy_node *node)
+{
+    return node->ndesc;
+}
+
+
+int phy_node_istip(struct phy_node *node)
+{
+    return node->ndesc ? 0 : 1;
+}
+
+
+int phy_isrooted(struct phy *phy)
+{
+    return phy->root->ndesc > 2 ? 0 : 1;
+}
+
+
+int phy_nnode(struct phy *phy)
+{
+    refresh(phy);
+    return phy->nnode;
+}
+
+
+int phy_ntip(struct phy *phy)
+{
+    refresh(phy);
+    return phy->ntip;
+}
+
+
+void phy_node_swap(struct phy_node *a, struct phy_node *b)
+{
+    if (!a->anc || !b->anc || a->anc != b->anc)
+        return;
+
+    touch(a->anc);
+
+    if (a->next == b) {
+        a->next = b->next;
+        if (a->next)
+            a->next->prev = a;
+        b->next = a;
+        if (a->prev)
+            a->prev->next = b;
+        b->prev = a->prev;
+        a->prev = b;
+    } else if (b->next == a) {
+        b->next = a->next;
+        if (b->next)
+            b->next->prev = b;
+        a->next = b;
+        if (b->prev)
+            b->prev->next = a;
+        a->prev = b->prev;
+        b->prev = a;
+    } else {
+        struct phy_node *prev;
+        struct phy_node *next;
+
+        next = a->next;
+        prev = a->prev;
+
+        a->next = b->next;
+        a->prev = b->prev;
+        if (b->next)
+            b->next->prev = a;
+        if (b->prev)
+            b->prev->next = a;
+        b->next = next;
+        b->prev = prev;
+        if (next)
+            next->prev = b;
+        if (prev)
+            prev->next = b;
+    }
+    if (a->anc->lfdesc == a)
+        a->anc->lfdesc = b;
+    else if (a->anc->lfdesc == b)
+        a->anc->lfdesc = a;
+}
+
+
+// Stable merge sort of the child list of p into increasing order of
+// key[child->index]
+static void sort_children(struct phy_node *p, const int *key)
+{
+    int k;
+    int na;
+    int nb;
+    int merges;
+    struct phy_node *a;
+    struct phy_node *b;
+    struct phy_node *e;
+    struct phy_node *head = p->lfdesc;
+    struct phy_node *tail;
+
+    // bottom-up merging of runs of length k = 1, 2, 4, ... using only
+    // the next links, which are repaired along with prev afterwards
+    for (k = 1; ; k *= 2)
+    {
+        a = head;
+        head = tail = 0;
+        merges = 0;
+        while (a)
+        {
+            merges++;
+            b = a;
+            for (na = 0; na < k && b; ++na)
+                b = b->next;
+            nb = k;
+            while (na > 0 || (nb > 0 && b))
+            {
+                if (na == 0 || (nb > 0 && b && key[b->index] < key[a->index]))
+                {
+                    e = b;
+                    b = b->next;
+                    nb--;
+                }
+                else
+                {
+                    e = a;
+                    a = a->next;
+                    na--;
+                }
+                if (tail)
+                    tail->next = e;
+                else
+                    head = e;
+                tail = e;
+            }
+            a = b;
+        }
+        tail->next = 0;
+        if (merges <= 1)
+            break;
+    }
+
+    p->lfdesc = head;
+    for (e = head, a = 0; e; a = e, e = e->next)
+        e->prev = a;
+}
+
+
+int phy_ladderize(struct phy *phy, int *n, int *perm)
+{
+    int i;
+    int *size = 0;
+    struct phy_node *p;
+
+    if (refresh(phy))
+        return PHY_ERR;
+
+    if (!n)
+    {
+        // number of descendants of each node, in a postorder pass
+        size = calloc(phy->nnode, sizeof(int));
+        if (!size)
+        {
+            phy_errno = 1;
+            return PHY_ERR;
+        }
+        for (i = phy->nnode - 1; i > 0; --i)
+        {
+            p = phy->nodes[i];
+            size[p->anc->index] += size[p->index] + 1;
+        }
+        n = size;
+    }
+
+    for (i = 0; i < phy->nnode - phy->ntip; ++i)
+    {
+        p = phy->inodes[i];
+        if (p->ndesc > 1)
+            sort_children(p, n);
+    }
+
+    free(size);
+    invalidate(phy);
+    reindex(phy, phy->root, 0, 0, phy->ntip, perm);
+    phy->dirty = 0;
+
+    return PHY_OK;
+}
+
+
+struct phy_node *phy_root(struct phy *phy)
+{
+    return phy->root;
+}
+
+
+struct phy_node *phy_node_get(struct phy *phy, int index)
+{
+    refresh(phy);
+    if (index >= 0 && index < phy->nnode)
+        return phy->nodes[phy->vseq[index]];
+    return NULL;
+}
+
+
+// FNV-1a hash of a string
+static size_t hash(const char *z)
+{
+    size_t h = 2166136261u;
+    while (*z)
+    {
+        h ^= (unsigned char)*z++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/* Build the label hash table of a phylogeny. Nodes are inserted in postorder
+** and only the first node with a given label is kept, so that a lookup
+** finds the same node a postorder scan would. */
+static int labels_fill(struct phy *phy)
+{
+    int i;
+    int n = 0;
+    size_t h;
+    size_t size = 16;
+    struct phy_node *p;
+    struct phy_node **labels;
+
+    for (i = 0; i < phy->nnode; ++i)
+        if (phy->nodes[i]->lab)
+            n++;
+    // keep the load factor at or below one half
+    while (size < 2 * (size_t)n)
+        size *= 2;
+
+    labels = calloc(size, sizeof(struct phy_node *));
+    if (!labels)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+
+    for (i = phy->nnode - 1; i >= 0; --i)
+    {
+        p = phy->nodes[i];
+        if (!p->lab)
+            continue;
+        for (h = hash(p->lab) & (size - 1); labels[h]; h = (h + 1) & (size - 1))
+        {
+            if (strcmp(p->lab, labels[h]->lab) == 0)
+                break;
+        }
+        if (!labels[h])
+            labels[h] = p;
+    }
+
+    phy->mask = size - 1;
+    STORE(phy->labels, labels);
+    return PHY_OK;
+}
+
+
+static int labels_build(struct phy *phy)
+{
+    int ret = PHY_OK;
+    if (LOAD(phy->labels))
+        return PHY_OK;
+#ifdef _OPENMP
+    #pragma omp critical(phy_cache)
+#endif
+    {
+        if (!phy->labels)
+            ret = labels_fill(phy);
+    }
+    return ret;
+}
+
+
+// Look up a label in the hash table of a phylogeny
+static struct phy_node *labels_find(struct phy *phy, const char *label)
+{
+    size_t h;
+    for (h = hash(label) & phy->mask; phy->labels[h];
+        h = (h + 1) & phy->mask)
+    {
+        if (strcmp(label, phy->labels[h]->lab) == 0)
+            return phy->labels[h];
+    }
+    return NULL;
+}
+
+
+struct phy_node *phy_node_find(struct phy *phy, const char *label)
+{
+    struct phy_cursor cursor;
+    struct phy_node *node = 0;
+
+    if (refresh(phy) == PHY_OK && labels_build(phy) == PHY_OK)
+        return labels_find(phy, label);
+
+    // fall back on a scan if the table could not be built
+    phy_cursor_prepare_v2(phy, phy->root, &cursor, ALL_NODES, POSTORDER);
+    while ((node = phy_cursor_step(&cursor)) != 0)
+    {
+        if (node->lab)
+        {
+            if (strcmp(label, node->lab) == 0)
+                break;
+        }
+    }
+
+    return node;
+}
+
+
+int phy_node_find_many(
+    struct phy *phy,
+    int n,
+    const char **labels,
+    int *index
+){
+    int i;
+    struct phy_node *node;
+
+    if (refresh(phy) || labels_build(phy))
+        return PHY_ERR;
+
+    for (i = 0; i < n; ++i)
+    {
+        node = labels[i] ? labels_find(phy, labels[i]) : NULL;
+        index[i] = node ? node->index : -1;
+    }
+
+    return PHY_OK;
+}
+
+
+void phy_node_set_data(
+    struct phy_node *node,
+    void *data,
+    void (*data_free)(void *)
+){
+    if (node->data && node->data_free)
+        node->data_free(node->data);
+    node->data = data;
+    node->data_free = data_free;
+}
+
+
+void phy_node_set_index(struct phy_node *node, int index)
+{
+    invalidate(node->phy);
+    node->index = index;
+}
+
+
+void phy_node_set_brlen(struct phy_node *node, double brlen)
+{
+    invalidate(node->phy);
+    node->brlen = brlen;
+}
+
+
+/* Compute the age and depth of every node in a single preorder pass: the
+** parent of a node is always visited before the node itself. */
+static int ages_fill(struct phy *phy)
+{
+    int i;
+    int n;
+    int *depth;
+    double h;
+    double height;
+    double *age;
+    struct phy_node *p;
+
+    n = phy->nnode;
+
+    age = malloc(n * (sizeof(double) + sizeof(int)));
+    if (!age)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    depth = (int *)(age + n);
+    height = 0;
+
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        if (p->anc)
+        {
+            age[p->index] = age[p->anc->index] + p->brlen;
+            depth[p->index] = depth[p->anc->index] + 1;
+        }
+        else
+        {
+            age[p->index] = p->brlen;
+            depth[p->index] = 0;
+        }
+        if (!p->ndesc)
+        {
+            h = age[p->index] - age[phy->root->index];
+            if (h > height)
+                height = h;
+        }
+    }
+
+    phy->depth = depth;
+    phy->height = height;
+    STORE(phy->age, age);
+    return PHY_OK;
+}
+
+
+static int ages_build(struct phy *phy)
+{
+    int ret = PHY_OK;
+
+    if (LOAD(phy->age))
+        return PHY_OK;
+
+    if (refresh(phy))
+        return PHY_ERR;
+
+#ifdef _OPENMP
+    #pragma omp critical(phy_cache)
+#endif
+    {
+        if (!phy->age)
+            ret = ages_fill(phy);
+    }
+    return ret;
+}
+
+
+const double *phy_ages(struct phy *phy)
+{
+    return ages_build(phy) ? NULL : phy->age;
+}
+
+
+const int *phy_depths(struct phy *phy)
+{
+    return ages_build(phy) ? NULL : phy->depth;
+}
+
+
+double phy_height(struct phy *phy)
+{
+    return ages_build(phy) ? -1 : phy->height;
+}
+
+
+/* Compute the height of every node in one reverse preorder pass, then
+** counting sort the node indices on height. Taking the indices in
+** increasing order keeps each level sorted. */
+static int levels_fill(struct phy *phy)
+{
+    int i;
+    int h;
+    int n;
+    int nlevel;
+    int *height;
+    int *level;
+    int *offset;
+    struct phy_node *p;
+
+    n = phy->nnode;
+
+    height = calloc(n, sizeof(int));
+    if (!height)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+
+    for (i = n - 1; i > 0; --i)
+    {
+        p = phy->nodes[i];
+        h = height[p->index] + 1;
+        if (h > height[p->anc->index])
+            height[p->anc->index] = h;
+    }
+    nlevel = height[phy->root->index] + 1;
+
+    level = malloc((n + nlevel + 1) * sizeof(int));
+    if (!level)
+    {
+        free(height);
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    offset = level + n;
+
+    memset(offset, 0, (nlevel + 1) * sizeof(int));
+    for (i = 0; i < n; ++i)
+        offset[height[i] + 1]++;
+    for (h = 0; h < nlevel; ++h)
+        offset[h + 1] += offset[h];
+    for (i = 0; i < n; ++i)
+        level[offset[height[i]]++] = i;
+    // each offset now marks the end of its level; shift them back
+    for (h = nlevel; h > 0; --h)
+        offset[h] = offset[h - 1];
+    offset[0] = 0;
+
+    free(height);
+    phy->nlevel = nlevel;
+    STORE(phy->level, level);
+    return PHY_OK;
+}
+
+
+int phy_levels(struct phy *phy, const int **offset, const int **node)
+{
+    int ret = PHY_OK;
+
+    if (!LOAD(phy->level))
+    {
+        if (refresh(phy))
+            return -1;
+#ifdef _OPENMP
+        #pragma omp critical(phy_cache)
+#endif
+        {
+            if (!phy->level)
+                ret = levels_fill(phy);
+        }
+        if (ret)
+            return -1;
+    }
+
+    if (offset)
+        *offset = phy->level + phy->nnode;
+    if (node)
+        *node = phy->level;
+    return phy->nlevel;
+}
+
+
+/* Kinds of tip-by-tip matrix filled by tip_rows */
+#define TIP_PATRISTIC 0
+#define TIP_VCV 1
+
+
+/* Because tips are numbered in preorder, the tips of the clade below a
+** node v have the consecutive indices lo[v] ... hi[v], where hi[v] is the
+** index of v's last visited tip. The row for tip t is filled by walking
+** from t to the root: on reaching an ancestor v from its child c, the tips
+** of v outside c, two runs of columns on either side of those of c, have
+** v as their common ancestor with t, and so are at distance
+** age[t] + age[j] - 2 * age[v] from t and share a path of length
+** age[v] - age[root] with it. Every entry of a row is thus written once,
+** in contiguous runs, in time proportional to ntip plus the depth of t.
+** Rows are independent and are shared out between threads in blocks. */
+static int tip_rows(
+    struct phy *phy, int kind, int first, int nrow, double *d, int nthreads)
+{
+    int i;
+    int j;
+    int r;
+    int n;
+    int *lo;
+    double a;
+    double *row;
+    const double *age;
+    struct phy_node *p;
+    struct phy_node *c;
+    struct phy_node *v;
+
+    if (nthreads < 1)
+        nthreads = 1;
+    if (ages_build(phy))
+        return PHY_ERR;
+    if (first < 0 || nrow < 0 || nrow > phy->ntip - first)
+    {
+        phy_errno = 10;
+        return PHY_ERR;
+    }
+
+    n = phy->ntip;
+    age = phy->age;
+
+    lo = malloc(phy->nnode * sizeof(int));
+    if (!lo)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    for (i = phy->nnode - 1; i >= 0; --i)
+    {
+        p = phy->nodes[i];
+        lo[p->index] = p->ndesc ? lo[p->lfdesc->index] : p->index;
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(static) num_threads(nthreads) \
+        private(j, a, row, c, v)
+#endif
+    for (r = 0; r < nrow; ++r)
+    {
+        row = d + (size_t)r * n;
+        c = phy->nodes[phy->vseq[first + r]];
+        if (kind == TIP_PATRISTIC)
+            row[c->index] = 0;
+        else
+            row[c->index] = age[c->index] - age[phy->root->index];
+        for (v = c->anc; v; c = v, v = v->anc)
+        {
+            if (kind == TIP_PATRISTIC)
+            {
+                a = age[first + r] - 2 * age[v->index];
+                for (j = lo[v->index]; j < lo[c->index]; ++j)
+                    row[j] = a + age[j];
+                for (j = (c->ndesc ? c->lastvisit->index : c->index) + 1;
+                    j <= v->lastvisit->index; ++j)
+                    row[j] = a + age[j];
+            }
+            else
+            {
+                a = age[v->index] - age[phy->root->index];
+                for (j = lo[v->index]; j < lo[c->index]; ++j)
+                    row[j] = a;
+                for (j = (c->ndesc ? c->lastvisit->index : c->index) + 1;
+                    j <= v->lastvisit->index; ++j)
+                    row[j] = a;
+            }
+        }
+    }
+
+    free(lo);
+    return PHY_OK;
+}
+
+
+/* Rows are computed a block at a time into a buffer of about TIP_BUFSZ
+** bytes and appended to the file as they are completed */
+#define TIP_BUFSZ (1 << 26)
+
+
+static int tip_rows_write(
+    struct phy *phy, int kind, const char *filename, int nthreads)
+{
+    int r;
+    int n;
+    int nrow;
+    int rc = PHY_OK;
+    double *buf;
+    FILE *out;
+
+    if (refresh(phy))
+        return PHY_ERR;
+
+    n = phy->ntip;
+    nrow = TIP_BUFSZ / ((int)sizeof(double) * n);
+    if (nrow < 1)
+        nrow = 1;
+    if (nrow > n)
+        nrow = n;
+
+    buf = malloc((size_t)nrow * n * sizeof(double));
+    if (!buf)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    out = fopen(filename, "wb");
+    if (!out)
+    {
+        phy_errno = 5;
+        free(buf);
+        return PHY_ERR;
+    }
+
+    for (r = 0; r < n && rc == PHY_OK; r += nrow)
+    {
+        if (nrow > n - r)
+            nrow = n - r;
+        if (tip_rows(phy, kind, r, nrow, buf, nthreads))
+            rc = PHY_ERR;
+        else if (fwrite(buf, sizeof(double), (size_t)nrow * n, out)
+            != (size_t)nrow * n)
+        {
+            phy_errno = 5;
+            rc = PHY_ERR;
+        }
+    }
+
+    if (fclose(out) && rc == PHY_OK)
+    {
+        phy_errno = 5;
+        rc = PHY_ERR;
+    }
+    free(buf);
+    return rc;
+}
+
+
+int phy_patristic(
+    struct phy *phy, int first, int nrow, double *d, int nthreads)
+{
+    return tip_rows(phy, TIP_PATRISTIC, first, nrow, d, nthreads);
+}
+
+
+int phy_patristic_write(struct phy *phy, const char *filename, int nthreads)
+{
+    return tip_rows_write(phy, TIP_PATRISTIC, filename, nthreads);
+}
+
+
+int phy_vcv(struct phy *phy, int first, int nrow, double *d, int nthreads)
+{
+    return tip_rows(phy, TIP_VCV, first, nrow, d, nthreads);
+}
+
+
+int phy_vcv_write(struct phy *phy, const char *filename, int nthreads)
+{
+    return tip_rows_write(phy, TIP_VCV, filename, nthreads);
+}
+
+
+/* Each branch, from parent p to child c with length t, contributes
+** (x_c - x_p)^2 / t to the exponent of the joint density, i.e. 1/t to the
+** diagonal entries of c and p and -1/t to the two entries linking them. */
+int phy_precision(struct phy *phy, int *i, int *j, double *x)
+{
+    int k;
+    int m;
+    double w;
+    struct phy_node *p;
+
+    if (refresh(phy))
+        return PHY_ERR;
+
+    for (k = 0; k < phy->nnode; ++k)
+    {
+        i[k] = j[k] = k;
+        x[k] = 0;
+    }
+
+    m = phy->nnode;
+    for (k = 1; k < phy->nnode; ++k)
+    {
+        p = phy->nodes[k];
+        if (p->brlen <= 0)
+        {
+            phy_errno = 9;
+            return PHY_ERR;
+        }
+        w = 1 / p->brlen;
+        x[p->index] += w;
+        x[p->anc->index] += w;
+        i[m] = p->index;
+        j[m] = p->anc->index;
+        x[m++] = -w;
+        i[m] = p->anc->index;
+        j[m] = p->index;
+        x[m++] = -w;
+    }
+    return PHY_OK;
+}
+
+
+void phy_node_set_label(struct phy_node *node, const char *label)
+{
+    if (node->phy)
+    {
+        free(node->phy->labels);
+        node->phy->labels = 0;
+    }
+    if (!(node->flags & NODE_LAB_POOL))
+        free(node->lab);
+    node->flags &= ~NODE_LAB_POOL;
+    node->lab = calloc(strlen(label)+1, sizeof(char));
+    strncpy(node->lab, label, strlen(label));
+}
+
+
+void *phy_node_data(struct phy_node *node)
+{
+    return node->data;
+}
+
+
+void phy_node_spanning_pair(
+    struct phy_node *node,
+    const char **a,
+    const char **b
+){
+    if (!node->ndesc)
+    {
+        *a = node->lab;
+        *b = node->lab;
+    }
+    else
+    {
+        *b = node->lastvisit->lab;
+        node = node->lfdesc;
+        while (node->lfdesc)
+            node = node->lfdesc;
+        *a = node->lab;
+    }
+}
+
+
+void phy_node_spanning_index(
+    struct phy_node *node,
+    int *a,
+    int *b
+){
+    if (!node->ndesc)
+    {
+        *a = node->index;
+        *b = node->index;
+    }
+    else
+    {
+        *a = node->firsttip;
+        *b = node->lastvisit->index;
+    }
+}
+
+
+int phy_node_clade(
+    struct phy *phy,
+    struct phy_node *node,
+    int *first,
+    int *last,
+    int *nnode
+){
+    if (refresh(phy))
+        return PHY_ERR;
+    *first = node->firsttip;
+    if (!node->ndesc)
+    {
+        *last = node->index;
+        *nnode = 1;
+    }
+    else
+    {
+        *last = node->lastvisit->index;
+        *nnode = phy->vseq[*last] - phy->vseq[node->index] + 1;
+    }
+    return PHY_OK;
+}
+
+
+int phy_node_isdesc(
+    struct phy *phy,
+    struct phy_node *node,
+    struct phy_node *anc
+){
+    if (refresh(phy))
+        return 0;
+    if (!anc->ndesc)
+        return node == anc;
+    if (!node->ndesc)
+        return anc->firsttip <= node->index
+            && node->index <= anc->lastvisit->index;
+    // the internal nodes of a clade are numbered in preorder from its root
+    return anc->index <= node->index && node->index <= anc->index
+        + (phy->vseq[anc->lastvisit->index] - phy->vseq[anc->index])
+        - (anc->lastvisit->index - anc->firsttip) - 1;
 }
 
 
-int phy_isbinary(struct phy *phy)
-{
-    return (phy->nnode ==  2*phy->ntip - 1) ? 1 : 0;
+struct phy_node *phy_node_mrca(
+    struct phy *phy,
+    struct phy_node *a,
+    struct phy_node *b
+){
+    if (refresh(phy))
+        return NULL;
+
+    // the clade of a spans a contiguous block of the preorder sequence,
+    // so the first ancestor of a whose block contains b is the mrca
+    int pos = phy->vseq[b->index];
+    while (a && !(phy->vseq[a->index] <= pos && pos <= phy->vseq[
+        (a->lastvisit ? a->lastvisit : a)->index]))
+        a = a->anc;
+    return a;
 }
 
 
-int phy_cursor_alloc(struct phy_cursor **cursor)
-{
-    *cursor = (struct phy_cursor *) malloc(sizeof(struct phy_cursor));
+/* An LCA index answers mrca queries in constant time. If u and v occupy
+** preorder positions i < j then their mrca is the parent of the node of
+** least depth among positions i+1 ... j, which a sparse table over the
+** node depths finds with two lookups. */
+struct phy_lca {
+    struct phy *phy;
 
-    if (*cursor)
-        return PHY_OK;
+    /* Number of levels in the sparse table */
+    int nlevel;
 
-    phy_errno = 1;
-    return PHY_ERR;
-}
+    /* Depth of the node at each preorder position */
+    int *depth;
 
+    /* Floor of the base 2 logarithm of 1 ... nnode */
+    int *lg;
 
-void phy_cursor_free(struct phy_cursor *cursor)
-{
-    free(cursor);
-}
+    /* Level k holds, for each position i, the position of the node of
+    ** least depth among positions i ... i + 2^k - 1 */
+    int *table;
+};
 
 
-void phy_free(struct phy *phy)
+struct phy_lca *phy_lca_new(struct phy *phy)
 {
-    if (phy)
+    int i;
+    int k;
+    int h;
+    int a;
+    int b;
+    int n;
+    int *lo;
+    int *hi;
+    struct phy_lca *lca;
+
+    if (refresh(phy))
+        return NULL;
+
+    n = phy->nnode;
+    lca = malloc(sizeof(struct phy_lca));
+    if (!lca)
     {
-        int i;
-        for (i = 0; i < phy->nnode; ++i)
-            node_free(phy->nodes[i]);
-        free(phy->nodes);
-        free(phy->inodes);
-        free(phy->vseq);
-        free(phy);
+        phy_errno = 1;
+        return NULL;
+    }
+    for (lca->nlevel = 1; (1 << lca->nlevel) <= n; ++lca->nlevel);
+    lca->phy = phy;
+    lca->depth = malloc(n * sizeof(int));
+    lca->lg = malloc((n + 1) * sizeof(int));
+    lca->table = malloc((size_t)n * lca->nlevel * sizeof(int));
+    if (!lca->depth || !lca->lg || !lca->table)
+    {
+        phy_lca_free(lca);
+        phy_errno = 1;
+        return NULL;
+    }
+
+    lca->depth[0] = 0;
+    for (i = 1; i < n; ++i)
+        lca->depth[i] = 1 + lca->depth[phy->vseq[phy->nodes[i]->anc->index]];
+
+    lca->lg[0] = lca->lg[1] = 0;
+    for (i = 2; i <= n; ++i)
+        lca->lg[i] = lca->lg[i/2] + 1;
+
+    for (i = 0; i < n; ++i)
+        lca->table[i] = i;
+    for (k = 1; k < lca->nlevel; ++k)
+    {
+        h = 1 << (k - 1);
+        lo = lca->table + (size_t)(k - 1) * n;
+        hi = lca->table + (size_t)k * n;
+        for (i = 0; i + 2*h <= n; ++i)
+        {
+            a = lo[i];
+            b = lo[i + h];
+            hi[i] = lca->depth[a] <= lca->depth[b] ? a : b;
+        }
     }
+    return lca;
 }
 
 
-struct phy *phy_read_newickstr(const char *newick)
+struct phy_node *phy_lca_query(
+    struct phy_lca *lca, struct phy_node *a, struct phy_node *b)
 {
-    struct phy_node *root = 0;
-    struct phy *phy = 0;
-    struct newick_reader ctx = {0, 0, 0, 0, 0, 0, newick, 0, 0, 0};
-    root = read_newick(&ctx);
-    if (root)
+    int i;
+    int j;
+    int k;
+    int u;
+    int v;
+    int *level;
+    struct phy *phy = lca->phy;
+
+    if (a == b)
+        return a;
+    i = phy->vseq[a->index];
+    j = phy->vseq[b->index];
+    if (i > j)
     {
-        phy = phy_build(root, ctx.nnode, ctx.ntip);
-        if (!phy)
-            cleanup(ctx.root);
+        k = i;
+        i = j;
+        j = k;
     }
-    else
-        cleanup(ctx.root);
-    free(ctx.z);
-    return phy;
+    ++i;
+    k = lca->lg[j - i + 1];
+    level = lca->table + (size_t)k * phy->nnode;
+    u = level[i];
+    v = level[j - (1 << k) + 1];
+    return phy->nodes[lca->depth[u] <= lca->depth[v] ? u : v]->anc;
 }
 
 
-struct phy *phy_read_newickfile(const char *filename)
+void phy_lca_query_v(
+    struct phy_lca *lca, int n, const int *a, const int *b, int *mrca)
 {
-    struct phy *phy = 0;
-    char *newick = 0;
-    int nBytes = 0;
-    FILE *in = fopen(filename, "r");
-    if (in) {
-        fseek(in, 0, SEEK_END);
-        nBytes = ftell(in);
-        rewind(in);
-        if (nBytes)
-            newick = malloc(nBytes);
-        if (newick)
-        {
-            fread(newick, nBytes, 1, in);
-            phy = phy_read_newickstr(newick);
-            free(newick);
-        }
-        fclose(in);
+    int i;
+    struct phy *phy = lca->phy;
+    for (i = 0; i < n; ++i)
+    {
+        mrca[i] = phy_lca_query(lca,
+            phy->nodes[phy->vseq[a[i]]], phy->nodes[phy->vseq[b[i]]])->index;
     }
-    return phy;
 }
 
 
-char *phy_write_newickstr(struct phy *phy)
+void phy_lca_free(struct phy_lca *lca)
 {
-    struct newick_writer ctx = {0, 0, 0};
-    write_newick(phy->root, &ctx);
-    write_chars(";", &ctx);
-    return ctx.newick;
+    if (lca)
+    {
+        free(lca->depth);
+        free(lca->lg);
+        free(lca->table);
+        free(lca);
+    }
 }
 
 
-int phy_write_newickfile(
-    struct phy *phy, const char *filename, const char *mode)
+/* A split table accumulates the splits (bipartitions of the tips) found in
+** any number of phylogenies over the same tip labels. The tip labels of
+** the first phylogeny added fix the bit position of each label, and a
+** split is stored as a bitset of nword 64-bit words over those positions:
+** for rooted phylogenies the tips below an edge, and for unrooted ones
+** the side of an edge that excludes the tip in bit position 0. Only
+** nontrivial splits, those not separating a single tip (or, if rooted,
+** no tip at all) from the rest, are stored. */
+struct phy_splits {
+    int rooted;
+
+    /* Number of tips and of words per split */
+    int ntip;
+    int nword;
+
+    /* Tip label at each bit position, held in the same allocation, and
+    ** an open-addressing table of bit positions (-1 if empty) keyed on
+    ** label with lmask + 1 slots */
+    char **label;
+    int *slot;
+    size_t lmask;
+
+    /* Sum over the trees of the branch length of the tip at each bit
+    ** position */
+    double *tiplen;
+
+    /* Split i occupies words i*nword ... (i+1)*nword-1 of bits. It was
+    ** found in count[i] trees, most recently the tree numbered last[i],
+    ** on branches whose lengths sum to brlen[i]. */
+    int nsplit;
+    int nalloc;
+    uint64_t *bits;
+    int *count;
+    int *last;
+    double *brlen;
+
+    /* Open-addressing table of split numbers (-1 if empty) keyed on the
+    ** bits of a split with mask + 1 slots */
+    int *table;
+    size_t mask;
+
+    /* The splits of tree t are split numbers id[start[t]] ...
+    ** id[start[t+1]-1] in increasing order */
+    int ntree;
+    int tree_alloc;
+    size_t *start;
+    int *id;
+    size_t id_alloc;
+};
+
+
+static uint64_t split_hash(const uint64_t *w, int n)
 {
-    char *newick = phy_write_newickstr(phy);
-    if (!newick)
-        return PHY_ERR;
-    FILE *out = fopen(filename, mode);
-    if (out) {
-        fputs(newick, out);
-        free(newick);
-        fclose(out);
-        return PHY_OK;
+    int i;
+    uint64_t h = 14695981039346656037ULL;
+    for (i = 0; i < n; ++i)
+    {
+        h = (h ^ w[i]) * 0x9e3779b97f4a7c15ULL;
+        h ^= h >> 29;
     }
-    return PHY_ERR;
+    return h;
 }
 
 
-struct phy *phy_extract_clade(struct phy_node *node)
+static int popcount64(uint64_t x)
 {
-    struct newick_writer ctx = {0, 0, 0};
-    struct phy *phy = 0;
-    if (write_newick(node, &ctx))
-        return NULL;
-    if (write_chars(";", &ctx))
-        return NULL;
-    phy = phy_read_newickstr(ctx.newick);
-    free(ctx.newick);
-    if (!phy)
-        return NULL;
-    phy->root->brlen = 0;
-    return phy;
+#ifdef __GNUC__
+    return __builtin_popcountll(x);
+#else
+    int n = 0;
+    for (; x; x &= x - 1)
+        n++;
+    return n;
+#endif
 }
 
 
-struct phy *phy_extract_subtree(
-    int ntip,
-    struct phy_node **tips,
-    struct phy *phy
-){
+// Number of bits set in a split
+static int split_size(const uint64_t *w, int n)
+{
     int i;
-    int nnode = 0;
-    int bitmask[phy->nnode];
-    struct phy_node *p;
-    struct phy_node *q;
-    struct phy_node *root;
-    struct phy_node *head;
-
-    memset(bitmask, 0, phy->nnode * sizeof(int));
-    for (i = 0; i < ntip; ++i)
-    {
-        p = tips[i];
-        bitmask[p->index] = 1;
-        while ((p = p->anc) != 0)
-        {
-            if (bitmask[p->index])
-                break;
-            bitmask[p->index] = 1;
-        }
-    }
-
-    root = 0;
-    head = 0;
+    int k = 0;
+    for (i = 0; i < n; ++i)
+        k += popcount64(w[i]);
+    return k;
+}
 
-    p = phy->root;
-    while (p)
-    {
-        if (bitmask[p->index] && !root)
-        {
-            nnode++;
-            root = node_new();
-            if (!root)
-            {
-                phy_errno = 1;
-                return NULL;
-            }
-            head = root;
-        }
-        else if (bitmask[p->index])
-        {
-            nnode++;
-            q = node_new();
-            if (!q)
-            {
-                phy_errno = 1;
-                cleanup(root);
-                return NULL;
-            }
-            q->brlen = p->brlen;
-            if (p->lab)
-            {
-                q->lab = malloc(strlen(p->lab)+1);
-                if (!q->lab)
-                {
-                    phy_errno = 1;
-                    cleanup(root);
-                    return NULL;
-                }
-                strcpy(q->lab, p->lab);
-            }
-            phy_node_add_child(head, q);
-            head = q;
-        }
-        if (p->lfdesc)
-            p = p->lfdesc;
-        else if (p->next)
-        {
-            if (bitmask[p->index])
-                head = head->anc;
-            p = p->next;
-        }
-        else
-        {
-            while (p->anc != 0 && p->next == 0)
-            {
-                if (bitmask[p->index])
-                    head = head->anc;
-                p = p->anc;
-            }
-            if (bitmask[p->index])
-                head = head->anc;
-            p = p->next;
-        }
-    }
 
-    root->brlen = 0;
-    p = root;
-    while (p)
+// Bit position of a tip label, or -1 if it is not in the table
+static int split_bit(struct phy_splits *splits, const char *label)
+{
+    size_t h;
+    int b;
+    for (h = hash(label) & splits->lmask; (b = splits->slot[h]) >= 0;
+        h = (h + 1) & splits->lmask)
     {
-        while (p->ndesc == 1)
-        {
-            q = p->lfdesc;
-            q->brlen += p->brlen;
-            q->next = p->next;
-            q->prev = p->prev;
-            q->anc = p->anc;
-            if (p->prev)
-                p->prev->next = q;
-            if (p->next)
-                p->next->prev = q;
-            if (p->anc && p->anc->lfdesc == p)
-                p->anc->lfdesc = q;
-            if (p == root) {
-                root = q;
-                root->brlen = 0;
-            }
-            node_free(p);
-            p = q;
-            nnode--;
-        }
-        if (p->lfdesc)
-            p = p->lfdesc;
-        else if (p->next)
-            p = p->next;
-        else {
-            while (p->anc != 0 && p->next == 0)
-                p = p->anc;
-            p = p->next;
-        }
+        if (strcmp(label, splits->label[b]) == 0)
+            return b;
     }
-
-    return phy_build(root, nnode, ntip);
+    return -1;
 }
 
 
-void phy_node_rotate(int n, struct phy_node **nodes, struct phy *phy)
+// Take the tip labels of phy as the bit positions of the table
+static int split_labels(struct phy_splits *splits, struct phy *phy)
 {
     int i;
-    int j;
-    int k;
-    struct phy_node *d = 0;
+    size_t h;
+    size_t size = 16;
+    size_t nbyte = 0;
+    char *z;
     struct phy_node *p;
-    struct phy_node *q;
-    struct phy_node *node;
 
-    for (i = 0; i < n; ++i)
+    for (i = 0; i < phy->ntip; ++i)
     {
-        node = nodes[i];
-
-        q = node->lfdesc;
-        p = q->next;
-
-        while (q)
-        {
-            phy_node_prune(node, q);
-            if (d)
-            {
-                q->prev = d;
-                d = q;
-            }
-            else
-                d = q;
-            q = p;
-            if (q)
-                p = q->next;
-        }
-
-        while (d)
+        p = phy->nodes[phy->vseq[i]];
+        if (!p->lab)
         {
-            q = d;
-            d = q->prev;
-            phy_node_add_child(node, q);
+            phy_errno = 8;
+            return PHY_ERR;
         }
-
+        nbyte += strlen(p->lab) + 1;
     }
+    while (size < 2 * (size_t)phy->ntip)
+        size *= 2;
 
-    i = 0;
-    j = 0;
-    k = 0;
+    splits->label = malloc(phy->ntip * sizeof(char *) + nbyte);
+    splits->slot = malloc(size * sizeof(int));
+    splits->tiplen = calloc(phy->ntip, sizeof(double));
+    if (!splits->label || !splits->slot || !splits->tiplen)
+    {
+        free(splits->label);
+        free(splits->slot);
+        free(splits->tiplen);
+        splits->label = 0;
+        splits->slot = 0;
+        splits->tiplen = 0;
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+    memset(splits->slot, -1, size * sizeof(int));
+    splits->lmask = size - 1;
+    splits->ntip = phy->ntip;
+    splits->nword = (phy->ntip + 63) / 64;
 
-    p = phy->root;
-    while (p)
+    z = (char *)(splits->label + phy->ntip);
+    for (i = 0; i < phy->ntip; ++i)
     {
-        phy->nodes[i] = p;
-        if (p->ndesc)
+        p = phy->nodes[phy->vseq[i]];
+        splits->label[i] = strcpy(z, p->lab);
+        z += strlen(p->lab) + 1;
+        for (h = hash(p->lab) & splits->lmask; splits->slot[h] >= 0;
+            h = (h + 1) & splits->lmask)
         {
-            p->index = phy->ntip + j;
-            phy->inodes[j++] = p;
-        }
-        else
-            p->index = k++;
-        phy->vseq[p->index] = i++;
-
-        if (p->lfdesc)
-            p = p->lfdesc;
-        else if (p->next)
-            p = p->next;
-        else {
-            q = p;
-            while (p->anc != 0 && p->next == 0) {
-                p = p->anc;
-                p->lastvisit = q;
+            if (strcmp(p->lab, splits->label[splits->slot[h]]) == 0)
+            {
+                // a repeated label cannot identify a tip
+                free(splits->label);
+                free(splits->slot);
+                free(splits->tiplen);
+                splits->label = 0;
+                splits->slot = 0;
+                splits->tiplen = 0;
+                phy_errno = 8;
+                return PHY_ERR;
             }
-            p = p->next;
         }
+        splits->slot[h] = i;
     }
+    return PHY_OK;
 }
 
 
-struct phy *phy_duplicate(struct phy *phy)
+// Make room for n more splits and a new tree, so that adding the tree
+// cannot fail part of the way through
+static int split_reserve(struct phy_splits *splits, int n)
 {
-    char *newick = phy_write_newickstr(phy);
-    struct phy *phy_cpy = phy_read_newickstr(newick);
-    free(newick);
-    return phy_cpy;
-}
-
+    int i;
+    int m;
+    size_t h;
+    size_t size;
+    void *tmp;
 
-void phy_reroot(
-    struct phy_node *node,
-    struct phy **in,
-    struct phy **out
-){
-    int overwrite = *in == *out ? 1 : 0;
-    int isrooted = phy_isrooted(*in);
-    double b;
+    if (splits->nsplit + n > splits->nalloc)
+    {
+        m = splits->nalloc ? splits->nalloc : 64;
+        while (m < splits->nsplit + n)
+            m *= 2;
+        if (!(tmp = realloc(splits->bits,
+            (size_t)m * splits->nword * sizeof(uint64_t))))
+            goto error;
+        splits->bits = tmp;
+        if (!(tmp = realloc(splits->count, m * sizeof(int))))
+            goto error;
+        splits->count = tmp;
+        if (!(tmp = realloc(splits->last, m * sizeof(int))))
+            goto error;
+        splits->last = tmp;
+        if (!(tmp = realloc(splits->brlen, m * sizeof(double))))
+            goto error;
+        splits->brlen = tmp;
+        splits->nalloc = m;
+    }
 
-    const char *lf_tip;
-    const char *rt_tip;
+    if (splits->ntree + 2 > splits->tree_alloc)
+    {
+        m = splits->tree_alloc ? 2 * splits->tree_alloc : 64;
+        if (!(tmp = realloc(splits->start, m * sizeof(size_t))))
+            goto error;
+        if (!splits->start)
+            ((size_t *)tmp)[0] = 0;
+        splits->start = tmp;
+        splits->tree_alloc = m;
+    }
 
-    struct phy *phy;
-    struct phy_node *d;
-    struct phy_node *p;
-    struct phy_node *q = 0;
-    struct phy_node *root_on;
-    struct phy_node *root;
+    if (splits->start[splits->ntree] + n > splits->id_alloc)
+    {
+        size = splits->id_alloc ? splits->id_alloc : 1024;
+        while (size < splits->start[splits->ntree] + n)
+            size *= 2;
+        if (!(tmp = realloc(splits->id, size * sizeof(int))))
+            goto error;
+        splits->id = tmp;
+        splits->id_alloc = size;
+    }
 
+    // keep the load factor of the split table at or below one half
+    size = splits->table ? splits->mask + 1 : 64;
+    while (size < 2 * (size_t)(splits->nsplit + n))
+        size *= 2;
+    if (!splits->table || size > splits->mask + 1)
+    {
+        if (!(tmp = malloc(size * sizeof(int))))
+            goto error;
+        free(splits->table);
+        splits->table = tmp;
+        splits->mask = size - 1;
+        memset(splits->table, -1, size * sizeof(int));
+        for (i = 0; i < splits->nsplit; ++i)
+        {
+            for (h = split_hash(splits->bits + (size_t)i * splits->nword,
+                splits->nword) & splits->mask; splits->table[h] >= 0;
+                h = (h + 1) & splits->mask);
+            splits->table[h] = i;
+        }
+    }
+    return PHY_OK;
 
-    phy_node_spanning_pair(node, &lf_tip, &rt_tip);
+error:
+    phy_errno = 1;
+    return PHY_ERR;
+}
 
-    phy = phy_duplicate(*in);
 
-    root_on = phy_node_mrca(
-        phy, phy_node_find(phy, lf_tip), phy_node_find(phy, rt_tip));
-
-    b = root_on->brlen / 2;
-    p = root_on->anc;
-    phy_node_prune(p, root_on);
-    root = node_new();
-    phy_node_add_child(root, root_on);
-    root_on->brlen = b;
-
-    // build up a list like so,
-    //   * <- 1 <- 2 <- 3 <- current_root
-    // where * equals root_on->anc and numbers
-    // refer to nodes on the path back to the
-    // current root. when re-rooting we need
-    // to reverse the direction of each edge on
-    // this path.
-    while (p->anc)
-    {
-        d = p->anc;
-        // removes p from d's descendants and sets p->prev, p->next
-        // and p->anc to NULL
-        p = phy_node_prune(d, p);
-        if (!q)
-            q = p;
-        else
-        {
-            p->prev = q;
-            q = p;
-        }
+// Record a split of the tree being added, found on a branch of length
+// brlen. Room must have been made for it.
+static void split_insert(
+    struct phy_splits *splits, const uint64_t *w, double brlen)
+{
+    int i;
+    size_t h;
+    int n = splits->nword;
 
-        p = d;
+    for (h = split_hash(w, n) & splits->mask; (i = splits->table[h]) >= 0;
+        h = (h + 1) & splits->mask)
+    {
+        if (memcmp(w, splits->bits + (size_t)i * n, n * sizeof(uint64_t)) == 0)
+            break;
     }
-    // p is now the current root
-    p->prev = q;
-    q = p;
 
-    if (isrooted && q->prev)
+    if (i < 0)
     {
-        // if the tree is currently rooted we want to
-        // jump around the current root
-        d = q;
-        p = q->prev;
-        for (d = d->lfdesc; d == p; d = d->next) {}
-        phy_node_add_child(p, d);
-        d->brlen += p->brlen;
-        q = p;
+        i = splits->nsplit++;
+        memcpy(splits->bits + (size_t)i * n, w, n * sizeof(uint64_t));
+        splits->count[i] = 0;
+        splits->last[i] = -1;
+        splits->brlen[i] = 0;
+        splits->table[h] = i;
     }
-    else if (isrooted)
+
+    // both branches below the root of a rooted tree give the same
+    // unrooted split, which is counted once over their combined length
+    if (splits->last[i] != splits->ntree)
     {
-        // rooting on a node whose parent is the current
-        // root, but we still need to jump around the
-        // current root. this bit prepares for the
-        // statement following the while loop below
-        // (which will not be entered if this branch is
-        // taken)
-        d = q;
-        p = root_on;
-        for (d = d->lfdesc; d == p; d = d->next) {}
-        q = d;
-        q->prev = NULL;
-        b += d->brlen;
+        splits->count[i]++;
+        splits->last[i] = splits->ntree;
+        splits->id[splits->start[splits->ntree+1]++] = i;
     }
+    splits->brlen[i] += brlen;
+}
 
-    // reverse the rest of the edges
-    while (q->prev) {
-        d = q;
-        p = q->prev;
-        phy_node_add_child(p, d);
-        d->brlen = p->brlen;
-        q = p;
+
+struct phy_splits *phy_splits_new(int rooted)
+{
+    struct phy_splits *splits = calloc(1, sizeof(struct phy_splits));
+    if (!splits)
+    {
+        phy_errno = 1;
+        return NULL;
     }
+    splits->rooted = rooted;
+    return splits;
+}
 
-    phy_node_add_child(root, q);
-    q->brlen = b;
 
-    *out = phy_build(root, phy->nnode + (isrooted ? 0 : 1), phy->ntip);
+/* The tip bitsets are built in one reverse preorder pass, in which each
+** internal node's bitset is complete when the node is reached and is then
+** folded into its parent's. */
+int phy_splits_add(struct phy_splits *splits, struct phy *phy)
+{
+    int i;
+    int j;
+    int k;
+    int b;
+    int n;
+    int ninode;
+    int nword;
+    int *map = 0;
+    char *used = 0;
+    uint64_t *row = 0;
+    uint64_t *key;
+    uint64_t *w;
+    uint64_t *u;
+    uint64_t tail;
+    struct phy_node *p;
+
+    if (refresh(phy))
+        return PHY_ERR;
+
+    if (!splits->label && split_labels(splits, phy))
+        return PHY_ERR;
 
-    if (overwrite)
+    if (phy->ntip != splits->ntip)
     {
-        phy_free(*in);
-        *in = *out;
+        phy_errno = 8;
+        return PHY_ERR;
     }
 
-    phy_free(phy);
-}
-
+    n = splits->ntip;
+    nword = splits->nword;
+    ninode = phy->nnode - phy->ntip;
+    tail = n % 64 ? ((uint64_t)1 << (n % 64)) - 1 : ~(uint64_t)0;
 
-void phy_unroot(struct phy **in, struct phy **out)
-{
-    int overwrite = *in == *out ? 1 : 0;
-    int isrooted = phy_isrooted(*in);
+    map = malloc(n * sizeof(int));
+    used = calloc(n, 1);
+    row = calloc((size_t)(ninode + 1) * nword, sizeof(uint64_t));
+    if (!map || !used || !row)
+    {
+        phy_errno = 1;
+        goto error;
+    }
 
-    if (isrooted)
+    for (i = 0; i < n; ++i)
     {
-        *out = 0;
-        return;
+        p = phy->nodes[phy->vseq[i]];
+        b = p->lab ? split_bit(splits, p->lab) : -1;
+        if (b < 0 || used[b])
+        {
+            phy_errno = 8;
+            goto error;
+        }
+        used[b] = 1;
+        map[i] = b;
     }
 
-    struct phy *phy;
-    struct phy_node *p;
-    struct phy_node *q;
+    if (split_reserve(splits, ninode))
+        goto error;
+    splits->start[splits->ntree+1] = splits->start[splits->ntree];
 
-    phy = phy_duplicate(*in);
+    // the last row holds the key of the split being inserted
+    key = row + (size_t)ninode * nword;
+    for (i = phy->nnode - 1; i > 0; --i)
+    {
+        p = phy->nodes[i];
+        u = row + (size_t)(p->anc->index - phy->ntip) * nword;
+        if (!p->ndesc)
+        {
+            b = map[p->index];
+            u[b / 64] |= (uint64_t)1 << (b % 64);
+            splits->tiplen[b] += p->brlen;
+            continue;
+        }
 
-    p = phy_node_prune(phy->root, phy->root->lfdesc);
-    q = phy_node_prune(phy->root, phy->root->lfdesc->next);
+        w = row + (size_t)(p->index - phy->ntip) * nword;
+        for (j = 0; j < nword; ++j)
+        {
+            u[j] |= w[j];
+            key[j] = (!splits->rooted && (w[0] & 1)) ? ~w[j] : w[j];
+        }
+        key[nword-1] &= tail;
 
-    q->brlen += p->brlen;
-    p->brlen = 0;
+        k = split_size(key, nword);
+        if (k >= 2 && k <= n - (splits->rooted ? 1 : 2))
+            split_insert(splits, key, p->brlen);
+        else if (!splits->rooted && (k == 1 || k == n - 1))
+        {
+            // below an unrooted root this branch and the branch to a
+            // tip are one edge
+            for (b = 0; k == 1 && !(key[b / 64] >> (b % 64) & 1); ++b);
+            splits->tiplen[k == 1 ? b : 0] += p->brlen;
+        }
+    }
 
-    phy_node_add_child(p, q);
+    qsort(splits->id + splits->start[splits->ntree],
+        splits->start[splits->ntree+1] - splits->start[splits->ntree],
+        sizeof(int), compare_int);
+    splits->ntree++;
 
-    *out = phy_build(p, phy->nnode - 1, phy->ntip);
+    free(map);
+    free(used);
+    free(row);
+    return PHY_OK;
 
-    if (overwrite)
+error:
+    if (!splits->ntree)
     {
-        phy_free(*in);
-        *in = *out;
+        // the next phylogeny added supplies the labels instead
+        free(splits->label);
+        free(splits->slot);
+        free(splits->tiplen);
+        splits->label = 0;
+        splits->slot = 0;
+        splits->tiplen = 0;
+        splits->ntip = 0;
     }
-
-    phy_free(phy);
+    free(map);
+    free(used);
+    free(row);
+    return PHY_ERR;
 }
 
 
-struct phy_node *phy_node_lfdesc(struct phy_node *node)
+int phy_splits_ntree(struct phy_splits *splits)
 {
-    return node->lfdesc;
+    return splits->ntree;
 }
 
 
-struct phy_node *phy_node_rtdesc(struct phy_node *node)
+int phy_splits_ntip(struct phy_splits *splits)
 {
-    struct phy_node *r;
-    switch (node->ndesc)
-    {
-        case 0:
-            return NULL;
-        case 2:
-            return node->lfdesc->next;
-        case 3:
-            return node->lfdesc->next->next;
-        case 4:
-            return node->lfdesc->next->next->next;
-        case 5:
-            return node->lfdesc->next->next->next->next;
-        default:
-            for (r = node->lfdesc; r->next != 0; r = r->next) {};
-            return r;
-    }
+    return splits->ntip;
 }
 
 
-struct phy_node *phy_node_next(struct phy_node *node)
+int phy_splits_nsplit(struct phy_splits *splits)
 {
-    return node->next;
+    return splits->nsplit;
 }
 
 
-struct phy_node *phy_node_prev(struct phy_node *node)
+int phy_splits_count(struct phy_splits *splits, int i)
 {
-    return node->prev;
+    return splits->count[i];
 }
 
 
-struct phy_node *phy_node_anc(struct phy_node *node)
+int phy_splits_tips(struct phy_splits *splits, int i, int *bit)
 {
-    return node->anc;
+    int b;
+    int k = 0;
+    const uint64_t *w = splits->bits + (size_t)i * splits->nword;
+    for (b = 0; b < splits->ntip; ++b)
+    {
+        if (w[b / 64] >> (b % 64) & 1)
+            bit[k++] = b;
+    }
+    return k;
 }
 
 
-double phy_node_brlen(struct phy_node *node)
+const char *phy_splits_label(struct phy_splits *splits, int bit)
 {
-    return node->brlen;
+    return splits->label[bit];
 }
 
 
-int phy_node_index(struct phy_node *node)
-{
-    return node->index;
-}
+struct split_order {
+    int key;
+    int rank;
+    int id;
+};
 
 
-int phy_node_ndesc(struct phy_node *node)
+// Order by decreasing key, then increasing rank
+static int compare_split(const void *a, const void *b)
 {
-    return node->ndesc;
+    const struct split_order *x = a;
+    const struct split_order *y = b;
+    if (x->key != y->key)
+        return x->key > y->key ? -1 : 1;
+    return (x->rank > y->rank) - (x->rank < y->rank);
 }
 
 
-int phy_node_istip(struct phy_node *node)
+// Test whether two splits are compatible, i.e. disjoint or nested
+static int split_compatible(const uint64_t *a, const uint64_t *b, int n)
 {
-    return node->ndesc ? 0 : 1;
+    int i;
+    int ab = 0;
+    int anb = 0;
+    int bna = 0;
+    for (i = 0; i < n; ++i)
+    {
+        ab |= (a[i] & b[i]) != 0;
+        anb |= (a[i] & ~b[i]) != 0;
+        bna |= (b[i] & ~a[i]) != 0;
+    }
+    return !ab || !anb || !bna;
 }
 
 
-int phy_isrooted(struct phy *phy)
+/* Splits are taken in decreasing order of frequency and kept if they are
+** compatible with those already kept. Splits in more than half of the
+** trees are compatible with each other, so for p >= 0.5 this is the
+** usual majority-rule consensus. As compatible splits nest, each kept
+** split becomes an internal node whose parent is the smallest larger
+** split containing it, found by tracking for each tip the last split
+** assigned to it while the splits are taken in decreasing size. */
+struct phy *phy_splits_consensus(struct phy_splits *splits, double p)
 {
-    return phy->root->ndesc > 2 ? 0 : 1;
+    int i;
+    int j;
+    int b;
+    int n = splits->ntip;
+    int nword = splits->nword;
+    int ncand = 0;
+    int nkeep = 0;
+    int maxkeep;
+    int *owner = 0;
+    struct split_order *cand = 0;
+    struct phy_node *root = 0;
+    struct phy_node **node = 0;
+    struct phy_node *q;
+    struct phy *phy;
+    char buf[32];
+    const uint64_t *w;
+
+    if (!splits->ntree)
+    {
+        phy_errno = 8;
+        return NULL;
+    }
+
+    cand = malloc((splits->nsplit + 1) * sizeof(struct split_order));
+    owner = malloc(n * sizeof(int));
+    node = calloc(splits->nsplit + n + 1, sizeof(struct phy_node *));
+    if (!cand || !owner || !node)
+    {
+        phy_errno = 1;
+        goto error;
+    }
+
+    for (i = 0; i < splits->nsplit; ++i)
+    {
+        if (splits->count[i] > p * splits->ntree)
+        {
+            cand[ncand].key = splits->count[i];
+            cand[ncand].rank = i;
+            cand[ncand++].id = i;
+        }
+    }
+    qsort(cand, ncand, sizeof(struct split_order), compare_split);
+
+    // a fully resolved tree has no room for more splits
+    maxkeep = n - (splits->rooted ? 2 : 3);
+    for (i = 0; i < ncand && nkeep < maxkeep; ++i)
+    {
+        w = splits->bits + (size_t)cand[i].id * nword;
+        for (j = 0; j < nkeep; ++j)
+        {
+            if (!split_compatible(w,
+                splits->bits + (size_t)cand[j].id * nword, nword))
+                break;
+        }
+        if (j == nkeep)
+            cand[nkeep++] = cand[i];
+    }
+
+    for (i = 0; i < nkeep; ++i)
+    {
+        cand[i].rank = i;
+        cand[i].key = split_size(
+            splits->bits + (size_t)cand[i].id * nword, nword);
+    }
+    qsort(cand, nkeep, sizeof(struct split_order), compare_split);
+
+    if (!(root = node_new()))
+        goto error;
+
+    for (b = 0; b < n; ++b)
+        owner[b] = -1;
+
+    for (i = 0; i < nkeep; ++i)
+    {
+        if (!(node[i] = node_new()))
+            goto error;
+        j = cand[i].id;
+        node[i]->brlen = splits->brlen[j] / splits->count[j];
+        snprintf(buf, sizeof(buf), "%g",
+            (double)splits->count[j] / splits->ntree);
+        if (!(node[i]->lab = malloc(strlen(buf) + 1)))
+        {
+            phy_errno = 1;
+            goto error;
+        }
+        strcpy(node[i]->lab, buf);
+
+        w = splits->bits + (size_t)j * nword;
+        for (b = 0; !(w[b / 64] >> (b % 64) & 1); ++b);
+        phy_node_add_child(owner[b] < 0 ? root : node[owner[b]], node[i]);
+        for (; b < n; ++b)
+        {
+            if (w[b / 64] >> (b % 64) & 1)
+                owner[b] = i;
+        }
+    }
+
+    for (b = 0; b < n; ++b)
+    {
+        if (!(q = node_new()))
+            goto error;
+        node[nkeep + b] = q;
+        q->brlen = splits->tiplen[b] / splits->ntree;
+        if (!(q->lab = malloc(strlen(splits->label[b]) + 1)))
+        {
+            phy_errno = 1;
+            goto error;
+        }
+        strcpy(q->lab, splits->label[b]);
+        phy_node_add_child(owner[b] < 0 ? root : node[owner[b]], q);
+    }
+
+    phy = phy_build(root, 1 + nkeep + n, n);
+    if (!phy)
+        goto error;
+
+    free(cand);
+    free(owner);
+    free(node);
+    return phy;
+
+error:
+    if (root)
+    {
+        // nodes not yet attached to the root are free'd on their own
+        for (i = 0; node && i < nkeep + n; ++i)
+        {
+            if (node[i] && !node[i]->anc)
+                node_free(node[i]);
+        }
+        cleanup(root);
+    }
+    free(cand);
+    free(owner);
+    free(node);
+    return NULL;
 }
 
 
-int phy_nnode(struct phy *phy)
+/* The split numbers of each tree are sorted, so the splits two trees
+** share are counted by merging their lists. */
+int phy_splits_rf(struct phy_splits *splits, int nthreads, int *rf)
 {
-    return phy->nnode;
+    int i;
+    int j;
+    int m = splits->ntree;
+    size_t a;
+    size_t b;
+    size_t a1;
+    size_t b1;
+    int shared;
+
+    if (nthreads < 1)
+        nthreads = 1;
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(nthreads) \
+        private(j, a, b, a1, b1, shared)
+#endif
+    for (i = 0; i < m; ++i)
+    {
+        rf[(size_t)i * m + i] = 0;
+        for (j = i + 1; j < m; ++j)
+        {
+            shared = 0;
+            a = splits->start[i];
+            a1 = splits->start[i+1];
+            b = splits->start[j];
+            b1 = splits->start[j+1];
+            while (a < a1 && b < b1)
+            {
+                if (splits->id[a] < splits->id[b])
+                    a++;
+                else if (splits->id[a] > splits->id[b])
+                    b++;
+                else
+                {
+                    shared++;
+                    a++;
+                    b++;
+                }
+            }
+            rf[(size_t)i * m + j] = rf[(size_t)j * m + i] = (int)(
+                (a1 - splits->start[i]) + (b1 - splits->start[j])
+                - 2 * shared);
+        }
+    }
+    return PHY_OK;
 }
 
 
-int phy_ntip(struct phy *phy)
+void phy_splits_free(struct phy_splits *splits)
 {
-    return phy->ntip;
+    if (splits)
+    {
+        free(splits->label);
+        free(splits->slot);
+        free(splits->tiplen);
+        free(splits->bits);
+        free(splits->count);
+        free(splits->last);
+        free(splits->brlen);
+        free(splits->table);
+        free(splits->start);
+        free(splits->id);
+        free(splits);
+    }
 }
 
 
-void phy_node_swap(struct phy_node *a, struct phy_node *b)
-{
-    if (!a->anc || !b->anc || a->anc != b->anc)
-        return;
+void phy_node_foreach(
+    struct phy *phy,
+    struct phy_node *node,
+    int visit,
+    int order,
+    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
+    void *param
+){
+    struct phy_cursor cursor;
+    phy_cursor_prepare_v2(phy, node, &cursor, visit, order);
+    while ((node = phy_cursor_step(&cursor)) != 0)
+        FUN(node, phy, param);
+}
 
-    if (a->next == b) {
-        a->next = b->next;
-        b->next = a;
-        if (a->prev)
-            a->prev->next = b;
-        b->prev = a->prev;
-        a->prev = b;
-    } else if (b->next == a) {
-        b->next = a->next;
-        a->next = b;
-        if (b->prev)
-            b->prev->next = a;
-        a->prev = b->prev;
-        b->prev = a;
-    } else {
-        struct phy_node *prev;
-        struct phy_node *next;
 
-        next = a->next;
-        prev = a->prev;
+/* Smallest clade handed to a thread as a unit of work by
+** phy_node_foreach_parallel */
+#define FOREACH_GRAIN 256
 
-        a->next = b->next;
-        a->prev = b->prev;
-        if (b->next)
-            b->next->prev = a;
-        if (b->prev)
-            b->prev->next = a;
-        b->next = next;
-        b->prev = prev;
-        if (next)
-            next->prev = b;
-        if (prev)
-            prev->next = b;
+
+// Apply FUN to the nodes of the clade occupying preorder positions
+// a ... b in the given order
+static void foreach_block(
+    struct phy *phy,
+    int a,
+    int b,
+    int visit,
+    int order,
+    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
+    void *param
+){
+    int i;
+    struct phy_node *p;
+    if (order == PREORDER)
+    {
+        for (i = a; i <= b; ++i)
+        {
+            p = phy->nodes[i];
+            if (visit == ALL_NODES || p->ndesc)
+                FUN(p, phy, param);
+        }
+    }
+    else
+    {
+        for (i = b; i >= a; --i)
+        {
+            p = phy->nodes[i];
+            if (visit == ALL_NODES || p->ndesc)
+                FUN(p, phy, param);
+        }
     }
-    if (a->anc->lfdesc == a)
-        a->anc->lfdesc = b;
 }
 
 
-void phy_ladderize(struct phy *phy, int *n, int *perm)
-{
-    int i = 0, j = 0, k = 0, sorted;
-    struct phy_node *d;
+/* The clade below node is cut into disjoint subclades of at most grain
+** nodes, each the largest such clade on its path to node, which
+** together with the nodes above them (the spine) cover the clade. No
+** subclade depends on another, so they are traversed in parallel, while
+** the spine is traversed serially after them (postorder) or before them
+** (preorder). Both are read straight off the preorder sequence, using
+** lastvisit to find the extent of each clade. */
+int phy_node_foreach_parallel(
+    struct phy *phy,
+    struct phy_node *node,
+    int visit,
+    int order,
+    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
+    void *param,
+    int nthreads
+){
+    int i;
+    int k;
+    int a;
+    int b;
+    int n;
+    int pos;
+    int end;
+    int size;
+    int grain;
+    int ntask = 0;
+    int nspine = 0;
+    int *task;
     struct phy_node *p;
-    struct phy_node *q;
-    struct phy_cursor *cursor;
-
-    cursor = phy_cursor_prepare(
-        phy, phy->root, INTERNAL_NODES_ONLY, PREORDER);
 
-    while ((p = phy_cursor_step(cursor)) != 0)
-    {
+    if (nthreads < 1)
+        nthreads = 1;
+    if (refresh(phy))
+        return PHY_ERR;
 
-        do {
-            sorted = 0;
+    pos = phy->vseq[node->index];
+    end = phy->vseq[(node->lastvisit ? node->lastvisit : node)->index];
+    n = end - pos + 1;
 
-            d = p->lfdesc;
-            while (d && d->next)
-            {
-                if (n[d->index] > n[d->next->index])
-                {
-                    ++sorted;
-                    phy_node_swap(d, d->next);
-                }
-                d = d->next;
-            }
+    grain = nthreads > 1 ? n / (8 * nthreads) : n;
+    if (grain < FOREACH_GRAIN)
+        grain = FOREACH_GRAIN;
 
-        } while (sorted > 0);
+    if (n <= grain)
+    {
+        foreach_block(phy, pos, end, visit, order, FUN, param);
+        return PHY_OK;
     }
 
-    p = phy->root;
-    while (p)
+    // count the subclades and the spine
+    for (i = pos; i <= end; )
     {
-        phy->nodes[i] = p;
-        if (p->ndesc)
+        p = phy->nodes[i];
+        size = p->ndesc ? phy->vseq[p->lastvisit->index] - i + 1 : 1;
+        if (size <= grain)
         {
-            perm[phy->ntip + j] = p->index;
-            p->index = phy->ntip + j;
-            phy->inodes[j++] = p;
+            ntask++;
+            i += size;
         }
         else
         {
-            perm[k] = p->index;
-            p->index = k++;
+            nspine++;
+            i++;
         }
-        phy->vseq[p->index] = i++;
+    }
 
-        if (p->lfdesc)
-            p = p->lfdesc;
-        else if (p->next)
-            p = p->next;
-        else {
-            q = p;
-            while (p->anc != 0 && p->next == 0) {
-                p = p->anc;
-                p->lastvisit = q;
-            }
-            p = p->next;
+    // the preorder positions of the subclades followed by those of the
+    // spine
+    task = malloc((ntask + nspine) * sizeof(int));
+    if (!task)
+    {
+        phy_errno = 1;
+        return PHY_ERR;
+    }
+
+    a = 0;
+    b = ntask;
+    for (i = pos; i <= end; )
+    {
+        p = phy->nodes[i];
+        size = p->ndesc ? phy->vseq[p->lastvisit->index] - i + 1 : 1;
+        if (size <= grain)
+        {
+            task[a++] = i;
+            i += size;
+        }
+        else
+        {
+            task[b++] = i++;
         }
     }
+
+    if (order == PREORDER)
+    {
+        for (k = ntask; k < ntask + nspine; ++k)
+            FUN(phy->nodes[task[k]], phy, param);
+    }
+
+#ifdef _OPENMP
+    #pragma omp parallel for schedule(dynamic) num_threads(nthreads) \
+        private(p)
+#endif
+    for (k = 0; k < ntask; ++k)
+    {
+        p = phy->nodes[task[k]];
+        foreach_block(phy, task[k],
+            p->ndesc ? phy->vseq[p->lastvisit->index] : task[k],
+            visit, order, FUN, param);
+    }
+
+    if (order == POSTORDER)
+    {
+        for (k = ntask + nspine - 1; k >= ntask; --k)
+            FUN(phy->nodes[task[k]], phy, param);
+    }
+
+    free(task);
+    return PHY_OK;
 }
 
 
-struct phy_node *phy_root(struct phy *phy)
+const char *phy_node_label(struct phy_node *node)
 {
-    return phy->root;
+    return node->lab;
 }
 
 
-struct phy_node *phy_node_get(struct phy *phy, int index)
+const char *phy_node_note(struct phy_node *node)
 {
-    if (index >= 0 && index < phy->nnode)
-        return phy->nodes[phy->vseq[index]];
-    return NULL;
+    return node->note;
 }
 
 
-struct phy_node *phy_node_find(struct phy *phy, const char *label)
+struct phy_flat *phy_flatten(struct phy *phy)
 {
-    struct phy_cursor *cursor;
-    struct phy_node *node = 0;
-
-    cursor = phy_cursor_prepare(phy, phy->root, ALL_NODES, POSTORDER);
-    while ((node = phy_cursor_step(cursor)) != 0)
-    {
-        if (node->lab)
-        {
-            if (strcmp(label, node->lab) == 0)
-                break;
-        }
-    }
+    int i;
+    int n;
+    struct phy_node *p;
+    struct phy_flat *flat;
+    const double *age;
 
-    return node;
-}
+    if (refresh(phy))
+        return NULL;
+    if (!(age = phy_ages(phy)))
+        return NULL;
 
+    n = phy->nnode;
 
-void phy_node_set_data(
-    struct phy_node *node,
-    void *data,
-    void (*data_free)(void *)
-){
-    if (node->data && node->data_free)
-        node->data_free(node->data);
-    node->data = data;
-    node->data_free = data_free;
-}
+    // one block: the header, the double arrays, then the int arrays
+    flat = malloc(sizeof(struct phy_flat)
+        + 2 * n * sizeof(double) + 5 * n * sizeof(int));
+    if (!flat)
+    {
+        phy_errno = 1;
+        return NULL;
+    }
+    flat->nnode = n;
+    flat->ntip = phy->ntip;
+    flat->root = phy->root->index;
+    flat->brlen = (double *)(flat + 1);
+    flat->age = flat->brlen + n;
+    memcpy(flat->age, age, n * sizeof(double));
+    flat->parent = (int *)(flat->age + n);
+    flat->first_child = flat->parent + n;
+    flat->next_sibling = flat->first_child + n;
+    flat->ndesc = flat->next_sibling + n;
+    flat->preorder = flat->ndesc + n;
 
+    for (i = 0; i < n; ++i)
+    {
+        p = phy->nodes[i];
+        flat->preorder[i] = p->index;
+        flat->parent[p->index] = p->anc ? p->anc->index : -1;
+        flat->first_child[p->index] = p->lfdesc ? p->lfdesc->index : -1;
+        flat->next_sibling[p->index] = p->next ? p->next->index : -1;
+        flat->ndesc[p->index] = p->ndesc;
+        flat->brlen[p->index] = p->brlen;
+    }
 
-void phy_node_set_index(struct phy_node *node, int index)
-{
-    node->index = index;
+    return flat;
 }
 
 
-void phy_node_set_brlen(struct phy_node *node, double brlen)
+void phy_flat_free(struct phy_flat *flat)
 {
-    node->brlen = brlen;
+    free(flat);
 }
 
 
-void phy_node_set_label(struct phy_node *node, const char *label)
+struct phy_layout *phy_layout_new(struct phy *phy)
 {
-    node->lab = calloc(strlen(label)+1, sizeof(char));
-    strncpy(node->lab, label, strlen(label));
-}
-
+    int i;
+    int k;
+    int n;
+    int a;
+    struct phy_node *p;
+    struct phy_layout *layout;
+    const double *age;
 
-void *phy_node_data(struct phy_node *node)
-{
-    return node->data;
-}
+    if (refresh(phy))
+        return NULL;
+    if (!(age = phy_ages(phy)))
+        return NULL;
 
+    n = phy->nnode;
 
-void phy_node_spanning_pair(
-    struct phy_node *node,
-    const char **a,
-    const char **b
-){
-    if (!node->ndesc)
+    // one block: the header, the double arrays, the int arrays, then the
+    // states
+    layout = malloc(sizeof(struct phy_layout)
+        + 6 * n * sizeof(double) + 4 * n * sizeof(int) + n);
+    if (!layout)
     {
-        *a = node->lab;
-        *b = node->lab;
+        phy_errno = 1;
+        return NULL;
     }
-    else
+    layout->nnode = n;
+    layout->ntip = phy->ntip;
+    layout->root = phy->root->index;
+    layout->age = (double *)(layout + 1);
+    layout->base = layout->age + n;
+    layout->pos = layout->base + n;
+    layout->lo = layout->pos + n;
+    layout->hi = layout->lo + n;
+    layout->reach = layout->hi + n;
+    layout->parent = (int *)(layout->reach + n);
+    layout->first = layout->parent + n;
+    layout->last = layout->first + n;
+    layout->size = layout->last + n;
+    layout->state = (unsigned char *)(layout->size + n);
+    memcpy(layout->age, age, n * sizeof(double));
+    memset(layout->state, 0, n);
+
+    layout->minage = layout->maxage = age[phy->root->index];
+
+    /* In reverse preorder every node is visited after its children. The
+    ** children of a node come in order, so the last child to report to
+    ** its parent is the first one and the largest position is the last
+    ** child's. */
+    for (k = n - 1; k >= 0; --k)
     {
-        *b = node->lastvisit->lab;
-        node = node->lfdesc;
-        while (node->lfdesc)
-            node = node->lfdesc;
-        *a = node->lab;
+        p = phy->nodes[k];
+        i = p->index;
+        layout->base[i] = age[i] - p->brlen;
+        layout->parent[i] = p->anc ? p->anc->index : -1;
+        layout->first[i] = p->firsttip;
+        if (p->ndesc)
+        {
+            layout->last[i] = p->lastvisit->index;
+            layout->size[i] = phy->vseq[p->lastvisit->index] - k + 1;
+            layout->pos[i] = 0.5 * (layout->lo[i] + layout->hi[i]);
+            if (age[i] > layout->reach[i])
+                layout->reach[i] = age[i];
+        }
+        else
+        {
+            layout->last[i] = i;
+            layout->size[i] = 1;
+            layout->pos[i] = layout->lo[i] = layout->hi[i] = i;
+            layout->reach[i] = age[i];
+        }
+        if (age[i] < layout->minage)
+            layout->minage = age[i];
+        if (age[i] > layout->maxage)
+            layout->maxage = age[i];
+        if (p->anc)
+        {
+            a = p->anc->index;
+            if (!p->next)
+            {
+                layout->hi[a] = layout->pos[i];
+                layout->reach[a] = layout->reach[i];
+            }
+            else if (layout->reach[i] > layout->reach[a])
+                layout->reach[a] = layout->reach[i];
+            layout->lo[a] = layout->pos[i];
+        }
     }
+    return layout;
 }
 
 
-void phy_node_spanning_index(
-    struct phy_node *node,
-    int *a,
-    int *b
-){
-    if (!node->ndesc)
+void phy_layout_collapse(struct phy_layout *layout, int node, int collapse)
+{
+    int i;
+    int end;
+    unsigned char *state = layout->state;
+
+    if (layout->first[node] == node)
+        return;
+    if (collapse)
+        state[node] |= PHY_LAYOUT_COLLAPSED;
+    else
+        state[node] &= ~PHY_LAYOUT_COLLAPSED;
+
+    /* The internal nodes of the clade are numbered in preorder from node
+    ** and its terminal nodes run from first to last, so each node's state
+    ** is derived from its parent's, which is already up to date */
+    end = node + layout->size[node]
+        - (layout->last[node] - layout->first[node] + 1);
+    for (i = node + 1; i < end; ++i)
     {
-        *a = node->index;
-        *b = node->index;
+        if (state[layout->parent[i]]
+                & (PHY_LAYOUT_COLLAPSED | PHY_LAYOUT_HIDDEN))
+            state[i] |= PHY_LAYOUT_HIDDEN;
+        else
+            state[i] &= ~PHY_LAYOUT_HIDDEN;
     }
-    else
+    for (i = layout->first[node]; i <= layout->last[node]; ++i)
     {
-        *b = node->lastvisit->index;
-        node = node->lfdesc;
-        while (node->lfdesc)
-            node = node->lfdesc;
-        *a = node->index;
+        if (state[layout->parent[i]]
+                & (PHY_LAYOUT_COLLAPSED | PHY_LAYOUT_HIDDEN))
+            state[i] |= PHY_LAYOUT_HIDDEN;
+        else
+            state[i] &= ~PHY_LAYOUT_HIDDEN;
     }
 }
 
 
-struct phy_node *phy_node_mrca(
-    struct phy *phy,
-    struct phy_node *a,
-    struct phy_node *b
-){
-    if (a == b)
-        return a;
-
-    int gotcha[phy->nnode];
+int phy_layout_cull(struct phy_layout *layout, const double *window,
+    double breadth, double depth)
+{
+    int i;
+    int k;
+    int p;
+    int ndrawn = 0;
+    int n = layout->nnode;
+    int ntip = layout->ntip;
+    double lo;
+    double hi;
+    double d0;
+    double d1;
+    unsigned char *state = layout->state;
 
-    memset(gotcha, 0, phy->nnode * sizeof(int));
+    for (i = 0; i < n; ++i)
+        state[i] &= PHY_LAYOUT_COLLAPSED | PHY_LAYOUT_HIDDEN;
 
-    while ((a = a->anc) != 0)
-        gotcha[a->index] = 1;
+    /* The internal nodes in preorder and then the terminal nodes, so that
+    ** every node comes after its parent */
+    for (k = 0; k < n; ++k)
+    {
+        i = k < n - ntip ? ntip + k : k - (n - ntip);
+        if (state[i] & PHY_LAYOUT_HIDDEN)
+            continue;
+        p = layout->parent[i];
+        if (p >= 0 && (state[p] & (PHY_LAYOUT_WEDGE | PHY_LAYOUT_CULLED)))
+        {
+            state[i] |= PHY_LAYOUT_CULLED;
+            continue;
+        }
+        lo = layout->pos[layout->first[i]];
+        hi = layout->pos[layout->last[i]];
+        d0 = layout->age[i] < layout->base[i] ?
+            layout->age[i] : layout->base[i];
+        d1 = layout->age[i] < layout->base[i] ?
+            layout->base[i] : layout->age[i];
+        if (window && (hi < window[0] || lo > window[1]
+            || (layout->reach[i] > d1 ? layout->reach[i] : d1) < window[2]
+            || d0 > window[3]))
+        {
+            state[i] |= PHY_LAYOUT_CULLED;
+            continue;
+        }
+        ndrawn++;
+        if (i >= ntip && !(state[i] & PHY_LAYOUT_COLLAPSED)
+                && hi - lo < breadth)
+            state[i] |= PHY_LAYOUT_WEDGE;
+        if (d1 - d0 < depth || (window && (layout->pos[i] < window[0]
+                || layout->pos[i] > window[1] || d1 < window[2]
+                || d0 > window[3])))
+            state[i] |= PHY_LAYOUT_NOEDGE;
+    }
+    return ndrawn;
+}
 
-    while (b && !gotcha[b->index])
-        b = b->anc;
 
-    return b;
+void phy_layout_free(struct phy_layout *layout)
+{
+    free(layout);
 }
 
 
-void phy_node_foreach(
-    struct phy *phy,
-    struct phy_node *node,
-    int visit,
-    int order,
-    void (*FUN)(struct phy_node *node, struct phy *phy, void *param),
-    void *param
-){
-    struct phy_cursor cursor;
-    phy_cursor_prepare_v2(phy, node, &cursor, visit, order);
-    while ((node = phy_cursor_step(&cursor)) != 0)
-        FUN(node, phy, param);
+void phy_stats(struct phy_stats *out)
+{
+#ifdef PHY_STATS
+    *out = stats;
+#else
+    memset(out, 0, sizeof(struct phy_stats));
+#endif
 }
 
 
-const char *phy_node_label(struct phy_node *node)
+void phy_stats_reset(void)
 {
-    return node->lab;
+#ifdef PHY_STATS
+    memset(&stats, 0, sizeof(struct phy_stats));
+#endif
 }
 
 
-const char *phy_node_note(struct phy_node *node)
+const char *phy_strerror(int err)
 {
-    return node->note;
+    switch (err)
+    {
+        case 1:
+            return PHY_ERR1;
+        case 2:
+            return PHY_ERR2;
+        case 3:
+            return PHY_ERR3;
+        case 4:
+            return PHY_ERR4;
+        case 5:
+            return PHY_ERR5;
+        case 6:
+            return PHY_ERR6;
+        case 7:
+            return PHY_ERR7;
+        case 8:
+            return PHY_ERR8;
+        case 9:
+            return PHY_ERR9;
+        case 10:
+            return PHY_ERR10;
+        default:;
+    }
+    return "no errors detected";
 }
 
 
@@ -1777,6 +6314,24 @@ const char *phy_errmsg()
         case 4:
             phy_errno = 0;
             return PHY_ERR4;
+        case 5:
+            phy_errno = 0;
+            return PHY_ERR5;
+        case 6:
+            phy_errno = 0;
+            return PHY_ERR6;
+        case 7:
+            phy_errno = 0;
+            return PHY_ERR7;
+        case 8:
+            phy_errno = 0;
+            return PHY_ERR8;
+        case 9:
+            phy_errno = 0;
+            return PHY_ERR9;
+        case 10:
+            phy_errno = 0;
+            return PHY_ERR10;
         default:;
     }
     return "no errors detected";
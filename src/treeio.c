@@ -13,17 +13,34 @@ void phylo_phy_free(SEXP rtree)
 }
 
 
+/* Wrap a phylogeny in an external pointer of class tree */
+static SEXP phylo_tree(struct phy *phy)
+{
+    SEXP rtree = PROTECT(R_MakeExternalPtr(phy, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(rtree, &phylo_phy_free);
+    setAttrib(rtree, install("root"),
+        ScalarInteger(phy_node_index(phy_root(phy))+1));
+    setAttrib(rtree, install("Ntip"), ScalarInteger(phy_ntip(phy)));
+    setAttrib(rtree, install("Nnode"), ScalarInteger(phy_nnode(phy)));
+    setAttrib(rtree, R_ClassSymbol, mkString("tree"));
+    UNPROTECT(1);
+    return rtree;
+}
+
+
+static void phylo_reader_free(SEXP rreader)
+{
+    phy_reader_close((struct phy_reader *)R_ExternalPtrAddr(rreader));
+    R_ClearExternalPtr(rreader);
+}
+
+
 SEXP phylo_phy_read_newickstr(SEXP newick)
 {
     SEXP rtree;
     struct phy *phy = phy_read_newickstr(CHAR(STRING_ELT(newick, 0)));
     if (phy) {
-        rtree = PROTECT(R_MakeExternalPtr(phy, R_NilValue, R_NilValue));
-        R_RegisterCFinalizer(rtree, &phylo_phy_free);
-        setAttrib(rtree, install("root"),
-            ScalarInteger(phy_node_index(phy_root(phy))+1));
-        setAttrib(rtree, install("Ntip"), ScalarInteger(phy_ntip(phy)));
-        setAttrib(rtree, install("Nnode"), ScalarInteger(phy_nnode(phy)));
+        rtree = PROTECT(phylo_tree(phy));
         UNPROTECT(1);
         return rtree;
     }
@@ -31,10 +48,115 @@ SEXP phylo_phy_read_newickstr(SEXP newick)
 }
 
 
-SEXP phylo_phy_write_newickstr(SEXP rtree)
+/* Read all trees from an open reader, parsing them on nthreads threads */
+static SEXP phylo_readall(struct phy_reader *reader, int nthreads)
+{
+    int i;
+    int n;
+    struct phy **trees;
+
+    if (phy_reader_readall(reader, nthreads, &trees, &n))
+        return NULL;
+
+    SEXP ret = PROTECT(allocVector(VECSXP, n));
+    for (i = 0; i < n; ++i)
+    {
+        SET_VECTOR_ELT(ret, i, phylo_tree(trees[i]));
+        trees[i] = 0;
+    }
+    free(trees);
+
+    UNPROTECT(1);
+    return ret;
+}
+
+
+/* Read up to ntree trees (all of them if ntree < 0) from a Newick file or
+** string. If fun is a function it is applied to each tree as it is read
+** and its results are returned in place of the trees. When all trees are
+** read and fun is NULL they are parsed on nthreads threads. */
+SEXP phylo_phy_read_newick(
+    SEXP source, SEXP isfile, SEXP ntree, SEXP fun, SEXP rho, SEXP nthreads)
+{
+    int i;
+    int sz;
+    int end = 0;
+    int cnt = 0;
+    int n = 0;
+    int nmax = INTEGER(ntree)[0];
+    struct phy *phy;
+    struct phy_reader *reader;
+
+    SEXP rtree;
+    SEXP buf = PROTECT(allocVector(VECSXP, 1000));
+    SEXP root = PROTECT(list1(buf));
+    SEXP tail = root;
+
+    if (LOGICAL(isfile)[0])
+        reader = phy_reader_open(CHAR(STRING_ELT(source, 0)));
+    else
+        reader = phy_reader_openstr(CHAR(STRING_ELT(source, 0)));
+    if (!reader)
+        error(phy_errmsg());
+
+    // the reader is closed by the finalizer if fun signals an error
+    SEXP rreader = PROTECT(R_MakeExternalPtr(reader, R_NilValue, source));
+    R_RegisterCFinalizer(rreader, &phylo_reader_free);
+
+    if (nmax < 0 && TYPEOF(fun) == NILSXP && INTEGER(nthreads)[0] > 1) {
+        SEXP ret = phylo_readall(reader, INTEGER(nthreads)[0]);
+        if (!ret)
+            error(phy_errmsg());
+        PROTECT(ret);
+        phylo_reader_free(rreader);
+        UNPROTECT(4);
+        return ret;
+    }
+
+    while (nmax < 0 || n < nmax) {
+        if (phy_reader_next(reader, &phy))
+            error("tree %d: %s", n+1, phy_errmsg());
+        if (!phy)
+            break;
+        rtree = PROTECT(phylo_tree(phy));
+        if (TYPEOF(fun) != NILSXP) {
+            SEXP call = PROTECT(lang2(fun, rtree));
+            rtree = eval(call, rho);
+            UNPROTECT(1);
+        }
+        SET_VECTOR_ELT(buf, cnt++, rtree);
+        UNPROTECT(1);
+        n++;
+        if (cnt == 1000) {
+            buf = PROTECT(allocVector(VECSXP, 1000));
+            tail = SETCDR(tail, list1(buf));
+            UNPROTECT(1);
+            cnt = 0;
+        }
+    }
+
+    phylo_reader_free(rreader);
+
+    SEXP ret = PROTECT(allocVector(VECSXP, n));
+
+    while (root != R_NilValue) {
+        sz = CDR(root) == R_NilValue ? cnt : 1000;
+        for (i = 0; i < sz; ++i)
+            SET_VECTOR_ELT(ret, end++, VECTOR_ELT(CAR(root), i));
+        root = CDR(root);
+    }
+
+    UNPROTECT(4);
+    return ret;
+}
+
+
+SEXP phylo_phy_write_newickstr(SEXP rtree, SEXP digits)
 {
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
-    char *newick = phy_write_newickstr(phy);
+    char *newick = phy_write_newickstr_v2(phy, INTEGER(digits)[0]);
+    if (!newick)
+        error(phy_errmsg());
     SEXP ret = PROTECT(allocVector(STRSXP, 1));
     SET_STRING_ELT(ret, 0, mkChar(newick));
     free(newick);
@@ -43,95 +165,278 @@ SEXP phylo_phy_write_newickstr(SEXP rtree)
 }
 
 
-SEXP phylo_tiplabels(SEXP rtree)
+SEXP phylo_phy_write_newickfile(SEXP trees, SEXP filename, SEXP digits)
 {
     int i;
-    int ntip;
-    SEXP tiplabel;
+    int n = LENGTH(trees);
+    struct phy **phy = (struct phy **)R_alloc(n, sizeof(struct phy *));
+    for (i = 0; i < n; ++i)
+        phy[i] = (struct phy *)R_ExternalPtrAddr(VECTOR_ELT(trees, i));
+    if (phy_write_newickfile_v2(n, phy, CHAR(STRING_ELT(filename, 0)), "w",
+            INTEGER(digits)[0]))
+        error(phy_errmsg());
+    return R_NilValue;
+}
+
+
+SEXP phylo_phy_duplicate(SEXP rtree)
+{
+    SEXP rdup;
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    struct phy *dup = phy_duplicate(phy);
+    if (dup) {
+        rdup = PROTECT(phylo_tree(dup));
+        UNPROTECT(1);
+        return rdup;
+    }
+    error(phy_errmsg());
+}
 
-    ntip = phy_ntip(phy);
-    tiplabel = PROTECT(allocVector(STRSXP, ntip));
 
-    for (i = 0; i < ntip; ++i)
-    {
-        SET_STRING_ELT(tiplabel, i,
-            mkChar(phy_node_label(phy_node_get(phy, i))));
+SEXP phylo_phy_write_binary(SEXP rtree, SEXP file)
+{
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    if (phy_write_binary(phy, CHAR(STRING_ELT(file, 0))))
+        error("unable to write tree to file");
+    return R_NilValue;
+}
+
+
+SEXP phylo_phy_read_binary(SEXP file)
+{
+    SEXP rtree;
+    struct phy *phy = phy_read_binary(CHAR(STRING_ELT(file, 0)));
+    if (phy) {
+        rtree = PROTECT(phylo_tree(phy));
+        UNPROTECT(1);
+        return rtree;
     }
+    error(phy_errmsg());
+}
+
 
+SEXP phylo_phy_serialize(SEXP rtree)
+{
+    size_t size;
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    unsigned char *buf = phy_write_binarystr(phy, &size);
+    if (!buf)
+        error(phy_errmsg());
+    SEXP ret = PROTECT(allocVector(RAWSXP, size));
+    memcpy(RAW(ret), buf, size);
+    free(buf);
     UNPROTECT(1);
-    return tiplabel;
+    return ret;
 }
 
 
-SEXP phylo_node_notes(SEXP rtree)
+SEXP phylo_phy_unserialize(SEXP raw)
 {
-    int i;
-    int nnode;
-    const char *note;
-    SEXP notes;
-    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    SEXP rtree;
+    struct phy *phy = phy_read_binarystr(RAW(raw), XLENGTH(raw));
+    if (phy) {
+        rtree = PROTECT(phylo_tree(phy));
+        UNPROTECT(1);
+        return rtree;
+    }
+    error(phy_errmsg());
+}
 
-    nnode = phy_nnode(phy);
-    notes = PROTECT(allocVector(STRSXP, nnode));
 
-    for (i = 0; i < nnode; ++i) {
-        note = phy_node_note(phy_node_get(phy, i));
-        if (note)
-            SET_STRING_ELT(notes, i, mkChar(note));
-        else
-            SET_STRING_ELT(notes, i, mkChar(""));
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+
+static int b64_value(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+
+/* Serialization hook for trees. A tree is persisted as the character
+** vector c("phylo::tree", <base64 encoded binary tree>). Given such a
+** vector the tree is rebuilt, and given any other reference object the
+** hook returns NULL so that R serializes it as usual. */
+SEXP phylo_tree_refhook(SEXP x)
+{
+    size_t i;
+    size_t j;
+    size_t size;
+    size_t len;
+    unsigned int v;
+    int c;
+    int nbit;
+    const char *z;
+    char *out;
+    unsigned char *buf;
+    struct phy *phy;
+    SEXP ret;
+
+    if (TYPEOF(x) == STRSXP) {
+        if (XLENGTH(x) != 2 || strcmp(CHAR(STRING_ELT(x, 0)), "phylo::tree"))
+            error("unrecognized reference in serialized data");
+        z = CHAR(STRING_ELT(x, 1));
+        len = strlen(z);
+        buf = (unsigned char *)R_alloc(len / 4 * 3 + 3, 1);
+        for (i = j = 0, v = 0, nbit = 0; i < len && z[i] != '='; ++i) {
+            if ((c = b64_value(z[i])) < 0)
+                error("malformed serialized tree");
+            v = (v << 6) | c;
+            nbit += 6;
+            if (nbit >= 8) {
+                nbit -= 8;
+                buf[j++] = (v >> nbit) & 0xff;
+            }
+        }
+        phy = phy_read_binarystr(buf, j);
+        if (!phy)
+            error(phy_errmsg());
+        return phylo_tree(phy);
+    }
+
+    if (TYPEOF(x) != EXTPTRSXP || !inherits(x, "tree")
+        || !R_ExternalPtrAddr(x))
+        return R_NilValue;
+
+    buf = phy_write_binarystr((struct phy *)R_ExternalPtrAddr(x), &size);
+    if (!buf)
+        error(phy_errmsg());
+    out = R_alloc(4 * ((size + 2) / 3) + 1, 1);
+    for (i = j = 0; i + 2 < size; i += 3) {
+        v = (buf[i] << 16) | (buf[i+1] << 8) | buf[i+2];
+        out[j++] = b64[(v >> 18) & 63];
+        out[j++] = b64[(v >> 12) & 63];
+        out[j++] = b64[(v >> 6) & 63];
+        out[j++] = b64[v & 63];
     }
+    if (i < size) {
+        v = buf[i] << 16;
+        if (i + 1 < size)
+            v |= buf[i+1] << 8;
+        out[j++] = b64[(v >> 18) & 63];
+        out[j++] = b64[(v >> 12) & 63];
+        out[j++] = i + 1 < size ? b64[(v >> 6) & 63] : '=';
+        out[j++] = '=';
+    }
+    out[j] = 0;
+    free(buf);
 
+    ret = PROTECT(allocVector(STRSXP, 2));
+    SET_STRING_ELT(ret, 0, mkChar("phylo::tree"));
+    SET_STRING_ELT(ret, 1, mkChar(out));
     UNPROTECT(1);
-    return notes;
+    return ret;
 }
 
 
-SEXP phylo_phy_node_brlens(SEXP rtree)
+SEXP phylo_phy_node_depths(SEXP rtree)
 {
-    int i;
     int nnode;
-    SEXP brlen;
+    const int *node_depth;
+    SEXP depth;
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
 
     nnode = phy_nnode(phy);
-    brlen = PROTECT(allocVector(REALSXP, nnode));
+    node_depth = phy_depths(phy);
+    if (!node_depth)
+        error(phy_errmsg());
 
-    for (i = 0; i < nnode; ++i)
-        REAL(brlen)[i] = phy_node_brlen(phy_node_get(phy, i));
+    depth = PROTECT(allocVector(INTSXP, nnode));
+    memcpy(INTEGER(depth), node_depth, nnode * sizeof(int));
 
     UNPROTECT(1);
-    return brlen;
+    return depth;
+}
+
+
+SEXP phylo_phy_height(SEXP rtree)
+{
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    double height = phy_height(phy);
+    if (height < 0)
+        error(phy_errmsg());
+    return ScalarReal(height);
+}
+
+
+static void phylo_lca_free(SEXP rlca)
+{
+    phy_lca_free((struct phy_lca *)R_ExternalPtrAddr(rlca));
+    R_ClearExternalPtr(rlca);
+}
+
+
+/* The LCA index of a phylogeny, built on first use and cached in the
+** "lca" attribute */
+static struct phy_lca *phylo_lca(SEXP rtree)
+{
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    struct phy_lca *lca;
+    SEXP rlca = getAttrib(rtree, install("lca"));
+
+    if (TYPEOF(rlca) != EXTPTRSXP || !R_ExternalPtrAddr(rlca)) {
+        lca = phy_lca_new(phy);
+        if (!lca)
+            error(phy_errmsg());
+        rlca = PROTECT(R_MakeExternalPtr(lca, R_NilValue, R_NilValue));
+        R_RegisterCFinalizer(rlca, &phylo_lca_free);
+        setAttrib(rtree, install("lca"), rlca);
+        UNPROTECT(1);
+    }
+    return (struct phy_lca *)R_ExternalPtrAddr(rlca);
 }
 
 
-SEXP phylo_phy_node_ages(SEXP rtree)
+/* Most recent common ancestors for pairs of nodes a[i], b[i] */
+SEXP phylo_phy_node_mrca(SEXP rtree, SEXP a, SEXP b)
 {
     int i;
-    int nnode;
-    double *node_age;
-    SEXP age;
+    int n = LENGTH(a);
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
-    struct phy_node *node;
+    struct phy_lca *lca = phylo_lca(rtree);
 
-    nnode = phy_nnode(phy);
+    SEXP ret = PROTECT(allocVector(INTSXP, n));
+    for (i = 0; i < n; ++i) {
+        INTEGER(ret)[i] = 1 + phy_node_index(phy_lca_query(lca,
+            phy_node_get(phy, INTEGER(a)[i]-1),
+            phy_node_get(phy, INTEGER(b)[i]-1)));
+    }
+    UNPROTECT(1);
+    return ret;
+}
 
-    age = PROTECT(allocVector(REALSXP, nnode));
-    node_age = REAL(age);
 
-    for (i = 0; i < nnode; ++i)
-    {
-        node = phy_node_get(phy, i);
-        node_age[i] = 0.0;
-        while (node != NULL) {
-            node_age[i] += phy_node_brlen(node);
-            node = phy_node_anc(node);
-        }
+SEXP phylo_phy_node_find(SEXP rtree, SEXP label)
+{
+    int i;
+    int n = LENGTH(label);
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    const char **labels = (const char **)R_alloc(n, sizeof(const char *));
+
+    for (i = 0; i < n; ++i) {
+        SEXP z = STRING_ELT(label, i);
+        labels[i] = z == NA_STRING ? NULL : CHAR(z);
     }
 
+    SEXP ret = PROTECT(allocVector(INTSXP, n));
+    if (phy_node_find_many(phy, n, labels, INTEGER(ret))) {
+        UNPROTECT(1);
+        error(phy_errmsg());
+    }
+    for (i = 0; i < n; ++i)
+        INTEGER(ret)[i] = INTEGER(ret)[i] < 0 ? NA_INTEGER : INTEGER(ret)[i] + 1;
     UNPROTECT(1);
-    return age;
+    return ret;
 }
 
 
@@ -145,15 +450,17 @@ SEXP phylo_phy_node_ancestors(SEXP rtree, SEXP node)
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
     struct phy_node *p = phy_node_get(phy, INTEGER(node)[0]-1);
 
-    SEXP buf;
-    SEXP root = PROTECT(list1(buf = allocVector(VECSXP, 1000)));
+    SEXP buf = PROTECT(allocVector(VECSXP, 1000));
+    SEXP root = PROTECT(list1(buf));
     SEXP tail = root;
 
     while (p != NULL) {
         nanc++;
         SET_VECTOR_ELT(buf, cnt++, ScalarInteger(phy_node_index(p)+1));
         if (cnt == 1000) {
-            tail = SETCDR(tail, list1(buf = allocVector(VECSXP, 1000)));
+            buf = PROTECT(allocVector(VECSXP, 1000));
+            tail = SETCDR(tail, list1(buf));
+            UNPROTECT(1);
             cnt = 0;
         }
         p = phy_node_anc(p);
@@ -168,7 +475,7 @@ SEXP phylo_phy_node_ancestors(SEXP rtree, SEXP node)
         root = CDR(root);
     }
 
-    UNPROTECT(2);
+    UNPROTECT(3);
     return ret;
 }
 
@@ -186,6 +493,36 @@ SEXP phylo_phy_node_children(SEXP rtree, SEXP node)
 }
 
 
+/* For each node, the range of indices of the terminal nodes in its clade
+** and the number of nodes in the clade, as the rows of a matrix */
+SEXP phylo_phy_node_clade(SEXP rtree, SEXP node)
+{
+    int i;
+    int n = LENGTH(node);
+    int first;
+    int last;
+    int nnode;
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    SEXP clade = PROTECT(allocMatrix(INTSXP, n, 3));
+
+    for (i = 0; i < n; ++i)
+    {
+        if (phy_node_clade(phy, phy_node_get(phy, INTEGER(node)[i]-1),
+            &first, &last, &nnode))
+        {
+            UNPROTECT(1);
+            error(phy_errmsg());
+        }
+        INTEGER(clade)[i] = first + 1;
+        INTEGER(clade)[i + n] = last + 1;
+        INTEGER(clade)[i + 2*n] = nnode;
+    }
+
+    UNPROTECT(1);
+    return clade;
+}
+
+
 SEXP phylo_phy_node_descendants(SEXP rtree, SEXP node, SEXP visit, SEXP order)
 {
     int i;
@@ -194,21 +531,23 @@ SEXP phylo_phy_node_descendants(SEXP rtree, SEXP node, SEXP visit, SEXP order)
     int cnt = 0;
     int ndesc = 0;
     struct phy_node *d;
-    struct phy_cursor *cursor;
+    struct phy_cursor cursor;
     struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
 
-    SEXP buf;
-    SEXP root = PROTECT(list1(buf = allocVector(VECSXP, 1000)));
+    SEXP buf = PROTECT(allocVector(VECSXP, 1000));
+    SEXP root = PROTECT(list1(buf));
     SEXP tail = root;
 
-    cursor = phy_cursor_prepare(phy, phy_node_get(phy, INTEGER(node)[0]-1),
-        INTEGER(visit)[0], INTEGER(order)[0]);
+    phy_cursor_prepare_v2(phy, phy_node_get(phy, INTEGER(node)[0]-1),
+        &cursor, INTEGER(visit)[0], INTEGER(order)[0]);
 
-    while ((d = phy_cursor_step(cursor)) != 0) {
+    while ((d = phy_cursor_step(&cursor)) != 0) {
         ndesc++;
         SET_VECTOR_ELT(buf, cnt++, ScalarInteger(phy_node_index(d)+1));
         if (cnt == 1000) {
-            tail = SETCDR(tail, list1(buf = allocVector(VECSXP, 1000)));
+            buf = PROTECT(allocVector(VECSXP, 1000));
+            tail = SETCDR(tail, list1(buf));
+            UNPROTECT(1);
             cnt = 0;
         }
     }
@@ -222,11 +561,155 @@ SEXP phylo_phy_node_descendants(SEXP rtree, SEXP node, SEXP visit, SEXP order)
         root = CDR(root);
     }
 
-    UNPROTECT(2);
+    UNPROTECT(3);
     return descendants;
 }
 
 
+/* Parents of all nodes (NA for the root) */
+SEXP phylo_phy_parents(SEXP rtree)
+{
+    int i;
+    struct phy_node *p;
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    int n = phy_nnode(phy);
+    SEXP ret = PROTECT(allocVector(INTSXP, n));
+    for (i = 0; i < n; ++i) {
+        p = phy_node_anc(phy_node_get(phy, i));
+        INTEGER(ret)[i] = p ? phy_node_index(p) + 1 : NA_INTEGER;
+    }
+    UNPROTECT(1);
+    return ret;
+}
+
+
+/* Ancestors of all nodes, nearest first. The ancestors of a node are its
+** parent followed by the ancestors of its parent, so visiting nodes in
+** preorder each vector is a copy of one built before it. */
+SEXP phylo_phy_ancestors(SEXP rtree)
+{
+    int k;
+    int n;
+    SEXP anc;
+    SEXP panc;
+    struct phy_node *d;
+    struct phy_node *p;
+    struct phy_cursor cursor;
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    SEXP ret = PROTECT(allocVector(VECSXP, phy_nnode(phy)));
+    phy_cursor_prepare_v2(phy, phy_root(phy), &cursor, ALL_NODES, PREORDER);
+    while ((d = phy_cursor_step(&cursor)) != 0) {
+        k = phy_node_index(d);
+        p = phy_node_anc(d);
+        if (!p) {
+            SET_VECTOR_ELT(ret, k, allocVector(INTSXP, 0));
+            continue;
+        }
+        panc = VECTOR_ELT(ret, phy_node_index(p));
+        n = LENGTH(panc);
+        anc = allocVector(INTSXP, n + 1);
+        SET_VECTOR_ELT(ret, k, anc);
+        INTEGER(anc)[0] = phy_node_index(p) + 1;
+        memcpy(INTEGER(anc) + 1, INTEGER(panc), n * sizeof(int));
+    }
+    UNPROTECT(1);
+    return ret;
+}
+
+
+/* Children of all nodes, either as a list of integer vectors or in
+** compressed sparse row form: the children of node i (1-based) are
+** index[offset[i]+1] ... index[offset[i+1]]. */
+SEXP phylo_phy_children(SEXP rtree, SEXP csr)
+{
+    int i;
+    int k = 0;
+    SEXP kids;
+    struct phy_node *p;
+    struct phy_node *d;
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+    int nnode = phy_nnode(phy);
+    SEXP ret;
+
+    if (LOGICAL(csr)[0]) {
+        ret = PROTECT(allocVector(VECSXP, 2));
+        SEXP offset = allocVector(INTSXP, nnode + 1);
+        SET_VECTOR_ELT(ret, 0, offset);
+        SEXP index = allocVector(INTSXP, nnode - 1);
+        SET_VECTOR_ELT(ret, 1, index);
+        for (i = 0; i < nnode; ++i) {
+            INTEGER(offset)[i] = k;
+            p = phy_node_get(phy, i);
+            for (d = phy_node_lfdesc(p); d != 0; d = phy_node_next(d))
+                INTEGER(index)[k++] = phy_node_index(d) + 1;
+        }
+        INTEGER(offset)[nnode] = k;
+        SEXP names = PROTECT(allocVector(STRSXP, 2));
+        SET_STRING_ELT(names, 0, mkChar("offset"));
+        SET_STRING_ELT(names, 1, mkChar("index"));
+        setAttrib(ret, R_NamesSymbol, names);
+        UNPROTECT(1);
+    } else {
+        ret = PROTECT(allocVector(VECSXP, nnode));
+        for (i = 0; i < nnode; ++i) {
+            p = phy_node_get(phy, i);
+            kids = allocVector(INTSXP, phy_node_ndesc(p));
+            SET_VECTOR_ELT(ret, i, kids);
+            k = 0;
+            for (d = phy_node_lfdesc(p); d != 0; d = phy_node_next(d))
+                INTEGER(kids)[k++] = phy_node_index(d) + 1;
+        }
+    }
+
+    UNPROTECT(1);
+    return ret;
+}
+
+
+/* Descendants of each node in a vector of nodes, excluding the node itself.
+** The size of a clade is known from phy_node_clade, so a cursor over the
+** clade alone writes its nodes straight into the result. */
+SEXP phylo_phy_node_descendants_v(
+    SEXP rtree, SEXP node, SEXP visit, SEXP order)
+{
+    int i;
+    int k;
+    int first;
+    int last;
+    int nnode;
+    int n = LENGTH(node);
+    SEXP desc;
+    struct phy_node *p;
+    struct phy_node *d;
+    struct phy_cursor cursor;
+    struct phy *phy = (struct phy*)R_ExternalPtrAddr(rtree);
+
+    SEXP ret = PROTECT(allocVector(VECSXP, n));
+    for (i = 0; i < n; ++i) {
+        p = phy_node_get(phy, INTEGER(node)[i] - 1);
+        if (phy_node_clade(phy, p, &first, &last, &nnode)) {
+            UNPROTECT(1);
+            error(phy_errmsg());
+        }
+        // the clade's internal nodes are those that are not its tips
+        if (INTEGER(visit)[0] != ALL_NODES)
+            nnode -= last - first + 1;
+        desc = allocVector(INTSXP, phy_node_ndesc(p) ? nnode - 1 : 0);
+        SET_VECTOR_ELT(ret, i, desc);
+        k = 0;
+        phy_cursor_prepare_v2(phy, p, &cursor, INTEGER(visit)[0],
+            INTEGER(order)[0]);
+        while ((d = phy_cursor_step(&cursor)) != 0) {
+            if (d != p)
+                INTEGER(desc)[k++] = phy_node_index(d) + 1;
+        }
+    }
+
+    UNPROTECT(1);
+    return ret;
+}
+
+
 SEXP phylo_phy_extract_clade(SEXP rtree, SEXP node)
 {
     SEXP rclade;
@@ -234,12 +717,7 @@ SEXP phylo_phy_extract_clade(SEXP rtree, SEXP node)
     struct phy *clade = phy_extract_clade(
         phy_node_get(phy, INTEGER(node)[0]-1));
     if (clade) {
-        rclade = PROTECT(R_MakeExternalPtr(clade, R_NilValue, R_NilValue));
-        R_RegisterCFinalizer(rclade, &phylo_phy_free);
-        setAttrib(rclade, install("root"),
-            ScalarInteger(phy_node_index(phy_root(clade))+1));
-        setAttrib(rclade, install("Ntip"), ScalarInteger(phy_ntip(clade)));
-        setAttrib(rclade, install("Nnode"), ScalarInteger(phy_nnode(clade)));
+        rclade = PROTECT(phylo_tree(clade));
         UNPROTECT(1);
         return rclade;
     }
@@ -253,19 +731,15 @@ SEXP phylo_phy_extract_subtree(SEXP rtree, SEXP ntip, SEXP tips)
     int i;
     int Ntip = INTEGER(ntip)[0];
     struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
-    struct phy_node *nodes[Ntip];
+    struct phy_node **nodes = (struct phy_node **)R_alloc(
+        Ntip, sizeof(struct phy_node *));
 
     for (i = 0; i < Ntip; ++i)
         nodes[i] = phy_node_get(phy, INTEGER(tips)[i]-1);
 
     struct phy *subtree = phy_extract_subtree(Ntip, nodes, phy);
     if (subtree) {
-        rsubtree = PROTECT(R_MakeExternalPtr(subtree, R_NilValue, R_NilValue));
-        R_RegisterCFinalizer(rsubtree, &phylo_phy_free);
-        setAttrib(rsubtree, install("root"),
-            ScalarInteger(phy_node_index(phy_root(subtree))+1));
-        setAttrib(rsubtree, install("Ntip"), ScalarInteger(phy_ntip(subtree)));
-        setAttrib(rsubtree, install("Nnode"), ScalarInteger(phy_nnode(subtree)));
+        rsubtree = PROTECT(phylo_tree(subtree));
         UNPROTECT(1);
         return rsubtree;
     }
@@ -273,13 +747,54 @@ SEXP phylo_phy_extract_subtree(SEXP rtree, SEXP ntip, SEXP tips)
 }
 
 
+/* Subtrees for each vector of tip indices in the list sets, extracted on
+** nthreads threads */
+SEXP phylo_phy_extract_subtrees(SEXP rtree, SEXP sets, SEXP nthreads)
+{
+    int i;
+    int j;
+    int nset = LENGTH(sets);
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    struct phy_lca *lca = phylo_lca(rtree);
+    int *ntip = (int *)R_alloc(nset, sizeof(int));
+    struct phy_node ***tips = (struct phy_node ***)R_alloc(
+        nset, sizeof(struct phy_node **));
+    struct phy **out = (struct phy **)R_alloc(nset, sizeof(struct phy *));
+
+    for (i = 0; i < nset; ++i) {
+        SEXP set = VECTOR_ELT(sets, i);
+        ntip[i] = LENGTH(set);
+        tips[i] = (struct phy_node **)R_alloc(
+            ntip[i], sizeof(struct phy_node *));
+        for (j = 0; j < ntip[i]; ++j)
+            tips[i][j] = phy_node_get(phy, INTEGER(set)[j]-1);
+    }
+
+    if (phy_extract_subtrees(phy, lca, nset, ntip, tips,
+        INTEGER(nthreads)[0], out))
+        error(phy_errmsg());
+
+    SEXP ret = PROTECT(allocVector(VECSXP, nset));
+    for (i = 0; i < nset; ++i)
+        SET_VECTOR_ELT(ret, i, phylo_tree(out[i]));
+    UNPROTECT(1);
+    return ret;
+}
+
+
 SEXP phylo_phy_ladderize(SEXP rtree, SEXP ndesc)
 {
     struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
 
     SEXP perm = PROTECT(allocVector(INTSXP, phy_nnode(phy)));
 
-    phy_ladderize(phy, INTEGER(ndesc), INTEGER(perm));
+    // without ladderizing keys the subtree sizes are computed natively
+    if (phy_ladderize(phy, isNull(ndesc) ? NULL : INTEGER(ndesc),
+        INTEGER(perm)))
+    {
+        UNPROTECT(1);
+        error(phy_errmsg());
+    }
 
     for (int i = 0; i < phy_nnode(phy); ++i)
         INTEGER(perm)[i] += 1;
@@ -294,7 +809,8 @@ SEXP phylo_phy_node_rotate(SEXP rtree, SEXP index)
     int i;
     int n = LENGTH(index);
     struct phy *phy;
-    struct phy_node *nodes[n];
+    struct phy_node **nodes = (struct phy_node **)R_alloc(
+        n, sizeof(struct phy_node *));
 
     phy = (struct phy *)R_ExternalPtrAddr(rtree);
 
@@ -306,3 +822,186 @@ SEXP phylo_phy_node_rotate(SEXP rtree, SEXP index)
 
     return R_NilValue;
 }
+
+
+/* The root index, number of terminal nodes and number of nodes of a
+** phylogeny that was modified in place */
+static SEXP phylo_tree_dims(struct phy *phy)
+{
+    SEXP dims = PROTECT(allocVector(INTSXP, 3));
+    INTEGER(dims)[0] = phy_node_index(phy_root(phy)) + 1;
+    INTEGER(dims)[1] = phy_ntip(phy);
+    INTEGER(dims)[2] = phy_nnode(phy);
+    UNPROTECT(1);
+    return dims;
+}
+
+
+SEXP phylo_phy_reroot(SEXP rtree, SEXP node)
+{
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    if (phy_reroot_inplace(phy, phy_node_get(phy, INTEGER(node)[0]-1)))
+        error(phy_errmsg());
+    return phylo_tree_dims(phy);
+}
+
+
+SEXP phylo_phy_unroot(SEXP rtree)
+{
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    if (phy_unroot_inplace(phy))
+        error(phy_errmsg());
+    return phylo_tree_dims(phy);
+}
+
+
+/* Split table of the trees in the list trees */
+static struct phy_splits *phylo_splits(SEXP trees, SEXP rooted)
+{
+    int i;
+    struct phy_splits *splits = phy_splits_new(LOGICAL(rooted)[0]);
+    if (!splits)
+        error(phy_errmsg());
+    for (i = 0; i < LENGTH(trees); ++i) {
+        if (phy_splits_add(splits,
+            (struct phy *)R_ExternalPtrAddr(VECTOR_ELT(trees, i))))
+        {
+            phy_splits_free(splits);
+            error("tree %d: %s", i+1, phy_errmsg());
+        }
+    }
+    return splits;
+}
+
+
+SEXP phylo_phy_consensus(SEXP trees, SEXP p, SEXP rooted)
+{
+    struct phy_splits *splits = phylo_splits(trees, rooted);
+    struct phy *phy = phy_splits_consensus(splits, REAL(p)[0]);
+    phy_splits_free(splits);
+    if (!phy)
+        error(phy_errmsg());
+    return phylo_tree(phy);
+}
+
+
+SEXP phylo_phy_rf(SEXP trees, SEXP rooted, SEXP nthreads)
+{
+    int n = LENGTH(trees);
+    struct phy_splits *splits = phylo_splits(trees, rooted);
+    SEXP rf = PROTECT(allocMatrix(INTSXP, n, n));
+    phy_splits_rf(splits, INTEGER(nthreads)[0], INTEGER(rf));
+    phy_splits_free(splits);
+    UNPROTECT(1);
+    return rf;
+}
+
+
+/* The tip labels of each split of the trees and the number of trees
+** containing it */
+SEXP phylo_phy_clade_freq(SEXP trees, SEXP rooted)
+{
+    int i;
+    int j;
+    int k;
+    struct phy_splits *splits = phylo_splits(trees, rooted);
+    int nsplit = phy_splits_nsplit(splits);
+    int *bit = (int *)R_alloc(phy_splits_ntip(splits), sizeof(int));
+
+    SEXP ret = PROTECT(allocVector(VECSXP, 2));
+    SEXP clades = allocVector(VECSXP, nsplit);
+    SET_VECTOR_ELT(ret, 0, clades);
+    SEXP count = allocVector(INTSXP, nsplit);
+    SET_VECTOR_ELT(ret, 1, count);
+
+    for (i = 0; i < nsplit; ++i) {
+        k = phy_splits_tips(splits, i, bit);
+        SEXP clade = allocVector(STRSXP, k);
+        SET_VECTOR_ELT(clades, i, clade);
+        for (j = 0; j < k; ++j)
+            SET_STRING_ELT(clade, j, mkChar(phy_splits_label(splits, bit[j])));
+        INTEGER(count)[i] = phy_splits_count(splits, i);
+    }
+
+    phy_splits_free(splits);
+    UNPROTECT(1);
+    return ret;
+}
+
+
+/* The tip-to-tip distance matrix, or NULL after writing it to file when
+** one is given */
+SEXP phylo_phy_patristic(SEXP rtree, SEXP file, SEXP nthreads)
+{
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    int n = phy_ntip(phy);
+
+    if (!isNull(file)) {
+        if (phy_patristic_write(phy, CHAR(STRING_ELT(file, 0)),
+            INTEGER(nthreads)[0]))
+            error(phy_errmsg());
+        return R_NilValue;
+    }
+
+    SEXP d = PROTECT(allocMatrix(REALSXP, n, n));
+    if (phy_patristic(phy, 0, n, REAL(d), INTEGER(nthreads)[0])) {
+        UNPROTECT(1);
+        error(phy_errmsg());
+    }
+    UNPROTECT(1);
+    return d;
+}
+
+
+/* The tip variance-covariance matrix, or NULL after writing it to file
+** when one is given */
+SEXP phylo_phy_vcv(SEXP rtree, SEXP file, SEXP nthreads)
+{
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    int n = phy_ntip(phy);
+
+    if (!isNull(file)) {
+        if (phy_vcv_write(phy, CHAR(STRING_ELT(file, 0)),
+            INTEGER(nthreads)[0]))
+            error(phy_errmsg());
+        return R_NilValue;
+    }
+
+    SEXP v = PROTECT(allocMatrix(REALSXP, n, n));
+    if (phy_vcv(phy, 0, n, REAL(v), INTEGER(nthreads)[0])) {
+        UNPROTECT(1);
+        error(phy_errmsg());
+    }
+    UNPROTECT(1);
+    return v;
+}
+
+
+/* The nonzero entries of the precision matrix of the node states as a
+** list of 1-based row indices, column indices and values */
+SEXP phylo_phy_precision(SEXP rtree)
+{
+    int k;
+    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
+    int m = 3 * phy_nnode(phy) - 2;
+
+    SEXP ret = PROTECT(allocVector(VECSXP, 3));
+    SEXP i = allocVector(INTSXP, m);
+    SET_VECTOR_ELT(ret, 0, i);
+    SEXP j = allocVector(INTSXP, m);
+    SET_VECTOR_ELT(ret, 1, j);
+    SEXP x = allocVector(REALSXP, m);
+    SET_VECTOR_ELT(ret, 2, x);
+
+    if (phy_precision(phy, INTEGER(i), INTEGER(j), REAL(x))) {
+        UNPROTECT(1);
+        error(phy_errmsg());
+    }
+    for (k = 0; k < m; ++k) {
+        INTEGER(i)[k] += 1;
+        INTEGER(j)[k] += 1;
+    }
+
+    UNPROTECT(1);
+    return ret;
+}
@@ -3,172 +3,121 @@
 #include "phy.h"
 
 
-SEXP phylo_plot_cartesian(SEXP rtree, SEXP ages, SEXP direction)
+static void phylo_layout_free(SEXP rlayout)
+{
+    phy_layout_free((struct phy_layout *)R_ExternalPtrAddr(rlayout));
+    R_ClearExternalPtr(rlayout);
+}
+
+
+SEXP phylo_plot_layout(SEXP rtree)
+{
+    struct phy_layout *layout = phy_layout_new(
+        (struct phy *)R_ExternalPtrAddr(rtree));
+    if (!layout)
+        error(phy_errmsg());
+    SEXP rlayout = PROTECT(R_MakeExternalPtr(layout, R_NilValue, R_NilValue));
+    R_RegisterCFinalizer(rlayout, &phylo_layout_free);
+    UNPROTECT(1);
+    return rlayout;
+}
+
+
+/* Bring the collapsed clades of a layout in line with the node indices in
+** collapse. Only clades whose state changes are visited. */
+static void phylo_layout_sync(struct phy_layout *layout, SEXP collapse)
 {
-    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
     int i;
-    int d = INTEGER(direction)[0];
-    int nnode = phy_nnode(phy);
-    int ntip = phy_ntip(phy);
-
-    SEXP coord = PROTECT(allocMatrix(REALSXP, nnode, 4));
-    SEXP bar = PROTECT(allocMatrix(REALSXP, (nnode-ntip),  4));
-
-    double a;
-    double b;
-    double *segs = REAL(coord);
-    double *bars = REAL(bar);
-    double *age = REAL(ages);
-    struct phy_node *lf;
-    struct phy_node *rt;
-    struct phy_node *node;
-    struct phy_cursor *cursor;
-
-    double ypos = ntip;
-    double maxage = 0;
-
-    for (i = 0; i < nnode; ++i)
+    int n = LENGTH(collapse);
+    char *want = R_alloc(layout->nnode, 1);
+
+    memset(want, 0, layout->nnode);
+    for (i = 0; i < n; ++i)
     {
-        if (age[i] > maxage)
-            maxage = age[i];
+        if (INTEGER(collapse)[i] >= 1 && INTEGER(collapse)[i] <= layout->nnode)
+            want[INTEGER(collapse)[i] - 1] = 1;
     }
+    for (i = layout->ntip; i < layout->nnode; ++i)
+    {
+        if (!want[i] != !(layout->state[i] & PHY_LAYOUT_COLLAPSED))
+            phy_layout_collapse(layout, i, want[i]);
+    }
+}
+
 
-    cursor = phy_cursor_prepare(phy, phy_root(phy), ALL_NODES, POSTORDER);
+#define NOT_DRAWN (PHY_LAYOUT_HIDDEN | PHY_LAYOUT_CULLED)
+#define AS_WEDGE (PHY_LAYOUT_COLLAPSED | PHY_LAYOUT_WEDGE)
 
-    while ((node = phy_cursor_step(cursor)) != 0)
+
+/* The direction-free coordinates of a layout, with the clades in collapse
+** drawn as wedges. cull is either NULL or the window and pixel size passed
+** to phy_layout_cull, as c(breadth min, breadth max, depth min, depth max,
+** pixel breadth, pixel depth). Returns a list of
+**   - a matrix of the index, age, branch base, position and bar extent of
+**     every node that is drawn (NA for edges and bars that are not);
+**   - a matrix of the node, apex age, apex position, reach and terminal
+**     span of every wedge. */
+SEXP phylo_plot_coords(SEXP rlayout, SEXP collapse, SEXP cull)
+{
+    int i;
+    int j;
+    int k;
+    int ndrawn;
+    int nwedge = 0;
+    struct phy_layout *layout = (struct phy_layout *)R_ExternalPtrAddr(
+        rlayout);
+    int n = layout->nnode;
+    unsigned char *state = layout->state;
+
+    phylo_layout_sync(layout, collapse);
+    if (isNull(cull))
+        ndrawn = phy_layout_cull(layout, NULL, 0, 0);
+    else
+        ndrawn = phy_layout_cull(layout, REAL(cull), REAL(cull)[4],
+            REAL(cull)[5]);
+    for (i = layout->ntip; i < n; ++i)
     {
-        i = phy_node_index(node);
-        lf = phy_node_lfdesc(node);
-        rt = phy_node_rtdesc(node);
-        switch (d)
-        {
-            case 0:
-                segs[i + 0 * nnode] = age[i];                        // x0
-                segs[i + 1 * nnode] = age[i] - phy_node_brlen(node); // x1
-                if (phy_node_istip(node))
-                {
-                    segs[i + 2 * nnode] = ypos;                 // y0
-                    segs[i + 3 * nnode] = ypos--;               // y1
-                }
-                else
-                {
-                    a = segs[phy_node_index(lf) + 2 * nnode];
-                    b = segs[phy_node_index(rt) + 2 * nnode];
-                    segs[i + 2 * nnode] = (a + b) / 2;
-                    segs[i + 3 * nnode] = (a + b) / 2;
-                    bars[(i-ntip) + 0 * (nnode-ntip)] = age[i];
-                    bars[(i-ntip) + 1 * (nnode-ntip)] = age[i];
-                    bars[(i-ntip) + 2 * (nnode-ntip)] = a;
-                    bars[(i-ntip) + 3 * (nnode-ntip)] = b;
-                }
-                break;
-            case 1:
-                segs[i + 0 * nnode] = maxage - age[i];
-                segs[i + 1 * nnode] = maxage - age[i] + phy_node_brlen(node);
-                if (phy_node_istip(node))
-                {
-                    segs[i + 2 * nnode] = ypos;
-                    segs[i + 3 * nnode] = ypos--;
-                }
-                else
-                {
-                    a = segs[phy_node_index(lf) + 2 * nnode];
-                    b = segs[phy_node_index(rt) + 2 * nnode];
-                    segs[i + 2 * nnode] = (a + b) / 2;
-                    segs[i + 3 * nnode] = (a + b) / 2;
-                    bars[(i-ntip) + 0 * (nnode-ntip)] = maxage - age[i];
-                    bars[(i-ntip) + 1 * (nnode-ntip)] = maxage - age[i];
-                    bars[(i-ntip) + 2 * (nnode-ntip)] = a;
-                    bars[(i-ntip) + 3 * (nnode-ntip)] = b;
-                }
-                break;
-            case 2:
-                segs[i + 2 * nnode] = age[i];
-                segs[i + 3 * nnode] = age[i] - phy_node_brlen(node);
-                if (phy_node_istip(node))
-                {
-                    segs[i + 0 * nnode] = ypos;
-                    segs[i + 1 * nnode] = ypos--;
-                }
-                else
-                {
-                    a = segs[phy_node_index(lf) + 0 * nnode];
-                    b = segs[phy_node_index(rt) + 0 * nnode];
-                    segs[i + 0 * nnode] = (a + b) / 2;
-                    segs[i + 1 * nnode] = (a + b) / 2;
-                    bars[(i-ntip) + 2 * (nnode-ntip)] = age[i];
-                    bars[(i-ntip) + 3 * (nnode-ntip)] = age[i];
-                    bars[(i-ntip) + 0 * (nnode-ntip)] = a;
-                    bars[(i-ntip) + 1 * (nnode-ntip)] = b;
-                }
-                break;
-            case 3:
-                segs[i + 2 * nnode] = maxage - age[i];
-                segs[i + 3 * nnode] = maxage - age[i] + phy_node_brlen(node);
-                if (phy_node_istip(node))
-                {
-                    segs[i + 0 * nnode] = ypos;
-                    segs[i + 1 * nnode] = ypos--;
-                }
-                else
-                {
-                    a = segs[phy_node_index(lf) + 0 * nnode];
-                    b = segs[phy_node_index(rt) + 0 * nnode];
-                    segs[i + 0 * nnode] = (a + b) / 2;
-                    segs[i + 1 * nnode] = (a + b) / 2;
-                    bars[(i-ntip) + 2 * (nnode-ntip)] = maxage - age[i];
-                    bars[(i-ntip) + 3 * (nnode-ntip)] = maxage - age[i];
-                    bars[(i-ntip) + 0 * (nnode-ntip)] = a;
-                    bars[(i-ntip) + 1 * (nnode-ntip)] = b;
-                }
-                break;
-        }
+        if ((state[i] & AS_WEDGE) && !(state[i] & NOT_DRAWN))
+            nwedge++;
     }
+
     SEXP ret = PROTECT(allocVector(VECSXP, 2));
+    SEXP coord = allocMatrix(REALSXP, ndrawn, 6);
     SET_VECTOR_ELT(ret, 0, coord);
-    SET_VECTOR_ELT(ret, 1, bar);
-    UNPROTECT(3);
-    return ret;
-}
+    SEXP wedge = allocMatrix(REALSXP, nwedge, 6);
+    SET_VECTOR_ELT(ret, 1, wedge);
 
+    double *c = REAL(coord);
+    double *w = REAL(wedge);
 
-SEXP phylo_plot_polar(SEXP rtree, SEXP step)
-{
-    struct phy *phy = (struct phy *)R_ExternalPtrAddr(rtree);
-    int i;
-    int z = 0;
-    int nnode = phy_nnode(phy);
-    SEXP theta = PROTECT(allocMatrix(REALSXP, nnode, 3));
-    double *th = REAL(theta);
-    double a, b, vstep = REAL(step)[0];
-    struct phy_node *lf;
-    struct phy_node *rt;
-    struct phy_node *node;
-    struct phy_cursor *cursor;
-
-    cursor = phy_cursor_prepare(phy, phy_root(phy), ALL_NODES, POSTORDER);
-
-    while ((node = phy_cursor_step(cursor)) != 0)
+    for (i = 0, j = 0, k = 0; i < n; ++i)
     {
-        i = phy_node_index(node);
-        lf = phy_node_lfdesc(node);
-        rt = phy_node_rtdesc(node);
-        if (phy_node_istip(node))
+        if (state[i] & NOT_DRAWN)
+            continue;
+        c[j] = i + 1;
+        c[j + ndrawn] = layout->age[i];
+        c[j + 2*ndrawn] = (state[i] & PHY_LAYOUT_NOEDGE) ?
+            NA_REAL : layout->base[i];
+        c[j + 3*ndrawn] = layout->pos[i];
+        if (state[i] & AS_WEDGE)
         {
-            th[i + 0 * nnode] = vstep * z++;
-            th[i + 1 * nnode] = 0;
-            th[i + 2 * nnode] = 0;
+            c[j + 4*ndrawn] = c[j + 5*ndrawn] = NA_REAL;
+            w[k] = i + 1;
+            w[k + nwedge] = layout->age[i];
+            w[k + 2*nwedge] = layout->pos[i];
+            w[k + 3*nwedge] = layout->reach[i];
+            w[k + 4*nwedge] = layout->pos[layout->first[i]];
+            w[k + 5*nwedge] = layout->pos[layout->last[i]];
+            k++;
         }
         else
         {
-            a = th[phy_node_index(lf)];
-            b = th[phy_node_index(rt)];
-            th[i + 0 * nnode] = (a + b) / 2;
-            th[i + 1 * nnode] = a;
-            th[i + 2 * nnode] = b;
+            c[j + 4*ndrawn] = layout->lo[i];
+            c[j + 5*ndrawn] = layout->hi[i];
         }
+        j++;
     }
+
     UNPROTECT(1);
-    return theta;
+    return ret;
 }
-
@@ -0,0 +1,113 @@
+/* Pruning a clade, freeing the phylogeny it came from and grafting the
+** clade into another tree. Build from the package root with
+**
+**   cc -g -fsanitize=address,undefined -Isrc tests/prune.c src/phy.c \
+**       -o prune -lm
+**
+** and run ./prune, which exits with status 1 on the first failed check.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "phy.h"
+
+
+#define CHECK(x) do { if (!(x)) { \
+    fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #x); \
+    exit(1); } } while (0)
+
+
+static struct phy_node *node(const char *label)
+{
+    struct phy_node *p;
+    CHECK(phy_node_alloc(&p) == 0);
+    phy_node_set_label(p, label);
+    phy_node_set_brlen(p, 1);
+    return p;
+}
+
+
+static struct phy_node *join(
+    const char *label, struct phy_node *a, struct phy_node *b)
+{
+    struct phy_node *p = node(label);
+    phy_node_add_child(p, a);
+    phy_node_add_child(p, b);
+    return p;
+}
+
+
+static void check_newick(struct phy *phy, const char *want)
+{
+    char *z = phy_write_newickstr(phy);
+    CHECK(z != 0);
+    if (strcmp(z, want))
+    {
+        fprintf(stderr, "got %s, want %s\n", z, want);
+        exit(1);
+    }
+    free(z);
+}
+
+
+int main(void)
+{
+    struct phy *phy;
+    struct phy_node *a, *b, *c, *d, *e, *r;
+
+    // ((A,B)E,(C,D)F)R, pruning E and freeing the tree before E is edited
+    a = node("A");
+    b = node("B");
+    e = join("E", a, b);
+    r = join("R", e, join("F", node("C"), node("D")));
+    phy = phy_build(r, 7, 4);
+    CHECK(phy != 0);
+    check_newick(phy, "((A:1,B:1)E:1,(C:1,D:1)F:1)R:1;");
+
+    CHECK(phy_node_prune(r, e) == e);
+    check_newick(phy, "((C:1,D:1)F:1)R:1;");
+    phy_free(phy);
+
+    // the detached clade is not owned by the freed tree, so these edits
+    // must not reach it
+    CHECK(phy_node_prune(e, a) == a);
+    phy_node_add_child(e, a);
+    c = node("G");
+    phy_node_add_child(e, c);
+
+    // re-graft into a new tree
+    d = node("H");
+    r = join("S", e, d);
+    phy = phy_build(r, 6, 4);
+    CHECK(phy != 0);
+    CHECK(phy_nnode(phy) == 6 && phy_ntip(phy) == 4);
+    check_newick(phy, "((B:1,A:1,G:1)E:1,H:1)S:1;");
+
+    // prune and re-graft within a tree, with the indices refreshed
+    CHECK(phy_node_prune(e, b) == b);
+    phy_node_add_child(r, b);
+    CHECK(phy_refresh(phy) == 0);
+    CHECK(phy_nnode(phy) == 6 && phy_ntip(phy) == 4);
+    CHECK(phy_node_get(phy, phy_node_index(b)) == b);
+    check_newick(phy, "((A:1,G:1)E:1,H:1,B:1)S:1;");
+    phy_free(phy);
+
+    // a pruned clade is left to the caller by phy_free
+    a = node("A");
+    b = node("B");
+    e = join("E", a, b);
+    r = join("R", e, node("C"));
+    phy = phy_build(r, 5, 3);
+    CHECK(phy != 0);
+    CHECK(phy_node_prune(r, e) == e);
+    phy_free(phy);
+    d = node("D");
+    r = join("S", e, d);
+    phy = phy_build(r, 5, 3);
+    CHECK(phy != 0);
+    check_newick(phy, "((A:1,B:1)E:1,D:1)S:1;");
+    phy_free(phy);
+
+    printf("ok\n");
+    return 0;
+}